@@ -0,0 +1,52 @@
+#include "BandParallel.hpp"
+
+#include <algorithm>
+
+int bandCount(const cv::Size &size, int threads)
+{
+    if (size.area() < band_min_pixels) return 1;
+
+    return std::max(1, std::min(threads, size.height / band_min_rows));
+}
+
+// Process the rows [begin, end) of src into dst
+static void runBand(const cv::Mat &src, cv::Mat &dst, int halo, int begin, int end,
+                    const BandOperation &op)
+{
+    // Pixel by pixel operations write straight into dst
+    if (halo == 0)
+    {
+        cv::Mat dstBand = dst.rowRange(begin, end);
+        op(src.rowRange(begin, end), dstBand);
+        return;
+    }
+
+    int haloBegin = std::max(0, begin - halo);
+    int haloEnd = std::min(src.rows, end + halo);
+
+    cv::Mat result;
+    op(src.rowRange(haloBegin, haloEnd), result);
+
+    // Throw away the halo rows
+    cv::Mat dstBand = dst.rowRange(begin, end);
+    result.rowRange(begin - haloBegin, end - haloBegin).copyTo(dstBand);
+}
+
+void runBands(ThreadPool &pool, const cv::Mat &src, cv::Mat &dst, int halo,
+              const BandOperation &op)
+{
+    int bands = bandCount(src.size(), pool.size());
+
+    parallelFor(pool, bands, 2, [&](int first, int last)
+    {
+        for (int band = first; band < last; band++)
+        {
+            int begin = src.rows * band / bands;
+            int end = src.rows * (band + 1) / bands;
+
+            runBand(src, dst, halo, begin, end, op);
+        }
+    });
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,40 @@
+/* Band parallel image operations
+ *
+ * The full image steps of the pipeline work on every pixel, so they are
+ * split into horizontal bands that run as tasks on the thread pool. Kernels
+ * that look at neighbouring pixels (blur, dilate, erode) get extra halo rows
+ * above and below their band, so every output row sees the same neighbours as
+ * it would on the whole image, and the result is the same.
+ *
+ * Small frames are not worth the hand off, so the number of bands is picked
+ * from the frame size: a 320x240 frame stays in one band and bigger frames
+ * get a band per worker.
+ */
+
+#ifndef BANDPARALLEL_HPP
+#define BANDPARALLEL_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "ThreadPool.hpp"
+
+#include <functional>
+
+static constexpr int band_min_pixels = 100000;     // Smaller images are processed in one band
+static constexpr int band_min_rows = 32;           // Bands are never smaller than this
+
+typedef std::function<void(const cv::Mat &, cv::Mat &)> BandOperation;
+
+// The number of bands to split an image of this size into
+int bandCount(const cv::Size &size, int threads);
+
+/* Run op on horizontal bands of src, putting the results in the same rows of
+ * dst. dst has to be created with the output size and type beforehand. halo
+ * is the number of extra source rows op needs above and below a band.
+ */
+void runBands(ThreadPool &pool, const cv::Mat &src, cv::Mat &dst, int halo,
+              const BandOperation &op);
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
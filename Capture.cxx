@@ -0,0 +1,415 @@
+#include "Capture.hpp"
+#include "V4l2Capture.hpp"
+
+#include "opencv2/highgui/highgui.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <sys/stat.h>
+
+// How the fake camera misbehaves, the chances are per frame
+static constexpr double fake_camera_fps = 30;
+static constexpr double fake_stall_chance = 0.003;
+static constexpr double fake_stall_seconds = 3;
+static constexpr double fake_disconnect_chance = 0.003;
+static constexpr double fake_open_failure_chance = 0.3;
+
+static double seconds(const timespec &start, const timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static void sleepSeconds(double time)
+{
+    std::this_thread::sleep_for(std::chrono::duration<double>(time));
+}
+
+// A camera or a video file
+class VideoFrameSource : public FrameSource
+{
+public:
+    VideoFrameSource(const std::string &name_): name(name_) {}
+
+    bool open() { return capture.open(name); }
+    bool grab() { return capture.grab(); }
+    bool retrieve(cv::Mat &frame) { return capture.retrieve(frame) && !frame.empty(); }
+
+    bool live() const
+    {
+        struct stat info;
+        return stat(name.c_str(), &info) != 0 || !S_ISREG(info.st_mode);
+    }
+
+private:
+    std::string name;
+    cv::VideoCapture capture;
+};
+
+/* A file played in a loop at fake_camera_fps as a camera that now and then
+ * fails to connect, stops sending for fake_stall_seconds or drops the
+ * stream, like the Axis camera does on a bad day.
+ */
+class FakeFrameSource : public FrameSource
+{
+public:
+    FakeFrameSource(const std::string &file_):
+        file(file_),
+        random(static_cast<unsigned>(std::chrono::steady_clock::now().time_since_epoch().count())),
+        chance(0, 1)
+    {
+    }
+
+    bool open()
+    {
+        sleepSeconds(0.1);
+
+        if (chance(random) < fake_open_failure_chance) return false;
+
+        if (!video.open(file))
+        {
+            still = cv::imread(file, 1);
+            if (still.empty()) return false;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        return true;
+    }
+
+    bool grab()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        double wait = seconds(now, next);
+
+        if (wait > 0) sleepSeconds(wait);
+        else next = now;
+
+        next.tv_nsec += static_cast<long>(1e9 / fake_camera_fps);
+        next.tv_sec += next.tv_nsec / 1000000000;
+        next.tv_nsec %= 1000000000;
+
+        double roll = chance(random);
+
+        if (roll < fake_disconnect_chance) return false;
+        if (roll < fake_disconnect_chance + fake_stall_chance) sleepSeconds(fake_stall_seconds);
+
+        if (!still.empty())
+        {
+            current = still;
+            return true;
+        }
+
+        // Start over at the end of the file
+        if (video.read(current)) return true;
+
+        video.release();
+        return video.open(file) && video.read(current);
+    }
+
+    bool retrieve(cv::Mat &frame)
+    {
+        current.copyTo(frame);
+        return !frame.empty();
+    }
+
+    bool live() const { return true; }
+
+private:
+    std::string file;
+    cv::VideoCapture video;
+    cv::Mat still;                      // The file when it is an image
+    cv::Mat current;
+    timespec next;                      // When the next frame is due
+    std::mt19937 random;
+    std::uniform_real_distribution<double> chance;
+};
+
+bool FrameSource::lease(FrameLease &frame)
+{
+    std::shared_ptr<cv::Mat> buffer;
+
+    // A buffer only this source holds is free, the pipeline let go of it
+    for (size_t i = 0; i < buffers.size() && !buffer; i++)
+    {
+        if (buffers[i].use_count() == 1) buffer = buffers[i];
+    }
+
+    if (!buffer)
+    {
+        buffer = std::make_shared<cv::Mat>();
+        buffers.push_back(buffer);
+    }
+
+    if (!retrieve(*buffer)) return false;
+
+    frame = buffer;
+    return true;
+}
+
+static bool hasPrefix(const std::string &name, const std::string &prefix)
+{
+    return name.compare(0, prefix.size(), prefix) == 0;
+}
+
+FrameSource *makeFrameSource(const std::string &name)
+{
+    if (hasPrefix(name, "fake:")) return new FakeFrameSource(name.substr(5));
+    if (hasPrefix(name, "v4l2:")) return new V4l2FrameSource(new SystemV4l2Device(name.substr(5)));
+    if (hasPrefix(name, "v4l2mock:")) return new V4l2FrameSource(new MockV4l2Device(name.substr(9)));
+
+    return new VideoFrameSource(name);
+}
+
+const char *captureStateString(CaptureState state)
+{
+    switch (state)
+    {
+        case CAPTURE_CONNECTING:    return "Connecting";
+        case CAPTURE_STREAMING:     return "Streaming";
+        case CAPTURE_STALLED:       return "Stalled";
+        case CAPTURE_DISCONNECTED:  return "Disconnected";
+        case CAPTURE_ENDED:         return "Ended";
+        default:                    return "Unknown";
+    }
+}
+
+/* What the watchdog, the readers and the pipeline share. A reader only
+ * delivers frames while it is the current one, so a reader that was left
+ * behind can't touch anything once it comes back.
+ */
+struct CaptureShared
+{
+    CaptureShared():
+        sequence(0),
+        taken(0),
+        reader(0),
+        failedReader(0),
+        ended(false),
+        stopping(false),
+        state(CAPTURE_CONNECTING)
+    {
+        captureTime.tv_sec = 0;
+        captureTime.tv_nsec = 0;
+    }
+
+    std::mutex lock;
+    std::condition_variable changed;
+
+    FrameLease frame;                   // The newest frame
+    timespec captureTime;
+    unsigned long sequence;             // Counts the frames
+    unsigned long taken;                // The frame the pipeline took last
+
+    unsigned long reader;               // The current reader
+    unsigned long failedReader;         // The last reader whose source failed
+    bool ended;                         // The source of failedReader is a file that ended
+    bool stopping;
+
+    CaptureState state;
+    CaptureStats stats;
+};
+
+/* Open the source and read it until it fails or the reader is left behind.
+ * A camera keeps going and the pipeline gets the newest frame, but a file
+ * waits for every frame to be taken so none are skipped.
+ */
+static void readerLoop(std::shared_ptr<CaptureShared> shared, unsigned long id,
+                       FrameSource *source_, MetricsRegistry *metrics)
+{
+    std::unique_ptr<FrameSource> source(source_);
+    bool live = source->live();
+    bool ok = source->open();
+
+    while (ok)
+    {
+        timespec grabbed, decoded;
+        FrameLease frame;
+
+        ok = source->grab();
+        clock_gettime(CLOCK_MONOTONIC, &grabbed);
+        ok = ok && source->lease(frame);
+        clock_gettime(CLOCK_MONOTONIC, &decoded);
+
+        if (!ok) break;
+
+        std::unique_lock<std::mutex> guard(shared->lock);
+
+        if (shared->reader != id || shared->stopping) return;
+
+        CaptureStats &stats = shared->stats;
+        stats.decodeSeconds = seconds(grabbed, decoded);
+        metrics->observe(HISTOGRAM_CAPTURE_DECODE, stats.decodeSeconds);
+
+        // The gap spans reconnects, it is how long the pipeline had no frame
+        if (shared->sequence)
+        {
+            stats.gapSeconds = seconds(shared->captureTime, grabbed);
+            stats.maxGapSeconds = std::max(stats.maxGapSeconds, stats.gapSeconds);
+            metrics->observe(HISTOGRAM_CAPTURE_GAP, stats.gapSeconds);
+        }
+
+        // A frame the pipeline did not take goes back to the source
+        shared->frame = frame;
+        shared->captureTime = grabbed;
+        shared->sequence++;
+        stats.frames++;
+        metrics->add(COUNTER_FRAMES_IN);
+
+        shared->changed.notify_all();
+
+        if (live) continue;
+
+        shared->changed.wait(guard, [&]
+            {
+                return shared->taken == shared->sequence || shared->reader != id || shared->stopping;
+            });
+    }
+
+    std::lock_guard<std::mutex> guard(shared->lock);
+
+    if (shared->reader != id) return;
+
+    shared->failedReader = id;
+    shared->ended = !source->live();
+    shared->changed.notify_all();
+}
+
+CaptureSource::CaptureSource(const std::string &name_, MetricsRegistry &metrics_)
+    : name(name_), metrics(metrics_), shared(std::make_shared<CaptureShared>())
+{
+}
+
+CaptureSource::~CaptureSource()
+{
+    {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        shared->stopping = true;
+    }
+
+    shared->changed.notify_all();
+
+    if (watchdog.joinable()) watchdog.join();
+}
+
+void CaptureSource::start()
+{
+    if (watchdog.joinable()) return;
+
+    watchdog = std::thread(&CaptureSource::watchdogLoop, this);
+}
+
+/* Start a reader and watch it: a stall or a broken stream leaves it behind
+ * and starts another after the backoff. The state only changes on what the
+ * readers do, so it stays stalled or disconnected until a frame comes in.
+ */
+void CaptureSource::watchdogLoop()
+{
+    std::unique_lock<std::mutex> guard(shared->lock);
+    double backoff = capture_backoff_min;
+
+    while (!shared->stopping)
+    {
+        unsigned long id = ++shared->reader;
+        unsigned long seen = shared->sequence;
+        double timeout = capture_open_timeout;
+        bool streamed = false;
+
+        FrameSource *source = makeFrameSource(name);
+        bool live = source->live();
+
+        std::thread(readerLoop, shared, id, source, &metrics).detach();
+
+        while (true)
+        {
+            bool woke = shared->changed.wait_for(guard, std::chrono::duration<double>(timeout), [&]
+                {
+                    return shared->stopping || shared->sequence != seen || shared->failedReader == id;
+                });
+
+            if (shared->stopping) return;
+
+            if (!woke)
+            {
+                shared->state = CAPTURE_STALLED;
+                shared->stats.stalls++;
+                metrics.add(COUNTER_CAPTURE_STALLS);
+                break;
+            }
+
+            if (shared->sequence != seen)
+            {
+                seen = shared->sequence;
+                shared->state = CAPTURE_STREAMING;
+                streamed = true;
+
+                // A file waits for the pipeline, which may be paused
+                timeout = live ? capture_read_timeout : 1e9;
+                continue;
+            }
+
+            if (shared->ended)
+            {
+                shared->state = CAPTURE_ENDED;
+                shared->changed.notify_all();
+                return;
+            }
+
+            shared->state = CAPTURE_DISCONNECTED;
+            break;
+        }
+
+        // Leave the reader behind
+        shared->reader++;
+        shared->changed.notify_all();
+
+        if (streamed) backoff = capture_backoff_min;
+
+        shared->changed.wait_for(guard, std::chrono::duration<double>(backoff), [this]
+            {
+                return shared->stopping;
+            });
+
+        backoff = std::min(2 * backoff, capture_backoff_max);
+        shared->stats.reconnects++;
+        metrics.add(COUNTER_CAPTURE_RECONNECTS);
+    }
+}
+
+bool CaptureSource::take(FrameLease &frame, timespec &captureTime, double timeout)
+{
+    std::unique_lock<std::mutex> guard(shared->lock);
+
+    shared->changed.wait_for(guard, std::chrono::duration<double>(timeout), [this]
+        {
+            return shared->sequence != shared->taken || shared->state == CAPTURE_ENDED || shared->stopping;
+        });
+
+    if (shared->sequence == shared->taken) return false;
+
+    // The frames in between came in faster than the pipeline took them
+    if (shared->taken) metrics.add(COUNTER_FRAMES_DROPPED, shared->sequence - shared->taken - 1);
+
+    frame = shared->frame;
+    captureTime = shared->captureTime;
+    shared->taken = shared->sequence;
+    shared->changed.notify_all();
+
+    return true;
+}
+
+CaptureState CaptureSource::state() const
+{
+    std::lock_guard<std::mutex> guard(shared->lock);
+    return shared->state;
+}
+
+CaptureStats CaptureSource::stats() const
+{
+    std::lock_guard<std::mutex> guard(shared->lock);
+    return shared->stats;
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,148 @@
+/* Robust frame capture
+ *
+ * VideoCapture::grab() blocks for as long as the camera takes to send a
+ * frame, which is forever when the Axis camera drops off the network the
+ * wrong way, and a grab that failed used to end the program. A
+ * CaptureSource instead reads its camera on a thread of its own and hands
+ * the newest frame over, so the pipeline never waits longer than it asks to
+ * and sees a state rather than a hang when there is no frame.
+ *
+ * A watchdog thread looks after the reader. A camera that sends no frame
+ * for capture_read_timeout counts as a stall, and one whose stream breaks
+ * as a disconnect; either way the watchdog connects again with a fresh
+ * reader, waiting capture_backoff_min seconds, then twice as long after
+ * every attempt that gets no frame up to capture_backoff_max. A reader
+ * stuck inside VideoCapture can't be stopped, so it is left behind and
+ * exits on its own once the call returns. A file is read no faster than
+ * the pipeline takes its frames, and simply ends.
+ *
+ * Sources named fake:<file> play the video or image file in a loop as a
+ * camera that stalls, disconnects and fails to connect now and then, to
+ * exercise all of this at the bench.
+ */
+
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "Metrics.hpp"
+
+#include <condition_variable>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr double capture_open_timeout = 5;       // Seconds to connect and get the first frame
+static constexpr double capture_read_timeout = 1;       // Seconds without a frame that make a stall
+static constexpr double capture_backoff_min = 0.25;     // Seconds before connecting again
+static constexpr double capture_backoff_max = 8;
+
+enum CaptureState
+{
+    CAPTURE_CONNECTING,                 // Opening the source, no frame yet
+    CAPTURE_STREAMING,                  // Frames are coming in
+    CAPTURE_STALLED,                    // No frame for capture_read_timeout, connecting again
+    CAPTURE_DISCONNECTED,               // The stream broke, connecting again
+    CAPTURE_ENDED                       // A file is out of frames
+};
+
+// What the capture has seen so far
+struct CaptureStats
+{
+    CaptureStats():
+        frames(0),
+        stalls(0),
+        reconnects(0),
+        decodeSeconds(0),
+        gapSeconds(0),
+        maxGapSeconds(0)
+    {
+    }
+
+    unsigned long frames;
+    unsigned long stalls;
+    unsigned long reconnects;
+    double decodeSeconds;               // Retrieving the last frame
+    double gapSeconds;                  // Between the last two frames
+    double maxGapSeconds;
+};
+
+/* A frame held by the pipeline. The image may be a header on a buffer of
+ * the source, which only gets the buffer back once every copy of the
+ * pointer is gone, so nothing may keep the image data past that. Frames
+ * are BGR (CV_8UC3), YUYV (CV_8UC2) or I420 (CV_8UC1, the U and V planes
+ * packed under the Y plane, so 3/2 the rows of the image).
+ */
+typedef std::shared_ptr<const cv::Mat> FrameLease;
+
+/* Where frames come from, the same calls as VideoCapture so a camera can be
+ * swapped for a fake one. A source is used by one reader thread.
+ */
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    virtual bool open() = 0;
+    virtual bool grab() = 0;
+    virtual bool retrieve(cv::Mat &frame) = 0;
+
+    /* Hand out the grabbed frame. By default it is retrieved into one of
+     * the buffers no lease holds any more; a source with buffers of its own
+     * can lend those out instead.
+     */
+    virtual bool lease(FrameLease &frame);
+
+    // False for a file, which is not connected again once it ends
+    virtual bool live() const = 0;
+
+private:
+    std::vector<std::shared_ptr<cv::Mat> > buffers;
+};
+
+/* A VideoCapture for the name, the fake camera for fake:<file>, or the V4L2
+ * device for v4l2:<device> and v4l2mock:<file>, see V4l2Capture.hpp
+ */
+FrameSource *makeFrameSource(const std::string &name);
+
+const char *captureStateString(CaptureState state);
+
+struct CaptureShared;
+
+class CaptureSource
+{
+public:
+    CaptureSource(const std::string &name, MetricsRegistry &metrics);
+    ~CaptureSource();
+
+    // Start reading frames
+    void start();
+
+    /* Take the newest frame if there is one newer than the one taken last,
+     * waiting at most timeout seconds for it. Returns false and leaves the
+     * frame alone when there is none.
+     */
+    bool take(FrameLease &frame, timespec &captureTime, double timeout);
+
+    CaptureState state() const;
+    CaptureStats stats() const;
+
+private:
+    CaptureSource(const CaptureSource &);
+    CaptureSource &operator=(const CaptureSource &);
+
+    void watchdogLoop();
+
+    std::string name;
+    MetricsRegistry &metrics;
+    std::shared_ptr<CaptureShared> shared;      // Also held by the reader threads
+    std::thread watchdog;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
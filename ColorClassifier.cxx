@@ -0,0 +1,112 @@
+#include "ColorClassifier.hpp"
+
+#include <algorithm>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+static constexpr int color_lut_shift = 8 - color_lut_bits;
+
+// The table cell of a pixel, its three bytes in the order they are in memory
+static inline int tableIndex(const uint8_t *pixel)
+{
+    return ((pixel[0] >> color_lut_shift) << (2 * color_lut_bits)) |
+           ((pixel[1] >> color_lut_shift) << color_lut_bits) |
+           (pixel[2] >> color_lut_shift);
+}
+
+ColorClassifier::ColorClassifier()
+    : table(color_lut_levels * color_lut_levels * color_lut_levels + 3, 0), builds(0)
+{
+}
+
+void ColorClassifier::buildHsv(int hueMin, int hueMax, int saturationMin, int valueMin,
+                               int bluePlane, int greenPlane, int redPlane)
+{
+    static constexpr int half = (1 << color_lut_shift) / 2;
+    uint8_t pixel[3];
+
+    for (int i = 0; i < color_lut_levels * color_lut_levels * color_lut_levels; i++)
+    {
+        // The color in the middle of the cell
+        pixel[0] = static_cast<uint8_t>((((i >> (2 * color_lut_bits)) & (color_lut_levels - 1)) << color_lut_shift) + half);
+        pixel[1] = static_cast<uint8_t>((((i >> color_lut_bits) & (color_lut_levels - 1)) << color_lut_shift) + half);
+        pixel[2] = static_cast<uint8_t>(((i & (color_lut_levels - 1)) << color_lut_shift) + half);
+
+        int blue = pixel[bluePlane];
+        int green = pixel[greenPlane];
+        int red = pixel[redPlane];
+
+        // cvtColor(CV_BGR2HSV) on 8 bit images
+        int value = std::max(blue, std::max(green, red));
+        int range = value - std::min(blue, std::min(green, red));
+        int saturation = value ? range * 255 / value : 0;
+        int hue = 0;
+
+        if (range)
+        {
+            if (value == red) hue = 60 * (green - blue) / range;
+            else if (value == green) hue = 120 + 60 * (blue - red) / range;
+            else hue = 240 + 60 * (red - green) / range;
+
+            if (hue < 0) hue += 360;
+
+            hue /= 2;
+        }
+
+        bool hueInside = hueMin <= hueMax ? hue >= hueMin && hue <= hueMax : hue >= hueMin || hue <= hueMax;
+
+        table[i] = hueInside && saturation >= saturationMin && value >= valueMin ? 255 : 0;
+    }
+
+    builds++;
+}
+
+void ColorClassifier::classify(const cv::Mat &in, cv::Mat &out) const
+{
+    const uint8_t *lut = &table[0];
+
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uint8_t *pixels = in.ptr(y);
+        uint8_t *mask = out.ptr(y);
+        int x = 0;
+
+#ifdef __AVX2__
+        /* Eight pixels at a time. The 24 bytes of the pixels are split over
+         * the two lanes, spread out to one pixel per 32 bit element, turned
+         * into table indices and gathered. The 32 byte loads stop 8 bytes
+         * short of the end of the row.
+         */
+        const __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+        const __m256i unpack = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                                0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+        const __m256i pack = _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                              0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m256i lanes = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+        const __m256i levelMask = _mm256_set1_epi32(color_lut_levels - 1);
+
+        for (; 3 * x + 32 <= 3 * in.cols; x += 8)
+        {
+            __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pixels + 3 * x));
+            __m256i pixel = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(bytes, spread), unpack);
+
+            __m256i first = _mm256_and_si256(_mm256_srli_epi32(pixel, color_lut_shift), levelMask);
+            __m256i second = _mm256_and_si256(_mm256_srli_epi32(pixel, 8 + color_lut_shift), levelMask);
+            __m256i third = _mm256_and_si256(_mm256_srli_epi32(pixel, 16 + color_lut_shift), levelMask);
+            __m256i index = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(first, 2 * color_lut_bits),
+                                                            _mm256_slli_epi32(second, color_lut_bits)), third);
+
+            __m256i classes = _mm256_i32gather_epi32(reinterpret_cast<const int *>(lut), index, 1);
+            __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(classes, pack), lanes);
+
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(mask + x), _mm256_castsi256_si128(packed));
+        }
+#endif
+
+        for (; x < in.cols; x++) mask[x] = lut[tableIndex(pixels + 3 * x)];
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
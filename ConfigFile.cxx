@@ -0,0 +1,132 @@
+#include "ConfigFile.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/stat.h>
+
+ConfigFile::ConfigFile(const ConfigParameter *parameters_, int count_)
+    : parameters(parameters_), count(count_), lastCheck(0)
+{
+    loadedTime.tv_sec = 0;
+    loadedTime.tv_nsec = 0;
+}
+
+bool ConfigFile::modified(timespec &modifiedTime) const
+{
+    struct stat info;
+
+    if (stat(fileName.c_str(), &info) < 0) return false;
+
+    modifiedTime = info.st_mtim;
+
+    return modifiedTime.tv_sec != loadedTime.tv_sec || modifiedTime.tv_nsec != loadedTime.tv_nsec;
+}
+
+bool ConfigFile::load(const char *name)
+{
+    fileName = name;
+
+    // Remember which version of the file this is, to notice the next one
+    modified(loadedTime);
+
+    FILE *file = fopen(name, "r");
+
+    if (!file)
+    {
+        perror(name);
+        return false;
+    }
+
+    // Everything is checked before anything is applied
+    std::vector<int> values(count);
+    std::vector<bool> given(count, false);
+    char line[256];
+    int lineNumber = 0;
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+
+        char key[64];
+        char value[64];
+        char extra[2];
+
+        int fields = sscanf(line, " %63[^= \t\n] = %63s %1s", key, value, extra);
+
+        if (fields == EOF) continue;
+
+        if (fields != 2)
+        {
+            printf("%s:%d: expected name = value\n", name, lineNumber);
+            ok = false;
+            continue;
+        }
+
+        int i = 0;
+
+        while (i < count && strcmp(parameters[i].name, key) != 0) i++;
+
+        if (i == count)
+        {
+            printf("%s:%d: unknown parameter %s\n", name, lineNumber, key);
+            ok = false;
+            continue;
+        }
+
+        char *end;
+        errno = 0;
+        long number = strtol(value, &end, 10);
+
+        if (*end || errno || number < parameters[i].minimum || number > parameters[i].maximum)
+        {
+            printf("%s:%d: %s must be a number from %d to %d\n", name, lineNumber, key,
+                   parameters[i].minimum, parameters[i].maximum);
+            ok = false;
+            continue;
+        }
+
+        values[i] = static_cast<int>(number);
+        given[i] = true;
+    }
+
+    fclose(file);
+
+    if (!ok)
+    {
+        printf("Keeping the old settings, %s has errors\n", name);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (given[i]) *parameters[i].value = values[i];
+    }
+
+    return true;
+}
+
+bool ConfigFile::reload(double now)
+{
+    if (fileName.empty() || now - lastCheck < config_check_interval) return false;
+
+    lastCheck = now;
+
+    timespec modifiedTime;
+
+    if (!modified(modifiedTime)) return false;
+
+    printf("Reading %s again\n", fileName.c_str());
+
+    // A file with errors is not read again until it is saved again
+    std::string name(fileName);
+    return load(name.c_str());
+}
+
+// vim:set ts=2 sw=2 bs=2:
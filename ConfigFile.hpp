@@ -0,0 +1,60 @@
+/* Tuning parameters from a configuration file
+ *
+ * With --config file the tuning parameters are read from a file of
+ * "name = value" lines, "#" starts a comment. The file is watched while
+ * vision runs: when it is saved, it is read again and the new values are
+ * applied between two frames, all of them or none of them if any line is
+ * wrong, so a frame never sees half of an edit.
+ *
+ * The parameters are plain ints owned by someone else (the trackbars work on
+ * them too), the ConfigFile only knows their names, where they live and
+ * their ranges.
+ */
+
+#ifndef CONFIGFILE_HPP
+#define CONFIGFILE_HPP
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+static constexpr double config_check_interval = 0.5;     // Seconds between looks at the file
+
+struct ConfigParameter
+{
+    const char *name;
+    int *value;
+    int minimum;
+    int maximum;
+};
+
+class ConfigFile
+{
+public:
+    ConfigFile(const ConfigParameter *parameters, int count);
+
+    /* Read the file and apply every value in it. Returns false, and leaves
+     * every parameter as it was, if the file can't be read or has a line
+     * that is not a known parameter with a value in its range.
+     */
+    bool load(const char *fileName);
+
+    /* Read the file again if it changed since the last look and enough time
+     * went by. Returns true if new values were applied.
+     */
+    bool reload(double now);
+
+private:
+    bool modified(timespec &modifiedTime) const;
+
+    const ConfigParameter *parameters;
+    int count;
+
+    std::string fileName;
+    timespec loadedTime;                // Modification time of the file when it was read
+    double lastCheck;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
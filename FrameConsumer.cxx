@@ -0,0 +1,128 @@
+/* frame_consumer: reads the frames vision shares with --shareFrames
+ *
+ * Attaches to the frame ring of a camera and reads every frame in place.
+ * Every second it prints how many frames it read, how many it missed
+ * because it fell behind, how many were overwritten while being read, and
+ * how old the frames were when it got them. With -s it shows the frames.
+ *
+ * Usage: frame_consumer [-s] [camera]
+ */
+
+#include "FrameRing.hpp"
+
+#include "opencv2/highgui/highgui.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <unistd.h>
+
+static double monotonicSeconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    bool show = false;
+    int camera = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0) show = true;
+        else camera = atoi(argv[i]);
+    }
+
+    std::string name = frameRingName(camera);
+    FrameRingReader reader;
+
+    printf("Waiting for %s\n", name.c_str());
+
+    uint32_t next = 0;
+    int read = 0, missed = 0, torn = 0, targets = 0;
+    double age = 0;
+    double lastReport = monotonicSeconds();
+    double lastFrame = 0;
+
+    while (true)
+    {
+        // Attach, or attach again when vision restarted and nothing new comes in
+        if (monotonicSeconds() - lastFrame > 2)
+        {
+            if (reader.open(name)) next = reader.published();
+
+            lastFrame = monotonicSeconds();
+        }
+
+        uint32_t published = reader.published();
+
+        if (next >= published)
+        {
+            usleep(1000);
+        }
+        else
+        {
+            // Skip to the oldest frame still in the ring
+            if (published - next > frame_ring_slots)
+            {
+                missed += published - next - frame_ring_slots;
+                next = published - frame_ring_slots;
+            }
+
+            cv::Mat image, shown;
+            const FrameRingInfo *info;
+            uint32_t sequence;
+
+            if (reader.begin(next, image, info, sequence))
+            {
+                // Work on the frame in place
+                cv::Scalar brightness = cv::mean(image);
+                int frameTargets = info->targetCount;
+                double frameAge = monotonicSeconds() - info->captureTime * 1e-9;
+
+                if (show) image.copyTo(shown);
+
+                if (reader.end(next, sequence))
+                {
+                    if (show) cv::imshow(name, shown);
+
+                    read++;
+                    targets = frameTargets;
+                    age += frameAge;
+                    (void)brightness;
+                }
+                else
+                {
+                    torn++;
+                }
+            }
+            else
+            {
+                torn++;
+            }
+
+            next++;
+            lastFrame = monotonicSeconds();
+        }
+
+        if (show) cv::waitKey(1);
+
+        double now = monotonicSeconds();
+
+        if (now - lastReport >= 1)
+        {
+            printf("%d frames read, %d missed, %d torn, %d targets, age %.2f ms\n",
+                   read, missed, torn, targets, read ? age * 1000 / read : 0.0);
+
+            read = missed = torn = 0;
+            age = 0;
+            lastReport = now;
+        }
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
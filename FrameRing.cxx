@@ -0,0 +1,292 @@
+#include "FrameRing.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Everything in the ring starts on a cache line
+static size_t alignLine(size_t bytes)
+{
+    return (bytes + 63) & ~static_cast<size_t>(63);
+}
+
+std::string frameRingName(int camera)
+{
+    char name[64];
+
+    if (camera == 0) snprintf(name, sizeof(name), "/vision-frames");
+    else snprintf(name, sizeof(name), "/vision-frames-%d", camera);
+
+    return name;
+}
+
+FrameRingWriter::FrameRingWriter()
+    : memory(0), size(0), lastFrame(0)
+{
+}
+
+FrameRingWriter::~FrameRingWriter()
+{
+    if (!memory) return;
+
+    munmap(memory, size);
+    shm_unlink(name.c_str());
+}
+
+bool FrameRingWriter::open(const std::string &name_, size_t pixelBytes)
+{
+    name = name_;
+
+    size_t pixelOffset = alignLine(sizeof(FrameRingSlot));
+    size_t slotBytes = pixelOffset + alignLine(pixelBytes);
+    size = alignLine(sizeof(FrameRingHeader)) + frame_ring_slots * slotBytes;
+
+    /* Start with a new ring, readers of an old one keep their mapping and
+     * notice that nothing new comes in.
+     */
+    shm_unlink(name.c_str());
+
+    int file = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+
+    if (file < 0)
+    {
+        perror("shm_open");
+        return false;
+    }
+
+    if (ftruncate(file, static_cast<off_t>(size)) < 0)
+    {
+        perror("ftruncate");
+        ::close(file);
+        return false;
+    }
+
+    memory = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    ::close(file);
+
+    if (memory == MAP_FAILED)
+    {
+        perror("mmap");
+        memory = 0;
+        return false;
+    }
+
+    FrameRingHeader *header = static_cast<FrameRingHeader *>(memory);
+    header->version = frame_ring_version;
+    header->slots = frame_ring_slots;
+    header->slotBytes = static_cast<uint32_t>(slotBytes);
+    header->pixelOffset = static_cast<uint32_t>(pixelOffset);
+    header->pixelBytes = static_cast<uint32_t>(alignLine(pixelBytes));
+    header->published.store(0, std::memory_order_relaxed);
+
+    // The magic number goes in last, a reader seeing it sees the rest
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = frame_ring_magic;
+
+    return true;
+}
+
+void FrameRingWriter::publish(const cv::Mat &image, unsigned long frameNumber, const timespec &captureTime,
+                              int camera, const TargetBatch &targets, const TargetGroup &targetGroup)
+{
+    if (!memory || frameNumber == lastFrame) return;
+
+    lastFrame = frameNumber;
+
+    FrameRingHeader *header = static_cast<FrameRingHeader *>(memory);
+    size_t rowBytes = image.cols * image.elemSize();
+
+    if (rowBytes * image.rows > header->pixelBytes) return;
+
+    uint32_t frame = header->published.load(std::memory_order_relaxed);
+    char *slotMemory = static_cast<char *>(memory) + alignLine(sizeof(FrameRingHeader)) +
+                       (frame % header->slots) * header->slotBytes;
+    FrameRingSlot *slot = reinterpret_cast<FrameRingSlot *>(slotMemory);
+
+    // Odd while we write, and readers must see that before any of the new data
+    uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    FrameRingInfo &info = slot->info;
+    info.frameNumber = frameNumber;
+    info.captureTime = static_cast<int64_t>(captureTime.tv_sec) * 1000000000 + captureTime.tv_nsec;
+    info.camera = camera;
+    info.rows = image.rows;
+    info.cols = image.cols;
+    info.type = image.type();
+    info.step = static_cast<int32_t>(rowBytes);
+    info.targetCount = targets.count;
+
+    for (int i = 0; i < targets.count; i++)
+    {
+        FrameRingTarget &target = info.targets[i];
+
+        target.targetType = targets.targetType[i];
+        target.centerX = targets.centerX[i];
+        target.centerY = targets.centerY[i];
+        target.sizeX = targets.sizeX[i];
+        target.sizeY = targets.sizeY[i];
+        target.distanceX = targets.distanceX[i];
+        target.distanceY = targets.distanceY[i];
+        target.angleX = targets.angleX[i];
+
+        for (int j = 0; j < 4; j++)
+        {
+            target.cornerX[j] = targets.cornerX[j][i];
+            target.cornerY[j] = targets.cornerY[j][i];
+        }
+    }
+
+    info.high = targetGroup.high;
+    info.middleLeft = targetGroup.middleLeft;
+    info.middleRight = targetGroup.middleRight;
+    info.low = targetGroup.low;
+    info.confidence = targetGroup.confidence;
+
+    char *pixels = slotMemory + header->pixelOffset;
+
+    for (int y = 0; y < image.rows; y++)
+    {
+        memcpy(pixels + y * rowBytes, image.ptr(y), rowBytes);
+    }
+
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    header->published.store(frame + 1, std::memory_order_release);
+}
+
+FrameRingReader::FrameRingReader()
+    : header(0), size(0)
+{
+}
+
+FrameRingReader::~FrameRingReader()
+{
+    close();
+}
+
+bool FrameRingReader::open(const std::string &name)
+{
+    close();
+
+    int file = shm_open(name.c_str(), O_RDONLY, 0);
+
+    if (file < 0) return false;
+
+    struct stat info;
+
+    if (fstat(file, &info) < 0 || static_cast<size_t>(info.st_size) < sizeof(FrameRingHeader))
+    {
+        ::close(file);
+        return false;
+    }
+
+    size = static_cast<size_t>(info.st_size);
+    void *memory = mmap(0, size, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+
+    if (memory == MAP_FAILED) return false;
+
+    header = static_cast<const FrameRingHeader *>(memory);
+
+    bool valid = header->magic == frame_ring_magic;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    valid = valid && header->version == frame_ring_version && header->slots > 0 &&
+            alignLine(sizeof(FrameRingHeader)) + header->slots * static_cast<size_t>(header->slotBytes) <= size &&
+            header->pixelOffset + static_cast<size_t>(header->pixelBytes) <= header->slotBytes;
+
+    if (!valid) close();
+
+    return valid;
+}
+
+void FrameRingReader::close()
+{
+    if (header) munmap(const_cast<FrameRingHeader *>(header), size);
+
+    header = 0;
+    size = 0;
+}
+
+uint32_t FrameRingReader::published() const
+{
+    return header ? header->published.load(std::memory_order_acquire) : 0;
+}
+
+const FrameRingSlot *FrameRingReader::slot(uint32_t frame) const
+{
+    const char *memory = reinterpret_cast<const char *>(header);
+
+    return reinterpret_cast<const FrameRingSlot *>(memory + alignLine(sizeof(FrameRingHeader)) +
+                                                   (frame % header->slots) * header->slotBytes);
+}
+
+bool FrameRingReader::begin(uint32_t frame, cv::Mat &image, const FrameRingInfo *&info,
+                            uint32_t &sequence) const
+{
+    uint32_t count = published();
+
+    // Not published yet, or already written over
+    if (!header || frame >= count || count - frame > header->slots) return false;
+
+    const FrameRingSlot *ringSlot = slot(frame);
+    sequence = ringSlot->sequence.load(std::memory_order_acquire);
+
+    if (sequence & 1) return false;
+
+    info = &ringSlot->info;
+
+    // Don't trust the size until it is known to be from one frame
+    size_t bytes = static_cast<size_t>(info->step) * static_cast<size_t>(info->rows);
+
+    if (info->rows <= 0 || info->step <= 0 || bytes > header->pixelBytes) return false;
+
+    const char *pixels = reinterpret_cast<const char *>(ringSlot) + header->pixelOffset;
+    image = cv::Mat(info->rows, info->cols, info->type, const_cast<char *>(pixels),
+                    static_cast<size_t>(info->step));
+
+    return true;
+}
+
+bool FrameRingReader::end(uint32_t frame, uint32_t sequence) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    uint32_t count = published();
+
+    // The slot must still be untouched, and still hold the same frame
+    return slot(frame)->sequence.load(std::memory_order_relaxed) == sequence &&
+           count - frame <= header->slots;
+}
+
+bool FrameRingReader::readLatest(cv::Mat &image, FrameRingInfo &info, uint32_t &frame) const
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        uint32_t count = published();
+
+        if (!count) return false;
+
+        frame = count - 1;
+
+        cv::Mat view;
+        const FrameRingInfo *ringInfo;
+        uint32_t sequence;
+
+        if (!begin(frame, view, ringInfo, sequence)) continue;
+
+        view.copyTo(image);
+        info = *ringInfo;
+
+        if (end(frame, sequence)) return true;
+    }
+
+    return false;
+}
+
+// vim:set ts=2 sw=2 bs=2:
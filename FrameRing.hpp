@@ -0,0 +1,148 @@
+/* Shared memory frame ring
+ *
+ * Vision publishes every decoded frame of a camera, with the targets found
+ * in it, into a POSIX shared memory ring so other processes on the
+ * coprocessor (the driver station streamer, the logger) do not have to open
+ * and decode the camera again.
+ *
+ * The ring has frame_ring_slots slots written in turn. Each slot is guarded
+ * by a sequence counter: the writer makes it odd before touching the slot
+ * and even again when done. A reader notes the counter, reads the slot and
+ * checks the counter again; if it changed the frame was overwritten while
+ * being read and has to be thrown away. Nobody takes a lock, and a reader can
+ * work on the pixels in place (zero copy) for as long as it takes the writer
+ * to come around the ring again.
+ *
+ * Readers only need this header, FrameRing.cxx and OpenCV core.
+ */
+
+#ifndef FRAMERING_HPP
+#define FRAMERING_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "Target.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#if ATOMIC_INT_LOCK_FREE != 2
+#error "The frame ring needs lock free atomics to work between processes"
+#endif
+
+static constexpr uint32_t frame_ring_magic = 0x5649524e;    // "VIRN"
+static constexpr uint32_t frame_ring_version = 1;
+static constexpr int frame_ring_slots = 4;
+
+// A target as it is stored in the ring
+struct FrameRingTarget
+{
+    int32_t targetType;
+    float centerX, centerY;
+    float sizeX, sizeY;
+    float distanceX, distanceY;
+    float angleX;
+    float cornerX[4], cornerY[4];
+};
+
+// Everything about a frame except its pixels
+struct FrameRingInfo
+{
+    uint64_t frameNumber;
+    int64_t captureTime;            // CLOCK_MONOTONIC in nanoseconds
+    int32_t camera;
+    int32_t rows, cols, type;
+    int32_t step;                   // Bytes per row
+
+    int32_t targetCount;
+    FrameRingTarget targets[max_targets];
+
+    // The group of TargetGroup, indices into targets or -1
+    int32_t high, middleLeft, middleRight, low;
+    float confidence;
+};
+
+struct FrameRingSlot
+{
+    std::atomic<uint32_t> sequence;     // Odd while the writer is in the slot
+    FrameRingInfo info;
+    // The pixels follow, at FrameRingHeader::pixelOffset from the slot
+};
+
+struct FrameRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint32_t slotBytes;                 // Distance from one slot to the next
+    uint32_t pixelOffset;               // Pixels from the start of a slot
+    uint32_t pixelBytes;                // Room for the pixels of a frame
+    std::atomic<uint32_t> published;    // Number of frames published so far
+};
+
+// The shared memory name of the ring of a camera
+std::string frameRingName(int camera);
+
+class FrameRingWriter
+{
+public:
+    FrameRingWriter();
+    ~FrameRingWriter();
+
+    // Create the ring, big enough for frames of pixelBytes
+    bool open(const std::string &name, size_t pixelBytes);
+
+    /* Copy a frame and its targets into the next slot. Frames that do not
+     * fit the ring, and frames that were already published, are dropped.
+     */
+    void publish(const cv::Mat &image, unsigned long frameNumber, const timespec &captureTime,
+                 int camera, const TargetBatch &targets, const TargetGroup &targetGroup);
+
+private:
+    FrameRingWriter(const FrameRingWriter &);
+    FrameRingWriter &operator=(const FrameRingWriter &);
+
+    std::string name;
+    void *memory;
+    size_t size;
+    unsigned long lastFrame;            // frameNumber of the last frame published
+};
+
+class FrameRingReader
+{
+public:
+    FrameRingReader();
+    ~FrameRingReader();
+
+    bool open(const std::string &name);
+    void close();
+
+    // Number of frames published so far, the newest one is published() - 1
+    uint32_t published() const;
+
+    /* Zero copy access to the frame with the given number of publication.
+     * begin() returns false if the frame is not in the ring (any more). image
+     * and info point into the ring, and are only good if end() returns true
+     * once the reader is done with them.
+     */
+    bool begin(uint32_t frame, cv::Mat &image, const FrameRingInfo *&info, uint32_t &sequence) const;
+    bool end(uint32_t frame, uint32_t sequence) const;
+
+    // Copy out the newest frame, returns false if there is none
+    bool readLatest(cv::Mat &image, FrameRingInfo &info, uint32_t &frame) const;
+
+private:
+    FrameRingReader(const FrameRingReader &);
+    FrameRingReader &operator=(const FrameRingReader &);
+
+    const FrameRingSlot *slot(uint32_t frame) const;
+
+    const FrameRingHeader *header;
+    size_t size;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,277 @@
+#include "Grouping.hpp"
+
+#include <cmath>
+
+static constexpr float layout_tolerance = 0.35f;       // Allowed layout error as a fraction of the offset
+static constexpr float layout_tolerance_inches = 4;    // Allowed layout error on top of that
+static constexpr float size_tolerance = 0.3f;          // Allowed log ratio between target sizes
+static constexpr float side_tie_break = 0.01f;         // Score that picks the side of a lone middle target
+
+// How well the height classification of a target agrees with a slot, 0 to 1
+static float typeAgreement(TargetType targetType, int slot)
+{
+    bool middleSlot = slot == GROUP_SLOT_MIDDLE_LEFT || slot == GROUP_SLOT_MIDDLE_RIGHT;
+
+    switch (targetType)
+    {
+        case TARGET_HEIGHT_HIGH:      return slot == GROUP_SLOT_HIGH ? 1 : 0;
+        case TARGET_HEIGHT_LOW:       return slot == GROUP_SLOT_LOW ? 1 : 0;
+        case TARGET_HEIGHT_MIDDLE:
+        case TARGET_HEIGHT_MIDDLE_LEFT:
+        case TARGET_HEIGHT_MIDDLE_RIGHT:
+        case TARGET_HEIGHT_MIDDLE_COMBINED:
+                                      return middleSlot ? 1 : 0;
+        case TARGET_HEIGHT_UNKNOWN:   return 0.5f;
+    }
+
+    return 0;
+}
+
+/* How well two targets agree with the layout, 0 to 1. The offset between the
+ * targets is converted to inches using the pixels per inch of the targets
+ * themselves, so this works at any distance.
+ */
+static float layoutAgreement(const TargetBatch &targets, int a, int slotA, int b, int slotB)
+{
+    float scaleA = (targets.sizeX[a] / target_width_inches + targets.sizeY[a] / target_height_inches) / 2;
+    float scaleB = (targets.sizeX[b] / target_width_inches + targets.sizeY[b] / target_height_inches) / 2;
+    float scale = (scaleA + scaleB) / 2;
+
+    if (scale <= 0) return 0;
+
+    float expectedX = group_layout_x[slotB] - group_layout_x[slotA];
+    float expectedY = group_layout_y[slotB] - group_layout_y[slotA];
+    float errorX = (targets.centerX[b] - targets.centerX[a]) / scale - expectedX;
+    float errorY = (targets.centerY[b] - targets.centerY[a]) / scale - expectedY;
+
+    float tolerance = layout_tolerance * std::sqrt(expectedX * expectedX + expectedY * expectedY) +
+                      layout_tolerance_inches;
+    float error = std::sqrt(errorX * errorX + errorY * errorY) / tolerance;
+
+    // All of the targets are the same size, so their sizes in the image should be close
+    float sizeRatio = std::log(scaleA / scaleB) / size_tolerance;
+
+    return std::exp(-(error * error + sizeRatio * sizeRatio) / 2);
+}
+
+// Can the targets be in these slots at all?
+static bool feasible(const TargetBatch &targets, const int *slots)
+{
+    int high = slots[GROUP_SLOT_HIGH];
+    int left = slots[GROUP_SLOT_MIDDLE_LEFT];
+    int right = slots[GROUP_SLOT_MIDDLE_RIGHT];
+    int low = slots[GROUP_SLOT_LOW];
+
+    if (left >= 0 && right >= 0 && targets.centerX[left] >= targets.centerX[right]) return false;
+
+    for (int slot = GROUP_SLOT_MIDDLE_LEFT; slot <= GROUP_SLOT_MIDDLE_RIGHT; slot++)
+    {
+        int middle = slots[slot];
+
+        if (middle < 0) continue;
+        if (high >= 0 && targets.centerY[high] >= targets.centerY[middle]) return false;
+        if (low >= 0 && targets.centerY[low] <= targets.centerY[middle]) return false;
+    }
+
+    if (high >= 0 && low >= 0 && targets.centerY[high] >= targets.centerY[low]) return false;
+
+    return true;
+}
+
+/* Every piece of evidence (the type of each target and the layout of each pair
+ * of targets) is a term between 0 and 1. The confidence is the mean of the
+ * terms. The score adds up how far each term is above or below 0.5, so an
+ * assignment gains from every target that fits and loses from every one that
+ * does not.
+ */
+float scoreTargetGroup(int imageWidth, const TargetBatch &targets,
+                       const int *slots, float &confidence)
+{
+    confidence = 0;
+
+    if (!feasible(targets, slots)) return -1;
+
+    float total = 0;
+    int terms = 0;
+
+    for (int a = 0; a < GROUP_SLOT_COUNT; a++)
+    {
+        if (slots[a] < 0) continue;
+
+        total += typeAgreement(targets.targetType[slots[a]], a);
+        terms++;
+
+        for (int b = a + 1; b < GROUP_SLOT_COUNT; b++)
+        {
+            if (slots[b] < 0) continue;
+
+            total += layoutAgreement(targets, slots[a], a, slots[b], b);
+            terms++;
+        }
+    }
+
+    if (!terms) return 0;
+
+    confidence = total / static_cast<float>(terms);
+
+    float score = total - static_cast<float>(terms) * 0.5f;
+
+    /* A middle target on its own could be either one. Assume the other
+     * targets are out of the image rather than hidden.
+     */
+    if (terms == 1 && score > 0)
+    {
+        int left = slots[GROUP_SLOT_MIDDLE_LEFT];
+        int right = slots[GROUP_SLOT_MIDDLE_RIGHT];
+
+        if (left >= 0 && targets.centerX[left] > static_cast<float>(imageWidth) / 2) score += side_tie_break;
+        if (right >= 0 && targets.centerX[right] <= static_cast<float>(imageWidth) / 2) score += side_tie_break;
+    }
+
+    return score;
+}
+
+// State of the search over all assignments
+struct GroupSearch
+{
+    int imageWidth;
+    int candidateCount;
+    const TargetBatch *targets;
+
+    int candidates[max_group_candidates];
+    int slots[GROUP_SLOT_COUNT];
+    int bestSlots[GROUP_SLOT_COUNT];
+
+    float bestScore;
+    float bestConfidence;
+};
+
+static void searchGroups(GroupSearch &search, int slot)
+{
+    if (slot == GROUP_SLOT_COUNT)
+    {
+        float confidence;
+        float score = scoreTargetGroup(search.imageWidth, *search.targets, search.slots, confidence);
+
+        if (score > search.bestScore)
+        {
+            search.bestScore = score;
+            search.bestConfidence = confidence;
+
+            for (int i = 0; i < GROUP_SLOT_COUNT; i++) search.bestSlots[i] = search.slots[i];
+        }
+
+        return;
+    }
+
+    // Leave the slot empty
+    search.slots[slot] = -1;
+    searchGroups(search, slot + 1);
+
+    for (int c = 0; c < search.candidateCount; c++)
+    {
+        int target = search.candidates[c];
+        bool used = false;
+
+        for (int i = 0; i < slot; i++)
+        {
+            if (search.slots[i] == target) used = true;
+        }
+
+        if (used) continue;
+
+        search.slots[slot] = target;
+        searchGroups(search, slot + 1);
+    }
+
+    search.slots[slot] = -1;
+}
+
+void getTargetGroup(int imageWidth, TargetBatch &targets, TargetGroup &targetGroup)
+{
+    GroupSearch search;
+    search.imageWidth = imageWidth;
+    search.targets = &targets;
+    search.candidateCount = 0;
+    search.bestScore = 0;
+    search.bestConfidence = 0;
+
+    for (int i = 0; i < GROUP_SLOT_COUNT; i++) search.bestSlots[i] = -1;
+
+    // Keep the largest quads as candidates
+    for (int i = 0; i < targets.count; i++)
+    {
+        float area = targets.sizeX[i] * targets.sizeY[i];
+        int c = search.candidateCount;
+
+        if (c == max_group_candidates)
+        {
+            int last = search.candidates[c - 1];
+
+            if (area <= targets.sizeX[last] * targets.sizeY[last]) continue;
+
+            c--;
+        }
+        else
+        {
+            search.candidateCount++;
+        }
+
+        while (c > 0 && targets.sizeX[search.candidates[c - 1]] * targets.sizeY[search.candidates[c - 1]] < area)
+        {
+            search.candidates[c] = search.candidates[c - 1];
+            c--;
+        }
+
+        search.candidates[c] = i;
+    }
+
+    searchGroups(search, 0);
+
+    targetGroup.high = search.bestSlots[GROUP_SLOT_HIGH];
+    targetGroup.middleLeft = search.bestSlots[GROUP_SLOT_MIDDLE_LEFT];
+    targetGroup.middleRight = search.bestSlots[GROUP_SLOT_MIDDLE_RIGHT];
+    targetGroup.low = search.bestSlots[GROUP_SLOT_LOW];
+    targetGroup.confidence = search.bestConfidence;
+
+    for (int i = 0; i < GROUP_SLOT_COUNT; i++)
+    {
+        if (search.bestSlots[i] >= 0) targets.targetType[search.bestSlots[i]] = group_slot_types[i];
+    }
+
+    // Now determine the location of the center target, given other target data
+    if (targetGroup.high >= 0)
+    {
+        targetGroup.selected = targets.get(targetGroup.high);
+    }
+    else if (targetGroup.low >= 0)
+    {
+        targetGroup.selected = targets.get(targetGroup.low);
+    }
+    else if (targetGroup.middleLeft >= 0 && targetGroup.middleRight >= 0)
+    {
+        int left = targetGroup.middleLeft;
+        int right = targetGroup.middleRight;
+
+        targetGroup.selected = TargetData();
+        targetGroup.selected.centerX = (targets.centerX[left] + targets.centerX[right])/2;
+        targetGroup.selected.centerY = (targets.centerY[left] + targets.centerY[right])/2;
+        targetGroup.selected.sizeX = (targets.sizeX[left] + targets.sizeX[right])/2;
+        targetGroup.selected.sizeY = (targets.sizeY[left] + targets.sizeY[right])/2;
+        targetGroup.selected.distanceX = (targets.distanceX[left] + targets.distanceX[right])/2;
+        targetGroup.selected.distanceY = (targets.distanceY[left] + targets.distanceY[right])/2;
+        targetGroup.selected.angleX = (targets.angleX[left] + targets.angleX[right])/2;
+        targetGroup.selected.targetType = TARGET_HEIGHT_MIDDLE_COMBINED;
+        targetGroup.selected.valid = true;
+    }
+    else if (targetGroup.middleLeft >= 0)
+    {
+        targetGroup.selected = targets.get(targetGroup.middleLeft);
+    }
+    else if (targetGroup.middleRight >= 0)
+    {
+        targetGroup.selected = targets.get(targetGroup.middleRight);
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
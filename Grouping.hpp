@@ -0,0 +1,61 @@
+/* Target grouping
+ *
+ * The four targets of the backboard sit in a fixed layout: the high target
+ * above the two middle targets and the low target below them. Instead of
+ * trusting the height classification of each target on its own, the grouping
+ * engine tries every feasible assignment of the detected quads to the four
+ * positions and scores it by how well the quads agree with the layout and
+ * with each other. The best assignment wins and its score is reported as a
+ * confidence between 0 and 1.
+ *
+ * Only the max_group_candidates largest quads are considered, so a frame is
+ * at most a few thousand assignments and nothing is allocated.
+ */
+
+#ifndef GROUPING_HPP
+#define GROUPING_HPP
+
+#include "Target.hpp"
+
+static constexpr int max_group_candidates = 8;     // Max quads tried for each position
+
+// The positions of the targets on the backboard
+typedef enum {
+  GROUP_SLOT_HIGH,
+  GROUP_SLOT_MIDDLE_LEFT,
+  GROUP_SLOT_MIDDLE_RIGHT,
+  GROUP_SLOT_LOW,
+  GROUP_SLOT_COUNT
+} GroupSlot;
+
+/* Approximate layout of the target centers on the backboard in inches,
+ * relative to the middle of the two middle targets (y grows down like
+ * the image).
+ */
+static const float group_layout_x[GROUP_SLOT_COUNT] = { 0, -27.375f, 27.375f, 0 };
+static const float group_layout_y[GROUP_SLOT_COUNT] = { -37, 0, 0, 33 };
+
+// The target type of each position
+static const TargetType group_slot_types[GROUP_SLOT_COUNT] =
+{
+    TARGET_HEIGHT_HIGH,
+    TARGET_HEIGHT_MIDDLE_LEFT,
+    TARGET_HEIGHT_MIDDLE_RIGHT,
+    TARGET_HEIGHT_LOW
+};
+
+/* Assign the targets to the backboard positions, set their target types and
+ * fill in the selected target and its confidence.
+ */
+void getTargetGroup(int imageWidth, TargetBatch &targets, TargetGroup &targetGroup);
+
+/* Score one assignment, slots holds a target index per GroupSlot or -1.
+ * Returns the score used to rank assignments, and the confidence in
+ * confidence. An assignment that breaks the layout returns a negative score.
+ */
+float scoreTargetGroup(int imageWidth, const TargetBatch &targets,
+                       const int *slots, float &confidence);
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
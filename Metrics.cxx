@@ -0,0 +1,336 @@
+#include "Metrics.hpp"
+
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+struct MetricInfo
+{
+    const char *name;
+    const char *labels;             // Prometheus labels of the series, or 0
+    const char *help;
+};
+
+static const MetricInfo counter_info[COUNTER_COUNT] =
+{
+    { "vision_frames_in_total", 0, "Frames captured" },
+    { "vision_frames_dropped_total", 0, "Frames captured faster than the pipeline took them" },
+    { "vision_frames_processed_total", 0, "Frames the targets were found in" },
+    { "vision_frames_still_total", 0, "Frames the motion gate kept the last targets for" },
+    { "vision_capture_stalls_total", 0, "Times a camera sent no frame for the read timeout" },
+    { "vision_capture_reconnects_total", 0, "Times a camera was connected again" },
+    { "vision_candidates_total", 0, "Contours looked at" },
+    { "vision_targets_total", 0, "Targets found" },
+    { "vision_targets_dropped_total", 0, "Quads left out of a frame with more than the max targets" },
+    { "vision_messages_sent_total", 0, "Messages sent to the cRIO" },
+    { "vision_echoes_total", 0, "Messages back from the echo server" },
+    { "vision_stream_frames_total", 0, "Frames encoded for the stream viewers" },
+    { "vision_stream_skipped_total", 0, "Stream frames a slow viewer skipped" }
+};
+
+static const MetricInfo gauge_info[GAUGE_COUNT] =
+{
+    { "vision_fps", 0, "Frames per second of the main loop" },
+    { "vision_cameras", 0, "Cameras still delivering frames" },
+    { "vision_contours", 0, "Contours in the last frame" },
+    { "vision_targets", 0, "Targets in the last frame" },
+    { "vision_group_confidence", 0, "Confidence of the last target group" }
+};
+
+static const MetricInfo histogram_info[HISTOGRAM_COUNT] =
+{
+    { "vision_stage_seconds", "stage=\"color\"", "Time a pipeline stage took" },
+    { "vision_stage_seconds", "stage=\"blur\"", 0 },
+    { "vision_stage_seconds", "stage=\"threshold\"", 0 },
+    { "vision_stage_seconds", "stage=\"close\"", 0 },
+    { "vision_stage_seconds", "stage=\"contours\"", 0 },
+    { "vision_stage_seconds", "stage=\"polygons\"", 0 },
+    { "vision_stage_seconds", "stage=\"targets\"", 0 },
+    { "vision_detect_seconds", 0, "Time from capture to targets found" },
+    { "vision_send_seconds", 0, "Time from capture to message sent" },
+    { "vision_capture_decode_seconds", 0, "Time retrieving a frame from a camera" },
+    { "vision_capture_gap_seconds", 0, "Time between two frames of a camera" },
+    { "vision_stream_encode_seconds", 0, "Time encoding a stream frame" }
+};
+
+// The shard of the calling thread, and the registry it belongs to
+static thread_local MetricsShard *local_shard = 0;
+static thread_local const MetricsRegistry *local_registry = 0;
+
+// The upper bound of a histogram bucket in seconds, 1 us doubling
+static double bucketBound(int bucket)
+{
+    return std::ldexp(1e-6, bucket);
+}
+
+MetricsRegistry::MetricsRegistry()
+    : shards(0), shardCount(0), serverSocket(-1), stopping(false)
+{
+    void *memory = 0;
+
+    // Aligned by hand, new only promises 16 bytes before C++17
+    if (posix_memalign(&memory, 64, max_metrics_shards * sizeof(MetricsShard)) != 0) throw std::bad_alloc();
+
+    shards = static_cast<MetricsShard *>(memory);
+
+    for (int i = 0; i < max_metrics_shards; i++)
+    {
+        MetricsShard *shard = new (&shards[i]) MetricsShard;
+
+        for (int j = 0; j < COUNTER_COUNT; j++) shard->counters[j].store(0, std::memory_order_relaxed);
+
+        for (int j = 0; j < HISTOGRAM_COUNT; j++)
+        {
+            for (int k = 0; k < metrics_buckets; k++) shard->buckets[j][k].store(0, std::memory_order_relaxed);
+
+            shard->nanoseconds[j].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < GAUGE_COUNT; i++) gauges[i].store(0, std::memory_order_relaxed);
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+    stop();
+
+    for (int i = 0; i < max_metrics_shards; i++) shards[i].~MetricsShard();
+
+    free(shards);
+
+    if (local_registry == this) local_shard = 0;
+}
+
+/* The first update from a thread takes the next free shard. Past
+ * max_metrics_shards threads share the last one, which is still correct as
+ * every update is an atomic add, just slower.
+ */
+MetricsShard &MetricsRegistry::shard()
+{
+    if (local_shard && local_registry == this) return *local_shard;
+
+    int index = shardCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (index >= max_metrics_shards) index = max_metrics_shards - 1;
+
+    local_shard = &shards[index];
+    local_registry = this;
+
+    return *local_shard;
+}
+
+void MetricsRegistry::add(MetricCounter counter, uint64_t count)
+{
+    shard().counters[counter].fetch_add(count, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::set(MetricGauge gauge, double value)
+{
+    gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+void MetricsRegistry::observe(MetricHistogram histogram, double seconds)
+{
+    MetricsShard &local = shard();
+
+    // The smallest bucket the time fits in, 2^bucket us
+    int bucket = 0;
+
+    if (seconds > 1e-6)
+    {
+        int exponent;
+        double mantissa = std::frexp(seconds * 1e6, &exponent);
+
+        bucket = mantissa == 0.5 ? exponent - 1 : exponent;
+
+        if (bucket >= metrics_buckets) bucket = metrics_buckets - 1;
+    }
+
+    local.buckets[histogram][bucket].fetch_add(1, std::memory_order_relaxed);
+    local.nanoseconds[histogram].fetch_add(static_cast<uint64_t>(seconds > 0 ? seconds * 1e9 : 0),
+                                           std::memory_order_relaxed);
+}
+
+// Append printf style to a string, this is only used by the server
+static void appendf(std::string &text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string &text, const char *format, ...)
+{
+    char line[256];
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    text += line;
+}
+
+static void appendHeader(std::string &text, const MetricInfo &info, const char *type)
+{
+    if (!info.help) return;
+
+    appendf(text, "# HELP %s %s\n# TYPE %s %s\n", info.name, info.help, info.name, type);
+}
+
+std::string MetricsRegistry::format() const
+{
+    std::string text;
+    int used = shardCount.load(std::memory_order_relaxed);
+
+    if (used > max_metrics_shards) used = max_metrics_shards;
+
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        uint64_t total = 0;
+
+        for (int j = 0; j < used; j++) total += shards[j].counters[i].load(std::memory_order_relaxed);
+
+        appendHeader(text, counter_info[i], "counter");
+        appendf(text, "%s %llu\n", counter_info[i].name, static_cast<unsigned long long>(total));
+    }
+
+    for (int i = 0; i < GAUGE_COUNT; i++)
+    {
+        appendHeader(text, gauge_info[i], "gauge");
+        appendf(text, "%s %g\n", gauge_info[i].name, gauges[i].load(std::memory_order_relaxed));
+    }
+
+    for (int i = 0; i < HISTOGRAM_COUNT; i++)
+    {
+        const MetricInfo &info = histogram_info[i];
+        const char *labels = info.labels ? info.labels : "";
+        const char *comma = info.labels ? "," : "";
+        uint64_t count = 0, nanoseconds = 0;
+
+        appendHeader(text, info, "histogram");
+
+        for (int j = 0; j < used; j++) nanoseconds += shards[j].nanoseconds[i].load(std::memory_order_relaxed);
+
+        // Prometheus buckets count everything up to their bound
+        for (int k = 0; k < metrics_buckets; k++)
+        {
+            for (int j = 0; j < used; j++) count += shards[j].buckets[i][k].load(std::memory_order_relaxed);
+
+            if (k == metrics_buckets - 1)
+            {
+                appendf(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", info.name, labels, comma,
+                        static_cast<unsigned long long>(count));
+            }
+            else
+            {
+                appendf(text, "%s_bucket{%s%sle=\"%g\"} %llu\n", info.name, labels, comma,
+                        bucketBound(k), static_cast<unsigned long long>(count));
+            }
+        }
+
+        double sum = static_cast<double>(nanoseconds) * 1e-9;
+
+        if (info.labels)
+        {
+            appendf(text, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", info.name, labels, sum,
+                    info.name, labels, static_cast<unsigned long long>(count));
+        }
+        else
+        {
+            appendf(text, "%s_sum %.6f\n%s_count %llu\n", info.name, sum, info.name,
+                    static_cast<unsigned long long>(count));
+        }
+    }
+
+    return text;
+}
+
+bool MetricsRegistry::serve(int port)
+{
+    stop();
+
+    serverSocket = socket(PF_INET, SOCK_DGRAM, 0);
+
+    if (serverSocket < 0)
+    {
+        perror("Metrics socket");
+        return false;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Wake up now and then to see if we have to stop
+    struct timeval timeout = { 0, 200000 };
+    setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (bind(serverSocket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        perror("Metrics bind");
+        close(serverSocket);
+        serverSocket = -1;
+        return false;
+    }
+
+    stopping = false;
+    server = std::thread(&MetricsRegistry::serverLoop, this);
+
+    return true;
+}
+
+void MetricsRegistry::stop()
+{
+    if (serverSocket < 0) return;
+
+    stopping = true;
+    server.join();
+
+    close(serverSocket);
+    serverSocket = -1;
+}
+
+void MetricsRegistry::serverLoop()
+{
+    char request[64];
+
+    while (!stopping)
+    {
+        struct sockaddr_in sender;
+        socklen_t senderLength = sizeof(sender);
+
+        ssize_t length = recvfrom(serverSocket, request, sizeof(request), 0,
+                                  reinterpret_cast<struct sockaddr*>(&sender), &senderLength);
+
+        if (length < 0) continue;
+
+        std::string text = format();
+
+        if (text.size() > static_cast<size_t>(metrics_reply_bytes)) text.resize(metrics_reply_bytes);
+
+        sendto(serverSocket, text.data(), text.size(), 0,
+               reinterpret_cast<struct sockaddr*>(&sender), senderLength);
+    }
+}
+
+MetricTimer::MetricTimer(MetricsRegistry &registry_, MetricHistogram histogram_)
+    : registry(registry_), histogram(histogram_)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start);
+}
+
+MetricTimer::~MetricTimer()
+{
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    registry.observe(histogram, static_cast<double>(end.tv_sec - start.tv_sec) +
+                                static_cast<double>(end.tv_nsec - start.tv_nsec) * 1e-9);
+}
+
+// vim:set ts=2 sw=2 bs=2:
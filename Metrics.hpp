@@ -0,0 +1,129 @@
+/* Live metrics
+ *
+ * Counters, gauges and histograms of the running process: frames in and
+ * dropped, the time each pipeline stage took, candidate and target counts
+ * and messages sent. With --metrics port they are served on a UDP socket on
+ * the loopback interface: send any datagram to the port and the reply is
+ * the current values in the Prometheus text format, for instance
+ *
+ *     echo | nc -u -w1 127.0.0.1 5801
+ *
+ * Updating a metric never takes a lock or prints. Each thread gets its own
+ * shard of counters and histogram buckets the first time it updates one, so
+ * threads never write to the same cache line, and the server adds the
+ * shards up when it is asked. Gauges hold the last value set.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <thread>
+
+static constexpr int max_metrics_shards = 64;        // Threads with a shard of their own, the rest share one
+static constexpr int metrics_buckets = 24;           // Histogram buckets of 1 us doubling up to 4 s, and one more
+static constexpr int metrics_reply_bytes = 65000;    // Largest UDP reply
+
+typedef enum {
+  COUNTER_FRAMES_IN,            // Frames captured
+  COUNTER_FRAMES_DROPPED,       // Frames captured faster than the pipeline took them
+  COUNTER_FRAMES_PROCESSED,     // Frames the targets were found in
+  COUNTER_FRAMES_STILL,         // Frames the motion gate kept the last targets for
+  COUNTER_CAPTURE_STALLS,       // Times a camera sent no frame for capture_read_timeout
+  COUNTER_CAPTURE_RECONNECTS,   // Times a camera was connected again
+  COUNTER_CANDIDATES,           // Contours looked at
+  COUNTER_TARGETS,              // Targets found
+  COUNTER_TARGETS_DROPPED,      // Quads left out of a frame with more than max_targets
+  COUNTER_MESSAGES_SENT,        // Messages sent to the cRIO
+  COUNTER_ECHOES,               // Messages back from the echo server
+  COUNTER_STREAM_FRAMES,        // Frames encoded for the stream viewers
+  COUNTER_STREAM_SKIPPED,       // Stream frames a viewer skipped as it was still being written the last one
+  COUNTER_COUNT
+} MetricCounter;
+
+typedef enum {
+  GAUGE_FPS,                    // Frames per second of the main loop
+  GAUGE_CAMERAS,                // Cameras still delivering frames
+  GAUGE_CONTOURS,               // Contours in the last frame
+  GAUGE_TARGETS,                // Targets in the last frame
+  GAUGE_CONFIDENCE,             // Confidence of the last target group
+  GAUGE_COUNT
+} MetricGauge;
+
+// The stage histograms are in the order of PipelineStage
+typedef enum {
+  HISTOGRAM_STAGE_COLOR,
+  HISTOGRAM_STAGE_BLUR,
+  HISTOGRAM_STAGE_THRESHOLD,
+  HISTOGRAM_STAGE_CLOSE,
+  HISTOGRAM_STAGE_CONTOURS,
+  HISTOGRAM_STAGE_POLYGONS,
+  HISTOGRAM_STAGE_TARGETS,
+  HISTOGRAM_DETECT,             // Capture to targets found
+  HISTOGRAM_SEND,               // Capture to message sent
+  HISTOGRAM_CAPTURE_DECODE,     // Retrieving a frame from the camera
+  HISTOGRAM_CAPTURE_GAP,        // Between two frames of a camera
+  HISTOGRAM_STREAM_ENCODE,      // Encoding a stream frame
+  HISTOGRAM_COUNT
+} MetricHistogram;
+
+// The values one thread has added, only ever written by that thread
+struct alignas(64) MetricsShard
+{
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][metrics_buckets];
+    std::atomic<uint64_t> nanoseconds[HISTOGRAM_COUNT];
+};
+
+class MetricsRegistry
+{
+public:
+    MetricsRegistry();
+    ~MetricsRegistry();
+
+    void add(MetricCounter counter, uint64_t count = 1);
+    void set(MetricGauge gauge, double value);
+    void observe(MetricHistogram histogram, double seconds);
+
+    // Every metric in the Prometheus text format
+    std::string format() const;
+
+    // Answer requests on a UDP port of the loopback interface
+    bool serve(int port);
+    void stop();
+
+private:
+    MetricsRegistry(const MetricsRegistry &);
+    MetricsRegistry &operator=(const MetricsRegistry &);
+
+    MetricsShard &shard();
+    void serverLoop();
+
+    MetricsShard *shards;
+    std::atomic<int> shardCount;
+    std::atomic<double> gauges[GAUGE_COUNT];
+
+    int serverSocket;
+    std::thread server;
+    std::atomic<bool> stopping;
+};
+
+// Observes the time from its construction to its destruction
+class MetricTimer
+{
+public:
+    MetricTimer(MetricsRegistry &registry, MetricHistogram histogram);
+    ~MetricTimer();
+
+private:
+    MetricsRegistry &registry;
+    MetricHistogram histogram;
+    timespec start;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,356 @@
+#include "MjpegStream.hpp"
+
+#include "opencv2/highgui/highgui.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static const char http_response[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+    "\r\n";
+
+static const char part_header[] =
+    "--frame\r\n"
+    "Content-Type: image/jpeg\r\n"
+    "Content-Length: %lu\r\n"
+    "\r\n";
+
+// The line that ends each frame
+static const char part_end[] = "\r\n";
+
+static bool wouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// Whether a client is still being written its header or frame
+static bool busy(const MjpegClient &client)
+{
+    return client.headerLength || client.jpeg;
+}
+
+/* Write as much of the rest of the header and frame as the socket takes
+ * without blocking. Returns false once the client is gone.
+ */
+static bool writeClient(MjpegClient &client)
+{
+    const char *data[3] = { client.header, 0, part_end };
+    size_t lengths[3] = { client.headerLength, 0, 0 };
+
+    if (client.jpeg)
+    {
+        data[1] = reinterpret_cast<const char *>(client.jpeg->data());
+        lengths[1] = client.jpeg->size();
+        lengths[2] = sizeof(part_end) - 1;
+    }
+
+    while (true)
+    {
+        struct iovec parts[3];
+        int count = 0;
+        size_t skip = client.written;
+
+        for (int i = 0; i < 3; i++)
+        {
+            if (skip >= lengths[i])
+            {
+                skip -= lengths[i];
+                continue;
+            }
+
+            parts[count].iov_base = const_cast<char *>(data[i] + skip);
+            parts[count].iov_len = lengths[i] - skip;
+            skip = 0;
+            count++;
+        }
+
+        // All written, the buffer goes back to the streamer
+        if (count == 0)
+        {
+            client.headerLength = 0;
+            client.jpeg.reset();
+            client.written = 0;
+            return true;
+        }
+
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = parts;
+        message.msg_iovlen = static_cast<size_t>(count);
+
+        ssize_t length = sendmsg(client.socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (length < 0) return wouldBlock();
+
+        client.written += static_cast<size_t>(length);
+    }
+}
+
+MjpegStreamer::MjpegStreamer(MetricsRegistry &metrics_)
+    : metrics(metrics_),
+      serverSocket(-1),
+      stopping(false),
+      clientCount(0),
+      lastPublish(0),
+      pendingQuality(0),
+      hasPending(false)
+{
+    wakePipe[0] = -1;
+    wakePipe[1] = -1;
+}
+
+MjpegStreamer::~MjpegStreamer()
+{
+    stop();
+}
+
+bool MjpegStreamer::serve(int port)
+{
+    stop();
+
+    serverSocket = socket(PF_INET, SOCK_STREAM, 0);
+
+    if (serverSocket < 0)
+    {
+        perror("Stream socket");
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(serverSocket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0 ||
+        listen(serverSocket, mjpeg_max_clients) < 0)
+    {
+        perror("Stream bind");
+        close(serverSocket);
+        serverSocket = -1;
+        return false;
+    }
+
+    if (pipe(wakePipe) < 0)
+    {
+        perror("Stream pipe");
+        close(serverSocket);
+        serverSocket = -1;
+        return false;
+    }
+
+    // A full pipe already wakes the thread up, so publish() never waits on it
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+    stopping = false;
+    server = std::thread(&MjpegStreamer::serverLoop, this);
+
+    return true;
+}
+
+void MjpegStreamer::stop()
+{
+    if (serverSocket < 0) return;
+
+    stopping = true;
+    server.join();
+
+    close(serverSocket);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    serverSocket = -1;
+    wakePipe[0] = -1;
+    wakePipe[1] = -1;
+}
+
+bool MjpegStreamer::wants(double now, int fps) const
+{
+    return clientCount > 0 && now - lastPublish >= 1.0 / std::max(fps, 1);
+}
+
+void MjpegStreamer::publish(const cv::Mat &image, double now, int quality)
+{
+    lastPublish = now;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        image.copyTo(pending);
+        pendingQuality = quality;
+        hasPending = true;
+    }
+
+    char wake = 0;
+    if (write(wakePipe[1], &wake, 1) < 0) return;
+}
+
+// A buffer no client is being written any more, like FrameSource::lease()
+std::shared_ptr<std::vector<uchar> > MjpegStreamer::freeBuffer()
+{
+    for (size_t i = 0; i < buffers.size(); i++)
+    {
+        if (buffers[i].use_count() == 1) return buffers[i];
+    }
+
+    buffers.push_back(std::make_shared<std::vector<uchar> >());
+    return buffers.back();
+}
+
+// Encode the pending image and start writing it to every client that is done with the last one
+void MjpegStreamer::encodeFrame()
+{
+    int quality;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!hasPending) return;
+
+        cv::swap(pending, encoding);
+        quality = pendingQuality;
+        hasPending = false;
+    }
+
+    if (clients.empty()) return;
+
+    std::shared_ptr<std::vector<uchar> > buffer = freeBuffer();
+    std::vector<int> parameters(2);
+    parameters[0] = CV_IMWRITE_JPEG_QUALITY;
+    parameters[1] = quality;
+
+    {
+        MetricTimer timer(metrics, HISTOGRAM_STREAM_ENCODE);
+        if (!cv::imencode(".jpg", encoding, *buffer, parameters)) return;
+    }
+
+    metrics.add(COUNTER_STREAM_FRAMES);
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        MjpegClient &client = clients[i];
+
+        // A slow client skips the frame rather than holding the others up
+        if (busy(client))
+        {
+            metrics.add(COUNTER_STREAM_SKIPPED);
+            continue;
+        }
+
+        client.headerLength = static_cast<size_t>(snprintf(client.header, sizeof(client.header), part_header,
+                                                           static_cast<unsigned long>(buffer->size())));
+        client.jpeg = buffer;
+        client.written = 0;
+
+        // A client that is gone is closed once poll() says so
+        writeClient(client);
+    }
+}
+
+void MjpegStreamer::acceptClient()
+{
+    int connection = accept(serverSocket, 0, 0);
+
+    if (connection < 0) return;
+
+    if (clients.size() >= static_cast<size_t>(mjpeg_max_clients))
+    {
+        close(connection);
+        return;
+    }
+
+    fcntl(connection, F_SETFL, O_NONBLOCK);
+
+    MjpegClient client;
+    client.socket = connection;
+    client.headerLength = static_cast<size_t>(snprintf(client.header, sizeof(client.header), "%s", http_response));
+    client.written = 0;
+
+    clients.push_back(client);
+    clientCount = static_cast<int>(clients.size());
+}
+
+/* Accept clients, encode the images publish() hands over and write them out,
+ * waking up now and then to see if we have to stop
+ */
+void MjpegStreamer::serverLoop()
+{
+    std::vector<struct pollfd> polls;
+
+    while (!stopping)
+    {
+        polls.clear();
+
+        struct pollfd listening = { serverSocket, POLLIN, 0 };
+        struct pollfd woken = { wakePipe[0], POLLIN, 0 };
+        polls.push_back(listening);
+        polls.push_back(woken);
+
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            struct pollfd client = { clients[i].socket, static_cast<short>(POLLIN | (busy(clients[i]) ? POLLOUT : 0)), 0 };
+            polls.push_back(client);
+        }
+
+        if (poll(polls.data(), polls.size(), 200) <= 0) continue;
+
+        // Backwards, so a client that is gone can be dropped on the way
+        for (size_t i = clients.size(); i-- > 0; )
+        {
+            short events = polls[i + 2].revents;
+            bool open = true;
+
+            // What a client sends is its request, which is read and ignored
+            if (events & (POLLIN | POLLHUP | POLLERR))
+            {
+                char request[512];
+                ssize_t length = recv(clients[i].socket, request, sizeof(request), MSG_DONTWAIT);
+                open = length > 0 || (length < 0 && wouldBlock());
+            }
+
+            if (open && (events & POLLOUT)) open = writeClient(clients[i]);
+
+            if (!open)
+            {
+                close(clients[i].socket);
+                clients.erase(clients.begin() + static_cast<long>(i));
+                clientCount = static_cast<int>(clients.size());
+            }
+        }
+
+        if (polls[1].revents & POLLIN)
+        {
+            char wake[64];
+            while (read(wakePipe[0], wake, sizeof(wake)) > 0) {}
+
+            encodeFrame();
+        }
+
+        if (polls[0].revents & POLLIN) acceptClient();
+    }
+
+    for (size_t i = 0; i < clients.size(); i++)
+    {
+        close(clients[i].socket);
+    }
+
+    clients.clear();
+    clientCount = 0;
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,100 @@
+/* MJPEG stream of the annotated frames
+ *
+ * With --stream port the final image of camera n is served over HTTP on
+ * port + n as a multipart/x-mixed-replace stream of JPEG frames, which a
+ * browser or the driver station dashboard shows as video. A local client
+ * will do to try it, for instance
+ *
+ *     curl -s http://127.0.0.1:5800/ > final.mjpg
+ *
+ * Watching must never slow detection, so the pipeline only copies the image
+ * into the streamer, at most stream_fps times a second and only while a
+ * client is connected. A thread of its own encodes the newest copy at
+ * stream_quality and writes it to the clients without blocking. A client
+ * that is still being written the last frame skips the new one, so a slow
+ * viewer just sees fewer frames.
+ *
+ * The JPEG buffers are reused like the frame buffers of a FrameSource: a
+ * frame is encoded into a buffer no client is still being written, so there
+ * are never more than one more buffers than clients.
+ */
+
+#ifndef MJPEGSTREAM_HPP
+#define MJPEGSTREAM_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "Metrics.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static constexpr int mjpeg_max_clients = 8;
+static constexpr int mjpeg_header_bytes = 256;      // Largest HTTP header written to a client
+
+typedef std::shared_ptr<const std::vector<uchar> > JpegBuffer;
+
+// A viewer and what is left to write to it
+struct MjpegClient
+{
+    int socket;
+    char header[mjpeg_header_bytes];    // The HTTP response, then the header of each part
+    size_t headerLength;
+    JpegBuffer jpeg;                    // The frame after the header, if any
+    size_t written;                     // Of the header, the frame and the line after it
+};
+
+class MjpegStreamer
+{
+public:
+    explicit MjpegStreamer(MetricsRegistry &metrics);
+    ~MjpegStreamer();
+
+    // Listen on a TCP port of every interface, so the driver station can connect
+    bool serve(int port);
+    void stop();
+
+    /* Whether a frame handed over at now seconds would be watched: a client
+     * is connected and the last one was at least 1 / fps ago
+     */
+    bool wants(double now, int fps) const;
+
+    // Copy the image for the encoder, over one it has not started on yet
+    void publish(const cv::Mat &image, double now, int quality);
+
+private:
+    MjpegStreamer(const MjpegStreamer &);
+    MjpegStreamer &operator=(const MjpegStreamer &);
+
+    void serverLoop();
+    void acceptClient();
+    void encodeFrame();
+    std::shared_ptr<std::vector<uchar> > freeBuffer();
+
+    MetricsRegistry &metrics;
+    int serverSocket;
+    int wakePipe[2];                    // publish() wakes the server thread up through this
+    std::thread server;
+    std::atomic<bool> stopping;
+    std::atomic<int> clientCount;       // Read by wants() on the pipeline thread
+
+    double lastPublish;                 // Only used by the pipeline thread
+
+    std::mutex lock;                    // Guards the pending image
+    cv::Mat pending;
+    int pendingQuality;
+    bool hasPending;
+
+    // Only used by the server thread
+    cv::Mat encoding;                   // Swapped with pending, so neither is allocated again
+    std::vector<std::shared_ptr<std::vector<uchar> > > buffers;
+    std::vector<MjpegClient> clients;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
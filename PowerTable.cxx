@@ -0,0 +1,20 @@
+#include "PowerTable.hpp"
+
+#include <cmath>
+
+PowerTable::PowerTable(float scale_, float exponent_)
+    : scale(scale_), exponent(exponent_), values(power_table_max * power_table_steps + 1)
+{
+    // Entries below 1 pixel are never read, see operator()
+    for (size_t i = power_table_steps; i < values.size(); i++)
+    {
+        values[i] = exact(static_cast<float>(i) / power_table_steps);
+    }
+}
+
+float PowerTable::exact(float size) const
+{
+    return scale * std::pow(size, exponent);
+}
+
+// vim:set ts=2 sw=2 bs=2:
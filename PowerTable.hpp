@@ -0,0 +1,52 @@
+/* Table driven power law
+ *
+ * The distance to a target is a power law fit of its size in pixels,
+ * scale * size^exponent, which costs a pow() per target and axis. On a
+ * coprocessor with a weak FPU a table of the curve every 1/power_table_steps
+ * of a pixel, read with linear interpolation, is a lot cheaper.
+ *
+ * Linear interpolation is off by at most h^2/8 times the second derivative,
+ * for these curves a relative error of about e(e+1) / (8 steps^2 size^2)
+ * once the size is a few pixels. For the distance fits (exponents -1.061
+ * and -1.025) that was measured as at most 0.10% from 4 pixels and 0.0042%
+ * (0.004 inches at 100 inches) from the 20 pixels a target has to be at
+ * least. Sizes outside the table fall back to pow().
+ */
+
+#ifndef POWERTABLE_HPP
+#define POWERTABLE_HPP
+
+#include <cstddef>
+#include <vector>
+
+static constexpr int power_table_steps = 4;          // Entries per pixel
+static constexpr int power_table_max = 1024;         // Largest size in the table, in pixels
+
+class PowerTable
+{
+public:
+    PowerTable(float scale, float exponent);
+
+    float operator()(float size) const
+    {
+        if (!(size >= 1 && size < power_table_max)) return exact(size);
+
+        float position = size * power_table_steps;
+        std::size_t index = static_cast<std::size_t>(position);
+        float fraction = position - static_cast<float>(index);
+
+        return values[index] + fraction * (values[index + 1] - values[index]);
+    }
+
+    // scale * size^exponent with pow()
+    float exact(float size) const;
+
+private:
+    float scale;
+    float exponent;
+    std::vector<float> values;          // At 0, 1 / power_table_steps, ... power_table_max
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,166 @@
+#include "SceneGenerator.hpp"
+#include "Grouping.hpp"
+
+#include "opencv2/imgproc/imgproc.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+static constexpr float board_half_width = 40;        // Inches from the backboard center to its side
+static constexpr int draw_shift = 4;                 // Fractional bits of the corners handed to OpenCV
+static constexpr float pi = 3.14159265f;
+
+// The reflective tape lit by the green ring light, and the dark inside of a target
+static const cv::Scalar tape_color(60, 230, 60);
+static const cv::Scalar hole_color(25, 25, 25);
+
+// Where a point of the backboard, in inches from its center, ends up in the image
+static cv::Point2f projectPoint(const SceneSettings &settings, float x, float y)
+{
+    float angle = settings.roll * pi / 180;
+    float rotatedX = x * std::cos(angle) - y * std::sin(angle);
+    float rotatedY = x * std::sin(angle) + y * std::cos(angle);
+
+    // Points on the far side are smaller and closer to the middle
+    float depth = 1 + settings.perspective * x / board_half_width;
+
+    return cv::Point2f(settings.size.width / 2.0f + settings.offsetX + settings.pixelsPerInch * rotatedX / depth,
+                       settings.size.height / 2.0f + settings.offsetY + settings.pixelsPerInch * rotatedY / depth);
+}
+
+// Fill a quad with sub pixel corners
+static void fillQuad(cv::Mat &image, const cv::Point2f *corners, const cv::Scalar &color)
+{
+    cv::Point points[4];
+
+    for (int j = 0; j < 4; j++)
+    {
+        points[j] = cv::Point(cvRound(corners[j].x * (1 << draw_shift)),
+                              cvRound(corners[j].y * (1 << draw_shift)));
+    }
+
+    fillConvexPoly(image, points, 4, color, 8, draw_shift);
+}
+
+// Draw a ring of tape, a rectangle of the given size in inches with a hole in it
+static void drawTarget(const SceneSettings &settings, cv::Mat &image, float centerX, float centerY,
+                       float width, float height, cv::Point2f *outer)
+{
+    static const float corner_x[4] = { -0.5f, 0.5f, 0.5f, -0.5f };
+    static const float corner_y[4] = { -0.5f, -0.5f, 0.5f, 0.5f };
+
+    cv::Point2f inner[4];
+
+    for (int j = 0; j < 4; j++)
+    {
+        outer[j] = projectPoint(settings, centerX + corner_x[j] * width, centerY + corner_y[j] * height);
+        inner[j] = projectPoint(settings, centerX + corner_x[j] * (width - 2 * target_tape_inches),
+                                centerY + corner_y[j] * (height - 2 * target_tape_inches));
+    }
+
+    fillQuad(image, outer, tape_color);
+    fillQuad(image, inner, hole_color);
+}
+
+// Background that gets brighter from the top left to the bottom right
+static void drawBackground(const SceneSettings &settings, cv::Mat &image)
+{
+    for (int y = 0; y < image.rows; y++)
+    {
+        cv::Vec3b *row = image.ptr<cv::Vec3b>(y);
+
+        for (int x = 0; x < image.cols; x++)
+        {
+            float position = (static_cast<float>(x) / image.cols + static_cast<float>(y) / image.rows) / 2;
+            uchar value = static_cast<uchar>(30 + settings.gradient * 120 * position);
+
+            row[x][0] = value;
+            row[x][1] = value;
+            row[x][2] = value;
+        }
+    }
+}
+
+void renderScene(const SceneSettings &settings, cv::Mat &image,
+                 std::vector<SceneTarget> &truth)
+{
+    cv::RNG rng(settings.seed);
+
+    image.create(settings.size, CV_8UC3);
+    truth.clear();
+
+    drawBackground(settings, image);
+
+    for (int i = 0; i < settings.clutter; i++)
+    {
+        cv::Point center(rng.uniform(0, image.cols), rng.uniform(0, image.rows));
+        cv::Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+
+        circle(image, center, rng.uniform(3, 25), color, -1);
+    }
+
+    // The part of the image the backboard covers, where decoys are not put
+    cv::Point2f boardTopLeft = projectPoint(settings, -board_half_width, -board_half_width);
+    cv::Point2f boardBottomRight = projectPoint(settings, board_half_width, board_half_width);
+    float boardLeft = std::min(boardTopLeft.x, boardBottomRight.x);
+    float boardRight = std::max(boardTopLeft.x, boardBottomRight.x);
+    float boardTop = std::min(boardTopLeft.y, boardBottomRight.y);
+    float boardBottom = std::max(boardTopLeft.y, boardBottomRight.y);
+
+    for (int i = 0; i < settings.decoys; i++)
+    {
+        // A decoy is drawn like a target of random size somewhere else in the image
+        SceneSettings decoy = settings;
+        decoy.perspective = 0;
+        decoy.roll = rng.uniform(-30.0f, 30.0f);
+        decoy.pixelsPerInch = settings.pixelsPerInch * rng.uniform(0.5f, 1.5f);
+
+        for (int attempt = 0; attempt < 10; attempt++)
+        {
+            decoy.offsetX = rng.uniform(-0.45f, 0.45f) * image.cols;
+            decoy.offsetY = rng.uniform(-0.45f, 0.45f) * image.rows;
+
+            float x = image.cols / 2.0f + decoy.offsetX;
+            float y = image.rows / 2.0f + decoy.offsetY;
+
+            if (x < boardLeft || x > boardRight || y < boardTop || y > boardBottom) break;
+        }
+
+        cv::Point2f corners[4];
+        drawTarget(decoy, image, 0, 0, target_width_inches * rng.uniform(0.5f, 1.2f),
+                   target_height_inches * rng.uniform(0.5f, 1.2f), corners);
+    }
+
+    for (int slot = 0; slot < std::min(settings.targets, static_cast<int>(GROUP_SLOT_COUNT)); slot++)
+    {
+        SceneTarget target;
+        target.targetType = group_slot_types[slot];
+        target.pixelsPerInch = settings.pixelsPerInch /
+                               (1 + settings.perspective * group_layout_x[slot] / board_half_width);
+
+        drawTarget(settings, image, group_layout_x[slot], group_layout_y[slot],
+                   target_width_inches, target_height_inches, target.points);
+        truth.push_back(target);
+    }
+
+    if (settings.blur > 0)
+    {
+        GaussianBlur(image, image, cv::Size(2 * settings.blur + 1, 2 * settings.blur + 1), 0, 0);
+    }
+
+    if (settings.noise > 0)
+    {
+        for (int y = 0; y < image.rows; y++)
+        {
+            uchar *row = image.ptr<uchar>(y);
+
+            for (int x = 0; x < image.cols * 3; x++)
+            {
+                double value = row[x] + rng.gaussian(settings.noise);
+                row[x] = static_cast<uchar>(std::max(0.0, std::min(255.0, value)));
+            }
+        }
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
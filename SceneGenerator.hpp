@@ -0,0 +1,71 @@
+/* Synthetic backboard scenes
+ *
+ * Renders frames of the four targets with a controlled amount of everything
+ * that makes the pipeline work harder: decoy quads that look like targets to
+ * the contour steps, noise blobs, a lighting gradient, perspective, roll,
+ * blur and sensor noise. The frames go straight into the pipeline, and the
+ * outer corners of every target drawn are returned as the truth.
+ *
+ * Scenes are drawn with a seeded random number generator, so the same
+ * settings always give the same frame.
+ */
+
+#ifndef SCENEGENERATOR_HPP
+#define SCENEGENERATOR_HPP
+
+#include "opencv2/core/core.hpp"
+
+#include "Target.hpp"
+
+#include <vector>
+
+static constexpr float target_tape_inches = 2;      // Width of the reflective tape around a target
+
+struct SceneSettings
+{
+    SceneSettings():
+        size(640, 480),
+        targets(4),
+        decoys(0),
+        clutter(0),
+        pixelsPerInch(3.5f),
+        offsetX(0),
+        offsetY(0),
+        perspective(0),
+        roll(0),
+        gradient(0),
+        blur(0),
+        noise(0),
+        seed(0)
+    {
+    }
+
+    cv::Size size;
+    int targets;                // How many of the targets to draw, in the order high, left, right, low
+    int decoys;                 // Quads with a hole in them that are not on the backboard
+    int clutter;                // Blobs of random size and color
+    float pixelsPerInch;        // Scale of the backboard, which sets the distance
+    float offsetX;              // Backboard center from the image center in pixels
+    float offsetY;
+    float perspective;          // How much further away the right side is, 0 faces the camera
+    float roll;                 // Rotation of the backboard in degrees
+    float gradient;             // Strength of the lighting gradient, 0 to 1
+    int blur;                   // Blur kernel radius in pixels
+    float noise;                // Standard deviation of the sensor noise
+    unsigned seed;
+};
+
+// A target drawn in a scene
+struct SceneTarget
+{
+    TargetType targetType;
+    cv::Point2f points[4];      // The outer corners, clockwise from the top left
+    float pixelsPerInch;        // Scale at the center of the target, perspective included
+};
+
+void renderScene(const SceneSettings &settings, cv::Mat &image,
+                 std::vector<SceneTarget> &truth);
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
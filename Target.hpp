@@ -0,0 +1,124 @@
+/* Target definitions shared between the vision pipeline and the
+ * modules that consume its results (tracking, logging, networking).
+ */
+
+#ifndef TARGET_HPP
+#define TARGET_HPP
+
+#include "opencv2/core/core.hpp"
+
+// A Target height enumerated type
+typedef enum {
+  TARGET_HEIGHT_UNKNOWN,
+  TARGET_HEIGHT_HIGH,
+  TARGET_HEIGHT_MIDDLE,
+  TARGET_HEIGHT_MIDDLE_RIGHT,
+  TARGET_HEIGHT_MIDDLE_LEFT,
+  TARGET_HEIGHT_LOW,
+  TARGET_HEIGHT_MIDDLE_COMBINED
+} TargetType;
+
+static constexpr int max_targets = 32;               // Max number of candidate targets in a frame, the largest quads are kept
+
+static constexpr int target_width_inches = 24;       // Width of a physical target in inches
+static constexpr int target_height_inches = 16;      // Height of a physical target in inches
+
+// Struct containing information about the vision targets
+struct TargetData 
+{
+    TargetData() 
+    {
+        centerX = 0;
+        centerY = 0;
+        sizeX = 0;
+        sizeY = 0;
+        distanceX = 0;
+        distanceY = 0;
+        angleX = 0;
+        tension = 0;
+        targetType = TARGET_HEIGHT_UNKNOWN;
+        valid = false;
+    }
+    
+    cv::Point2f points[4];
+
+    float centerX;
+    float centerY;
+    float sizeX;
+    float sizeY;
+    float distanceX;
+    float distanceY;
+    float angleX;
+    float tension;
+    
+    TargetType targetType;
+    
+    bool valid;
+};
+
+/* All of the candidate targets of a frame, stored as one array per field so
+ * the size, distance, angle and type of every candidate are computed in one
+ * pass over contiguous data. Corners are stored inline, corner j of target i
+ * is (cornerX[j][i], cornerY[j][i]).
+ */
+struct TargetBatch
+{
+    TargetBatch() : count(0) {}
+
+    // The target at index i gathered back into a single struct
+    TargetData get(int i) const
+    {
+        TargetData target;
+
+        for (int j = 0; j < 4; j++)
+        {
+            target.points[j] = cv::Point2f(cornerX[j][i], cornerY[j][i]);
+        }
+
+        target.centerX = centerX[i];
+        target.centerY = centerY[i];
+        target.sizeX = sizeX[i];
+        target.sizeY = sizeY[i];
+        target.distanceX = distanceX[i];
+        target.distanceY = distanceY[i];
+        target.angleX = angleX[i];
+        target.targetType = targetType[i];
+        target.valid = true;
+
+        return target;
+    }
+
+    int count;
+
+    float cornerX[4][max_targets];
+    float cornerY[4][max_targets];
+
+    float centerX[max_targets];
+    float centerY[max_targets];
+    float sizeX[max_targets];
+    float sizeY[max_targets];
+    float distanceX[max_targets];
+    float distanceY[max_targets];
+    float angleX[max_targets];
+
+    TargetType targetType[max_targets];
+};
+
+/* Struct containing target groups based on location of target. The groups
+ * are indices into the frame's TargetBatch, -1 when the target is not seen.
+ */
+struct TargetGroup 
+{
+    TargetGroup() : high(-1), middleLeft(-1), middleRight(-1), low(-1), confidence(0) {}
+
+    int high;
+    int middleLeft;
+    int middleRight;
+    int low;
+    float confidence;       // How well the group fits the backboard, 0 to 1
+    TargetData selected;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,173 @@
+#include "TargetLog.hpp"
+
+#include <chrono>
+#include <cstring>
+
+static int64_t toNanoseconds(const timespec &time)
+{
+    return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+TargetLogWriter::TargetLogWriter()
+    : file(0), stopping(false), droppedRecords(0)
+{
+}
+
+TargetLogWriter::~TargetLogWriter()
+{
+    close();
+}
+
+bool TargetLogWriter::open(const char *fileName)
+{
+    close();
+
+    file = fopen(fileName, "wb");
+
+    if (!file)
+    {
+        perror(fileName);
+        return false;
+    }
+
+    TargetLogHeader header;
+    header.magic = target_log_magic;
+    header.version = target_log_version;
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        perror(fileName);
+        fclose(file);
+        file = 0;
+        return false;
+    }
+
+    pending.reserve(target_log_buffer_bytes);
+    writing.reserve(target_log_buffer_bytes);
+    stopping = false;
+    droppedRecords = 0;
+
+    writer = std::thread(&TargetLogWriter::writerLoop, this);
+
+    return true;
+}
+
+void TargetLogWriter::close()
+{
+    if (!file) return;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+
+    wake.notify_one();
+    writer.join();
+
+    fclose(file);
+    file = 0;
+
+    if (droppedRecords) printf("The target log dropped %lu frames\n", droppedRecords);
+}
+
+void TargetLogWriter::log(unsigned long frameNumber, const timespec &captureTime, const timespec &detectTime,
+                          int camera, const TargetBatch &targets, const TargetGroup &targetGroup)
+{
+    if (!file) return;
+
+    // Build the record on the stack so the lock is only held for one copy
+    char record[sizeof(TargetLogFrame) + max_targets * sizeof(TargetLogTarget)];
+    TargetLogFrame frame;
+
+    frame.frameNumber = frameNumber;
+    frame.captureTime = toNanoseconds(captureTime);
+    frame.detectTime = toNanoseconds(detectTime);
+    frame.camera = camera;
+    frame.high = targetGroup.high;
+    frame.middleLeft = targetGroup.middleLeft;
+    frame.middleRight = targetGroup.middleRight;
+    frame.low = targetGroup.low;
+    frame.confidence = targetGroup.confidence;
+    frame.selectedType = targetGroup.selected.targetType;
+    frame.selectedDistance = targetGroup.selected.distanceY;
+    frame.selectedAngle = targetGroup.selected.angleX;
+    frame.targetCount = targets.count;
+
+    memcpy(record, &frame, sizeof(frame));
+
+    TargetLogTarget *logTargets = reinterpret_cast<TargetLogTarget *>(record + sizeof(frame));
+
+    for (int i = 0; i < targets.count; i++)
+    {
+        TargetLogTarget &target = logTargets[i];
+
+        target.targetType = targets.targetType[i];
+        target.centerX = targets.centerX[i];
+        target.centerY = targets.centerY[i];
+        target.sizeX = targets.sizeX[i];
+        target.sizeY = targets.sizeY[i];
+        target.distanceX = targets.distanceX[i];
+        target.distanceY = targets.distanceY[i];
+        target.angleX = targets.angleX[i];
+
+        for (int j = 0; j < 4; j++)
+        {
+            target.cornerX[j] = targets.cornerX[j][i];
+            target.cornerY[j] = targets.cornerY[j][i];
+        }
+    }
+
+    size_t bytes = sizeof(frame) + targets.count * sizeof(TargetLogTarget);
+    bool half;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // The writer thread is a whole buffer behind, rather drop than wait
+        if (pending.size() + bytes > target_log_buffer_bytes)
+        {
+            droppedRecords++;
+            return;
+        }
+
+        pending.insert(pending.end(), record, record + bytes);
+        half = pending.size() >= target_log_buffer_bytes / 2;
+    }
+
+    if (half) wake.notify_one();
+}
+
+/* Every flush interval, or as soon as the buffer is half full, take the
+ * records logged so far and write them out without holding the lock.
+ */
+void TargetLogWriter::writerLoop()
+{
+    std::unique_lock<std::mutex> guard(lock);
+
+    while (true)
+    {
+        wake.wait_for(guard, std::chrono::duration<double>(target_log_flush_interval), [this]
+            {
+                return stopping || pending.size() >= target_log_buffer_bytes / 2;
+            });
+
+        bool last = stopping;
+
+        pending.swap(writing);
+        guard.unlock();
+
+        if (!writing.empty())
+        {
+            if (fwrite(&writing[0], writing.size(), 1, file) != 1) perror("Target log");
+
+            fflush(file);
+            writing.clear();
+        }
+
+        guard.lock();
+
+        if (last && pending.empty()) return;
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,113 @@
+/* Binary target log
+ *
+ * With --log every frame of every camera is appended to a compact binary
+ * file: the frame number, when it was captured and processed, every
+ * candidate target with its corners and the group picked for it. A whole
+ * match is a few tens of megabytes, and target_log_csv turns it into CSV for
+ * offline analysis.
+ *
+ * The pipeline only copies each record into a memory buffer. A background
+ * thread writes the buffer out, so a slow disk never holds up a frame; if
+ * the disk falls a whole buffer behind, records are dropped and counted
+ * instead.
+ *
+ * The file is a TargetLogHeader followed by records. Each record is a
+ * TargetLogFrame followed by its targetCount TargetLogTargets, all in the
+ * byte order of the machine that wrote it.
+ */
+
+#ifndef TARGETLOG_HPP
+#define TARGETLOG_HPP
+
+#include "Target.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static constexpr uint32_t target_log_magic = 0x56544c47;     // "VTLG"
+static constexpr uint32_t target_log_version = 1;
+static constexpr size_t target_log_buffer_bytes = 1 << 20;   // Records held for the writer thread
+static constexpr double target_log_flush_interval = 0.5;     // Seconds between writes when it is quiet
+
+struct TargetLogHeader
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+// A candidate target as it is logged
+struct TargetLogTarget
+{
+    int32_t targetType;
+    float centerX, centerY;
+    float sizeX, sizeY;
+    float distanceX, distanceY;
+    float angleX;
+    float cornerX[4], cornerY[4];
+};
+
+// The fixed part of the record of a frame
+struct TargetLogFrame
+{
+    uint64_t frameNumber;
+    int64_t captureTime;            // CLOCK_MONOTONIC in nanoseconds
+    int64_t detectTime;             // When the targets were found, same clock
+    int32_t camera;
+
+    // The group of TargetGroup, indices into the targets or -1
+    int32_t high, middleLeft, middleRight, low;
+    float confidence;
+
+    // The selected target of the group
+    int32_t selectedType;
+    float selectedDistance;
+    float selectedAngle;
+
+    int32_t targetCount;            // TargetLogTargets following this record
+};
+
+class TargetLogWriter
+{
+public:
+    TargetLogWriter();
+    ~TargetLogWriter();
+
+    // Create the log file and start the writer thread
+    bool open(const char *fileName);
+
+    // Write out everything logged so far and stop the writer thread
+    void close();
+
+    /* Queue the record of a frame, this only copies it. Called from one
+     * thread at a time.
+     */
+    void log(unsigned long frameNumber, const timespec &captureTime, const timespec &detectTime,
+             int camera, const TargetBatch &targets, const TargetGroup &targetGroup);
+
+    unsigned long dropped() const { return droppedRecords; }
+
+private:
+    TargetLogWriter(const TargetLogWriter &);
+    TargetLogWriter &operator=(const TargetLogWriter &);
+
+    void writerLoop();
+
+    FILE *file;
+    std::thread writer;
+    std::mutex lock;
+    std::condition_variable wake;
+
+    std::vector<char> pending;      // Filled by log(), swapped out by the writer thread
+    std::vector<char> writing;
+    bool stopping;
+    unsigned long droppedRecords;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,131 @@
+/* target_log_csv: turns a target log written with --log into CSV
+ *
+ * Prints one row per candidate target, and one row with target -1 for a
+ * frame without any. Times are in milliseconds from the first frame, the
+ * slot column tells where the grouping put the target on the backboard.
+ *
+ * Usage: target_log_csv log [csv]
+ */
+
+#include "TargetLog.hpp"
+
+#include <cstdio>
+
+static const char *slotName(const TargetLogFrame &frame, int target)
+{
+    if (target < 0) return "";
+    if (target == frame.high) return "high";
+    if (target == frame.middleLeft) return "middleLeft";
+    if (target == frame.middleRight) return "middleRight";
+    if (target == frame.low) return "low";
+
+    return "";
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("Usage: target_log_csv log [csv]\n");
+        return -1;
+    }
+
+    FILE *input = fopen(argv[1], "rb");
+
+    if (!input)
+    {
+        perror(argv[1]);
+        return -1;
+    }
+
+    TargetLogHeader header;
+
+    if (fread(&header, sizeof(header), 1, input) != 1 || header.magic != target_log_magic)
+    {
+        printf("%s is not a target log\n", argv[1]);
+        fclose(input);
+        return -1;
+    }
+
+    if (header.version != target_log_version)
+    {
+        printf("%s is a version %u target log, this reads version %u\n", argv[1], header.version,
+               target_log_version);
+        fclose(input);
+        return -1;
+    }
+
+    FILE *output = stdout;
+
+    if (argc > 2)
+    {
+        output = fopen(argv[2], "w");
+
+        if (!output)
+        {
+            perror(argv[2]);
+            fclose(input);
+            return -1;
+        }
+    }
+
+    fprintf(output, "frame,camera,capture_ms,detect_ms,confidence,selected_type,selected_distance,"
+                    "selected_angle,target,slot,type,center_x,center_y,size_x,size_y,distance_x,"
+                    "distance_y,angle_x,x0,y0,x1,y1,x2,y2,x3,y3\n");
+
+    TargetLogFrame frame;
+    TargetLogTarget targets[max_targets];
+    int64_t start = 0;
+    long frames = 0;
+
+    while (fread(&frame, sizeof(frame), 1, input) == 1)
+    {
+        if (frame.targetCount < 0 || frame.targetCount > max_targets ||
+            fread(targets, sizeof(TargetLogTarget), frame.targetCount, input) !=
+                static_cast<size_t>(frame.targetCount))
+        {
+            printf("%s is cut short after %ld frames\n", argv[1], frames);
+            break;
+        }
+
+        if (!frames) start = frame.captureTime;
+
+        frames++;
+
+        for (int i = frame.targetCount ? 0 : -1; i < frame.targetCount; i++)
+        {
+            fprintf(output, "%lu,%d,%.3f,%.3f,%.3f,%d,%f,%f,%d,%s",
+                    static_cast<unsigned long>(frame.frameNumber), frame.camera,
+                    (frame.captureTime - start) * 1e-6, (frame.detectTime - start) * 1e-6,
+                    frame.confidence, frame.selectedType, frame.selectedDistance, frame.selectedAngle,
+                    i, slotName(frame, i));
+
+            if (i < 0)
+            {
+                fprintf(output, ",,,,,,,,,,,,,,,,\n");
+                continue;
+            }
+
+            const TargetLogTarget &target = targets[i];
+
+            fprintf(output, ",%d,%f,%f,%f,%f,%f,%f,%f", target.targetType, target.centerX,
+                    target.centerY, target.sizeX, target.sizeY, target.distanceX, target.distanceY,
+                    target.angleX);
+
+            for (int j = 0; j < 4; j++)
+            {
+                fprintf(output, ",%.2f,%.2f", target.cornerX[j], target.cornerY[j]);
+            }
+
+            fprintf(output, "\n");
+        }
+    }
+
+    fclose(input);
+
+    if (output != stdout) fclose(output);
+
+    return 0;
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,76 @@
+#include "Telemetry.hpp"
+
+#include <cstdio>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(double seconds)
+{
+    int bucket = static_cast<int>(seconds / latency_bucket_seconds);
+
+    if (bucket < 0) bucket = 0;
+    if (bucket >= latency_buckets) bucket = latency_buckets - 1;
+
+    buckets[bucket]++;
+    samples++;
+    total += seconds;
+
+    if (seconds > largest) largest = seconds;
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < latency_buckets; i++) buckets[i] = 0;
+
+    samples = 0;
+    total = 0;
+    largest = 0;
+}
+
+double LatencyHistogram::percentile(double fraction) const
+{
+    if (!samples) return 0;
+
+    int wanted = static_cast<int>(fraction * samples + 0.5);
+    int seen = 0;
+
+    for (int i = 0; i < latency_buckets; i++)
+    {
+        seen += buckets[i];
+
+        // The top of the bucket, so the percentile is never too small
+        if (seen >= wanted && seen > 0) return (i + 1) * latency_bucket_seconds;
+    }
+
+    return latency_max_seconds;
+}
+
+void LatencyHistogram::print(const char *name) const
+{
+    if (!samples) return;
+
+    printf("%-12s %6d frames  mean %7.2f  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f ms\n",
+           name, samples, mean() * 1000, percentile(0.5) * 1000, percentile(0.9) * 1000,
+           percentile(0.99) * 1000, maximum() * 1000);
+}
+
+LatencyTelemetry::LatencyTelemetry()
+{
+    clock_gettime(CLOCK_MONOTONIC, &lastReport);
+}
+
+void LatencyTelemetry::report()
+{
+    printf("Latency:\n");
+    detect.print("to detect");
+    send.print("to send");
+    echo.print("to echo");
+    roundTrip.print("send to echo");
+
+    clock_gettime(CLOCK_MONOTONIC, &lastReport);
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,66 @@
+/* Latency telemetry
+ *
+ * Every frame carries its sequence number and the CLOCK_MONOTONIC time it was
+ * captured, and the pipeline stamps the time each stage finished. These
+ * histograms collect how long frames take from capture to detection, from
+ * capture to the message to the cRIO, and from capture until the message
+ * comes back from an echo server such as udp_echo.
+ *
+ * Latencies are kept in buckets of latency_bucket_seconds up to
+ * latency_max_seconds, so recording is a division and an increment and the
+ * percentiles are good to a bucket.
+ */
+
+#ifndef TELEMETRY_HPP
+#define TELEMETRY_HPP
+
+#include <ctime>
+
+static constexpr double latency_bucket_seconds = 0.0001;    // 0.1 ms buckets
+static constexpr double latency_max_seconds = 1;             // Slower frames go in the last bucket
+static constexpr int latency_buckets = 10000;
+static constexpr double latency_report_interval = 5;         // Seconds between reports with --latency
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void record(double seconds);
+    void reset();
+
+    int count() const { return samples; }
+    double mean() const { return samples ? total / samples : 0; }
+    double maximum() const { return largest; }
+
+    // The latency below which this fraction of the samples fall, in seconds
+    double percentile(double fraction) const;
+
+    // One line with the count, mean, p50, p90, p99 and max in milliseconds
+    void print(const char *name) const;
+
+private:
+    int buckets[latency_buckets];
+    int samples;
+    double total;
+    double largest;
+};
+
+// The latencies of all of the cameras, recorded on the GUI thread
+struct LatencyTelemetry
+{
+    LatencyTelemetry();
+
+    void report();
+
+    LatencyHistogram detect;        // Capture to targets found
+    LatencyHistogram send;          // Capture to message sent
+    LatencyHistogram echo;          // Capture to message back from the echo server
+    LatencyHistogram roundTrip;     // Message sent to message back
+
+    timespec lastReport;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,234 @@
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// The pool and queue index of the worker running on this thread
+static thread_local ThreadPool *current_pool = 0;
+static thread_local int current_worker = -1;
+
+ThreadPool::ThreadPool(int threads, bool pinned_)
+    : pending(0), nextQueue(0), stopping(false), pinned(pinned_)
+{
+    if (threads <= 0) threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads <= 0) threads = 1;
+
+    for (int i = 0; i < threads; i++)
+    {
+        queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping = true;
+    }
+
+    wake.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+}
+
+void ThreadPool::submit(const std::function<void()> &task)
+{
+    size_t index;
+
+    // Workers keep their own tasks, everybody else spreads them around
+    if (current_pool == this)
+    {
+        index = static_cast<size_t>(current_worker);
+    }
+    else
+    {
+        index = nextQueue++ % queues.size();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(queues[index]->lock);
+        queues[index]->tasks.push_back(task);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        pending++;
+    }
+
+    wake.notify_one();
+}
+
+/* Take the newest task of our own queue, or steal the oldest task of
+ * another queue. index is -1 for threads that are not workers.
+ */
+bool ThreadPool::popTask(int index, std::function<void()> &task)
+{
+    size_t count = queues.size();
+
+    if (index >= 0)
+    {
+        WorkQueue &own = *queues[static_cast<size_t>(index)];
+        std::lock_guard<std::mutex> guard(own.lock);
+
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            pending--;
+            return true;
+        }
+    }
+
+    size_t start = index >= 0 ? static_cast<size_t>(index) + 1 : 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        WorkQueue &victim = *queues[(start + i) % count];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            pending--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ThreadPool::runPendingTask()
+{
+    std::function<void()> task;
+    int index = current_pool == this ? current_worker : -1;
+
+    if (!popTask(index, task)) return false;
+
+    task();
+    return true;
+}
+
+// Keep the worker on one core, where the OS supports it
+void ThreadPool::pinWorker(int index)
+{
+#ifdef __linux__
+    int cores = static_cast<int>(std::thread::hardware_concurrency());
+
+    if (cores <= 0) return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % cores, &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    {
+        printf("Could not pin worker %d to a core\n", index);
+    }
+#else
+    (void)index;
+#endif
+}
+
+void ThreadPool::workerLoop(int index)
+{
+    current_pool = this;
+    current_worker = index;
+
+    if (pinned) pinWorker(index);
+
+    while (true)
+    {
+        std::function<void()> task;
+
+        if (popTask(index, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this] { return pending > 0 || stopping; });
+
+        if (stopping && pending == 0) return;
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool &pool_)
+    : pool(pool_), outstanding(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(const std::function<void()> &task)
+{
+    outstanding++;
+
+    pool.submit([this, task]
+    {
+        task();
+
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (--outstanding == 0) done.notify_all();
+    });
+}
+
+void TaskGroup::wait()
+{
+    while (outstanding > 0)
+    {
+        // Help out instead of sitting idle
+        if (pool.runPendingTask()) continue;
+
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait_for(guard, std::chrono::milliseconds(1), [this] { return outstanding == 0; });
+    }
+
+    // The last task may still be holding the lock after it counted down
+    std::lock_guard<std::mutex> guard(lock);
+}
+
+void parallelFor(ThreadPool &pool, int count, int minParallel,
+                 const std::function<void(int, int)> &body)
+{
+    int chunks = std::min(count, pool.size());
+
+    if (count < minParallel || chunks <= 1)
+    {
+        if (count > 0) body(0, count);
+        return;
+    }
+
+    TaskGroup group(pool);
+
+    for (int i = 0; i < chunks; i++)
+    {
+        int begin = count * i / chunks;
+        int end = count * (i + 1) / chunks;
+
+        group.run([&body, begin, end] { body(begin, end); });
+    }
+
+    group.wait();
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,101 @@
+/* Work stealing thread pool
+ *
+ * One pool is shared by every camera and every parallel stage, sized to the
+ * number of cores. Each worker has its own queue: tasks submitted by a worker
+ * go onto its own queue and it takes the newest one first, while idle workers
+ * steal the oldest tasks from the other queues. Tasks submitted from outside
+ * the pool are spread over the queues round robin.
+ *
+ * A TaskGroup waits for a set of tasks. While it waits, the waiting thread
+ * runs queued tasks itself, so a task may start and wait for more tasks
+ * without tying up a worker.
+ *
+ * A pinned pool keeps each worker on its own core, so the image bands a
+ * worker touches stay in that core's cache from frame to frame.
+ */
+
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+public:
+    /* A pool of the given number of workers, 0 uses one worker per core.
+     * pinned binds worker i to core i.
+     */
+    explicit ThreadPool(int threads = 0, bool pinned = false);
+    ~ThreadPool();
+
+    void submit(const std::function<void()> &task);
+
+    // Run one queued task on the calling thread, returns false if there was none
+    bool runPendingTask();
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<std::function<void()> > tasks;
+    };
+
+    void workerLoop(int index);
+    void pinWorker(int index);
+    bool popTask(int index, std::function<void()> &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue> > queues;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::atomic<int> pending;               // Number of tasks sitting in the queues
+    std::atomic<unsigned> nextQueue;        // Round robin queue for outside submissions
+    std::atomic<bool> stopping;
+    bool pinned;
+};
+
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool &pool);
+    ~TaskGroup();
+
+    void run(const std::function<void()> &task);
+
+    // Wait for every task of the group, running queued tasks in the meantime
+    void wait();
+
+private:
+    TaskGroup(const TaskGroup &);
+    TaskGroup &operator=(const TaskGroup &);
+
+    ThreadPool &pool;
+    std::atomic<int> outstanding;
+    std::mutex lock;
+    std::condition_variable done;
+};
+
+/* Call body(begin, end) on chunks covering [0, count), one chunk per worker.
+ * Jobs with fewer than minParallel items run inline on the calling thread.
+ * Every index belongs to exactly one chunk, so results stored by index come
+ * out in the same order for any number of threads.
+ */
+void parallelFor(ThreadPool &pool, int count, int minParallel,
+                 const std::function<void(int, int)> &body);
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
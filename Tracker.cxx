@@ -0,0 +1,256 @@
+#include "Tracker.hpp"
+
+#include <cmath>
+
+// Measurement noise (variance) and process noise (acceleration spectral density) per channel
+static constexpr float center_x_noise = 4;         // pixels^2
+static constexpr float center_x_process = 2000;
+static constexpr float distance_y_noise = 16;      // inches^2
+static constexpr float distance_y_process = 800;
+static constexpr float angle_x_noise = 0.1f;       // degrees^2
+static constexpr float angle_x_process = 50;
+
+static constexpr float initial_rate_variance = 1e4f;  // We know nothing about the rate of a new track
+
+void KalmanChannel::init(float z, float r)
+{
+    x = z;
+    v = 0;
+    p00 = r;
+    p01 = 0;
+    p11 = initial_rate_variance;
+}
+
+// Move the state dt seconds forward, q is the white acceleration noise density
+void KalmanChannel::predict(float dt, float q)
+{
+    if (dt <= 0) return;
+
+    x += v * dt;
+
+    p00 += dt * (2 * p01 + dt * p11) + q * dt * dt * dt / 3;
+    p01 += dt * p11 + q * dt * dt / 2;
+    p11 += q * dt;
+}
+
+// Correct the state with the measurement z that has a variance of r
+void KalmanChannel::update(float z, float r)
+{
+    float s = p00 + r;
+    float k0 = p00 / s;
+    float k1 = p01 / s;
+    float y = z - x;
+
+    x += k0 * y;
+    v += k1 * y;
+
+    p11 -= k1 * p01;
+    p01 -= k0 * p01;
+    p00 -= k0 * p00;
+}
+
+/* Middle targets change between left, right and plain middle depending on
+ * what else is in the picture, so they all belong to the same track.
+ */
+static bool isMiddle(TargetType targetType)
+{
+    return targetType == TARGET_HEIGHT_MIDDLE ||
+           targetType == TARGET_HEIGHT_MIDDLE_LEFT ||
+           targetType == TARGET_HEIGHT_MIDDLE_RIGHT;
+}
+
+static bool compatibleTypes(TargetType a, TargetType b)
+{
+    return a == b || ( isMiddle(a) && isMiddle(b) );
+}
+
+TargetTracker::TargetTracker()
+{
+    nextId = 1;
+}
+
+void TargetTracker::reset()
+{
+    for (int i = 0; i < max_tracks; i++)
+    {
+        tracks[i].active = false;
+    }
+}
+
+// Find the closest free track that the target could belong to, -1 if there is none
+int TargetTracker::findTrack(const TargetData &target, double captureTime, const bool *matched) const
+{
+    int best = -1;
+    float bestDistance = track_gate_pixels;
+
+    for (int i = 0; i < max_tracks; i++)
+    {
+        const TargetTrack &track = tracks[i];
+
+        if (!track.active || matched[i]) continue;
+        if (!compatibleTypes(track.last.targetType, target.targetType)) continue;
+
+        float dx = track.centerX.valueAt(static_cast<float>(captureTime - track.lastTime)) - target.centerX;
+        float dy = track.last.centerY - target.centerY;
+        float distance = std::sqrt(dx * dx + dy * dy);
+
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+void TargetTracker::update(const TargetBatch &targets, const TargetGroup &targetGroup, double captureTime)
+{
+    bool matched[max_tracks] = { false };
+    int slots[] = { targetGroup.high, targetGroup.middleLeft, targetGroup.middleRight, targetGroup.low };
+
+    // Throw away the tracks we have not seen in a while
+    for (int i = 0; i < max_tracks; i++)
+    {
+        if (tracks[i].active && captureTime - tracks[i].lastTime > track_drop_time)
+        {
+            tracks[i].active = false;
+        }
+    }
+
+    for (size_t slot = 0; slot < sizeof(slots) / sizeof(slots[0]); slot++)
+    {
+        if (slots[slot] < 0) continue;
+
+        TargetData target = targets.get(slots[slot]);
+
+        int i = findTrack(target, captureTime, matched);
+
+        if (i < 0)
+        {
+            // Start a new track in the first free slot, or replace the oldest one
+            i = 0;
+
+            for (int k = 0; k < max_tracks; k++)
+            {
+                if (!tracks[k].active)
+                {
+                    i = k;
+                    break;
+                }
+
+                if (tracks[k].lastTime < tracks[i].lastTime) i = k;
+            }
+
+            TargetTrack &track = tracks[i];
+            track.id = nextId++;
+            track.active = true;
+            track.hits = 0;
+            track.centerX.init(target.centerX, center_x_noise);
+            track.distanceY.init(target.distanceY, distance_y_noise);
+            track.angleX.init(target.angleX, angle_x_noise);
+        }
+        else
+        {
+            TargetTrack &track = tracks[i];
+            float dt = static_cast<float>(captureTime - track.lastTime);
+
+            track.centerX.predict(dt, center_x_process);
+            track.distanceY.predict(dt, distance_y_process);
+            track.angleX.predict(dt, angle_x_process);
+
+            track.centerX.update(target.centerX, center_x_noise);
+            track.distanceY.update(target.distanceY, distance_y_noise);
+            track.angleX.update(target.angleX, angle_x_noise);
+        }
+
+        TargetTrack &track = tracks[i];
+        track.hits++;
+        track.lastTime = captureTime;
+        track.last = target;
+        matched[i] = true;
+    }
+}
+
+// The confirmed live track of a given type with the most detections
+const TargetTrack *TargetTracker::bestTrack(TargetType targetType, double sendTime) const
+{
+    const TargetTrack *best = 0;
+
+    for (int i = 0; i < max_tracks; i++)
+    {
+        const TargetTrack &track = tracks[i];
+
+        if (!track.active || track.last.targetType != targetType) continue;
+        if (track.hits < track_confirm_hits) continue;
+        if (sendTime - track.lastTime > track_max_coast) continue;
+
+        if (!best || track.hits > best->hits) best = &track;
+    }
+
+    return best;
+}
+
+// The target of a track as we expect it to be at sendTime
+TargetData TargetTracker::predict(const TargetTrack &track, double sendTime) const
+{
+    TargetData target = track.last;
+    float dt = static_cast<float>(sendTime - track.lastTime);
+
+    target.centerX = track.centerX.valueAt(dt);
+    target.distanceY = track.distanceY.valueAt(dt);
+    target.angleX = track.angleX.valueAt(dt);
+    target.valid = true;
+
+    return target;
+}
+
+bool TargetTracker::getSelected(double sendTime, TargetData &selected) const
+{
+    const TargetTrack *high = bestTrack(TARGET_HEIGHT_HIGH, sendTime);
+    const TargetTrack *low = bestTrack(TARGET_HEIGHT_LOW, sendTime);
+    const TargetTrack *middleLeft = bestTrack(TARGET_HEIGHT_MIDDLE_LEFT, sendTime);
+    const TargetTrack *middleRight = bestTrack(TARGET_HEIGHT_MIDDLE_RIGHT, sendTime);
+
+    // Same priority as getTargetGroup
+    if (high)
+    {
+        selected = predict(*high, sendTime);
+    }
+    else if (low)
+    {
+        selected = predict(*low, sendTime);
+    }
+    else if (middleLeft && middleRight)
+    {
+        TargetData left = predict(*middleLeft, sendTime);
+        TargetData right = predict(*middleRight, sendTime);
+
+        selected = TargetData();
+        selected.centerX = (left.centerX + right.centerX)/2;
+        selected.centerY = (left.centerY + right.centerY)/2;
+        selected.sizeX = (left.sizeX + right.sizeX)/2;
+        selected.sizeY = (left.sizeY + right.sizeY)/2;
+        selected.distanceX = (left.distanceX + right.distanceX)/2;
+        selected.distanceY = (left.distanceY + right.distanceY)/2;
+        selected.angleX = (left.angleX + right.angleX)/2;
+        selected.targetType = TARGET_HEIGHT_MIDDLE_COMBINED;
+        selected.valid = true;
+    }
+    else if (middleLeft)
+    {
+        selected = predict(*middleLeft, sendTime);
+    }
+    else if (middleRight)
+    {
+        selected = predict(*middleRight, sendTime);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// vim:set ts=2 sw=2 bs=2:
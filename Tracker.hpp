@@ -0,0 +1,107 @@
+/* Temporal target tracker
+ *
+ * The detector looks at every frame on its own, so the distance and angle
+ * it reports jump around from frame to frame and disappear completely when
+ * a single frame misses the targets. The tracker keeps a track for every
+ * target the grouping engine has put on the backboard, matches new ones to
+ * those tracks by target type and position, and runs a constant velocity
+ * Kalman filter on centerX, distanceY and angleX. The quads the grouping left
+ * out are never tracked, so a steady decoy cannot outvote the backboard.
+ *
+ * Every track is filtered at the time its frame was captured and can then be
+ * predicted forward to the time the message is sent to the cRIO, which takes
+ * out the latency of the image pipeline. A track that stops getting
+ * detections keeps coasting on its prediction for a short time before it is
+ * dropped.
+ */
+
+#ifndef TRACKER_HPP
+#define TRACKER_HPP
+
+#include "Target.hpp"
+
+static constexpr int max_tracks = 16;                  // Max number of targets tracked at once
+static constexpr int track_confirm_hits = 2;           // Detections needed before a track is reported
+static constexpr double track_max_coast = 0.5;         // Seconds a track is reported without a detection
+static constexpr double track_drop_time = 1.0;         // Seconds without a detection before a track is removed
+static constexpr float track_gate_pixels = 60;         // Max distance in pixels to match a detection to a track
+
+// A constant velocity Kalman filter of a single value and its rate of change
+struct KalmanChannel
+{
+    KalmanChannel()
+    {
+        x = 0;
+        v = 0;
+        p00 = 0;
+        p01 = 0;
+        p11 = 0;
+    }
+
+    void init(float z, float r);
+    void predict(float dt, float q);
+    void update(float z, float r);
+
+    // The value extrapolated dt seconds past the current state
+    float valueAt(float dt) const { return x + v * dt; }
+
+    float x;        // The filtered value
+    float v;        // The rate of change per second
+    float p00;      // The state covariance
+    float p01;
+    float p11;
+};
+
+// Struct containing a single tracked target
+struct TargetTrack
+{
+    TargetTrack()
+    {
+        id = 0;
+        active = false;
+        hits = 0;
+        lastTime = 0;
+    }
+
+    int id;
+    bool active;
+    int hits;                   // Number of detections matched to this track
+    double lastTime;            // Capture time of the last detection
+
+    KalmanChannel centerX;
+    KalmanChannel distanceY;
+    KalmanChannel angleX;
+
+    TargetData last;            // The last detection matched to this track
+};
+
+class TargetTracker
+{
+public:
+    TargetTracker();
+
+    /* Match the targets of the group of a frame captured at captureTime
+     * (CLOCK_MONOTONIC seconds) to the tracks and filter them in.
+     */
+    void update(const TargetBatch &targets, const TargetGroup &targetGroup, double captureTime);
+
+    /* Build the selected target as it is predicted to be at sendTime. Returns
+     * false if no confirmed track is alive.
+     */
+    bool getSelected(double sendTime, TargetData &selected) const;
+
+    // Forget all tracks
+    void reset();
+
+private:
+    int findTrack(const TargetData &target, double captureTime, const bool *matched) const;
+    const TargetTrack *bestTrack(TargetType targetType, double sendTime) const;
+    TargetData predict(const TargetTrack &track, double sendTime) const;
+
+    TargetTrack tracks[max_tracks];
+    int nextId;
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
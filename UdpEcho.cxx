@@ -0,0 +1,93 @@
+/* udp_echo: stands in for the cRIO and sends every message back
+ *
+ * Run it on the vision machine and point vision at it with
+ * "--crio 127.0.0.1:9999 --sendAge --latency" to measure the whole trip from
+ * capture to a message coming back. Prints each message with -v.
+ *
+ * Usage: udp_echo [-v] [port]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#define BUFFERSIZE              1024
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    int port = 9999;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0) verbose = true;
+        else port = atoi(argv[i]);
+    }
+
+    int _socket = socket(PF_INET, SOCK_DGRAM, 0);
+
+    if (_socket < 0)
+    {
+        perror("Socket");
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(port));
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(_socket, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        perror("Bind");
+        close(_socket);
+        return -1;
+    }
+
+    printf("Echoing UDP messages on port %d\n", port);
+
+    char buffer[BUFFERSIZE];
+    long count = 0;
+    time_t lastReport = time(0);
+
+    while (true)
+    {
+        struct sockaddr_in sender;
+        socklen_t senderLength = sizeof(sender);
+
+        ssize_t length = recvfrom(_socket, buffer, sizeof(buffer) - 1, 0,
+                                  reinterpret_cast<struct sockaddr*>(&sender), &senderLength);
+
+        if (length < 0)
+        {
+            perror("Receive");
+            continue;
+        }
+
+        sendto(_socket, buffer, static_cast<size_t>(length), 0,
+               reinterpret_cast<struct sockaddr*>(&sender), senderLength);
+
+        buffer[length] = '\0';
+        count++;
+
+        if (verbose) printf("%s\n", buffer);
+
+        // Print the message rate every few seconds
+        time_t now = time(0);
+
+        if (now - lastReport >= 5)
+        {
+            printf("%.1f messages/s\n", static_cast<double>(count) / static_cast<double>(now - lastReport));
+            count = 0;
+            lastReport = now;
+        }
+    }
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,603 @@
+#include "V4l2Capture.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static double seconds(const timespec &start, const timespec &end)
+{
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+static void addSeconds(timespec &time, double seconds)
+{
+    long nanoseconds = time.tv_nsec + static_cast<long>(seconds * 1e9);
+
+    time.tv_sec += nanoseconds / 1000000000;
+    time.tv_nsec = nanoseconds % 1000000000;
+}
+
+SystemV4l2Device::SystemV4l2Device(const std::string &path_)
+    : path(path_), fd(-1)
+{
+}
+
+SystemV4l2Device::~SystemV4l2Device()
+{
+    close();
+}
+
+bool SystemV4l2Device::open()
+{
+    fd = ::open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) perror(path.c_str());
+
+    return fd >= 0;
+}
+
+void SystemV4l2Device::close()
+{
+    if (fd >= 0) ::close(fd);
+
+    fd = -1;
+}
+
+int SystemV4l2Device::control(unsigned long request, void *argument)
+{
+    int result;
+
+    do result = ioctl(fd, request, argument);
+    while (result < 0 && errno == EINTR);
+
+    return result;
+}
+
+void *SystemV4l2Device::map(size_t length, off_t offset)
+{
+    return mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+void SystemV4l2Device::unmap(void *address, size_t length)
+{
+    munmap(address, length);
+}
+
+bool SystemV4l2Device::wait(double timeout)
+{
+    pollfd ready;
+    ready.fd = fd;
+    ready.events = POLLIN;
+    ready.revents = 0;
+
+    return poll(&ready, 1, static_cast<int>(timeout * 1000)) > 0 && (ready.revents & POLLIN);
+}
+
+// The bytes of a frame of the format, YUYV or I420
+static size_t frameSize(uint32_t pixelFormat, size_t bytesPerLine, size_t height)
+{
+    return pixelFormat == V4L2_PIX_FMT_YUV420 ? bytesPerLine * height * 3 / 2 : bytesPerLine * height;
+}
+
+static bool hasSuffix(const std::string &name, const std::string &suffix)
+{
+    return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+MockV4l2Device::MockV4l2Device(const std::string &file_)
+    : file(file_), frames(0), pixelFormat(hasSuffix(file_, ".i420") ? V4L2_PIX_FMT_YUV420 : V4L2_PIX_FMT_YUYV),
+      width(v4l2_width), height(v4l2_height), frameBytes(0), fps(v4l2_fps), streaming(false), sequence(0)
+{
+    next.tv_sec = 0;
+    next.tv_nsec = 0;
+}
+
+MockV4l2Device::~MockV4l2Device()
+{
+    close();
+}
+
+bool MockV4l2Device::open()
+{
+    frames = fopen(file.c_str(), "rb");
+
+    if (!frames) perror(file.c_str());
+
+    return frames != 0;
+}
+
+// The buffers stay, like the mappings of a real device outlive its file
+void MockV4l2Device::close()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (frames) fclose(frames);
+
+    frames = 0;
+    streaming = false;
+    queue.clear();
+    queuedBuffers.assign(queuedBuffers.size(), false);
+}
+
+// The next frame of the file, which starts over at the end
+bool MockV4l2Device::readFrame(uint8_t *data)
+{
+    if (fread(data, frameBytes, 1, frames) == 1) return true;
+
+    rewind(frames);
+    return fread(data, frameBytes, 1, frames) == 1;
+}
+
+// Only the requests V4l2FrameSource makes, checked like a driver would
+int MockV4l2Device::control(unsigned long request, void *argument)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int error = 0;
+
+    switch (request)
+    {
+        case VIDIOC_QUERYCAP:
+        {
+            v4l2_capability *capability = static_cast<v4l2_capability *>(argument);
+
+            memset(capability, 0, sizeof(*capability));
+            strncpy(reinterpret_cast<char *>(capability->driver), "mock", sizeof(capability->driver) - 1);
+            capability->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+            capability->device_caps = capability->capabilities;
+            break;
+        }
+
+        case VIDIOC_S_FMT:
+        {
+            v4l2_pix_format &format = static_cast<v4l2_format *>(argument)->fmt.pix;
+
+            if (streaming || !buffers.empty())
+            {
+                error = EBUSY;
+                break;
+            }
+
+            // The file has to be whole frames of the size asked for
+            fseek(frames, 0, SEEK_END);
+            long fileBytes = ftell(frames);
+            rewind(frames);
+
+            // The camera only has the one format
+            uint32_t bytesPerLine = pixelFormat == V4L2_PIX_FMT_YUV420 ? format.width : 2 * format.width;
+            size_t bytes = frameSize(pixelFormat, bytesPerLine, format.height);
+
+            if (!bytes || fileBytes < static_cast<long>(bytes) || fileBytes % bytes)
+            {
+                printf("%s is not made of %ux%u frames\n", file.c_str(), format.width, format.height);
+                error = EINVAL;
+                break;
+            }
+
+            width = format.width;
+            height = format.height;
+            frameBytes = bytes;
+
+            format.pixelformat = pixelFormat;
+            format.field = V4L2_FIELD_NONE;
+            format.bytesperline = bytesPerLine;
+            format.sizeimage = static_cast<uint32_t>(frameBytes);
+            break;
+        }
+
+        case VIDIOC_S_PARM:
+        {
+            v4l2_fract &interval = static_cast<v4l2_streamparm *>(argument)->parm.capture.timeperframe;
+
+            if (interval.numerator && interval.denominator) fps = std::max(1u, interval.denominator / interval.numerator);
+            break;
+        }
+
+        case VIDIOC_REQBUFS:
+        {
+            v4l2_requestbuffers *requestBuffers = static_cast<v4l2_requestbuffers *>(argument);
+
+            if (streaming) error = EBUSY;
+            else if (requestBuffers->memory != V4L2_MEMORY_MMAP) error = EINVAL;
+            else
+            {
+                buffers.assign(requestBuffers->count, std::vector<uint8_t>(frameBytes));
+                queuedBuffers.assign(requestBuffers->count, false);
+                queue.clear();
+            }
+            break;
+        }
+
+        case VIDIOC_QUERYBUF:
+        case VIDIOC_QBUF:
+        {
+            v4l2_buffer *buffer = static_cast<v4l2_buffer *>(argument);
+
+            if (buffer->index >= buffers.size() || buffer->memory != V4L2_MEMORY_MMAP)
+            {
+                error = EINVAL;
+            }
+            else if (request == VIDIOC_QUERYBUF)
+            {
+                buffer->length = static_cast<uint32_t>(frameBytes);
+                buffer->m.offset = static_cast<uint32_t>(buffer->index * frameBytes);
+            }
+            else if (queuedBuffers[buffer->index])
+            {
+                // Queued twice, the pipeline let go of a frame twice
+                error = EINVAL;
+            }
+            else
+            {
+                queuedBuffers[buffer->index] = true;
+                queue.push_back(buffer->index);
+            }
+            break;
+        }
+
+        case VIDIOC_DQBUF:
+        {
+            v4l2_buffer *buffer = static_cast<v4l2_buffer *>(argument);
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            if (!streaming)
+            {
+                error = EINVAL;
+                break;
+            }
+
+            if (queue.empty() || seconds(now, next) > 0)
+            {
+                error = EAGAIN;
+                break;
+            }
+
+            int index = queue.front();
+            queue.pop_front();
+            queuedBuffers[index] = false;
+
+            buffer->index = index;
+            buffer->bytesused = readFrame(&buffers[index][0]) ? static_cast<uint32_t>(frameBytes) : 0;
+            buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | (buffer->bytesused ? 0 : V4L2_BUF_FLAG_ERROR);
+            buffer->field = V4L2_FIELD_NONE;
+            buffer->sequence = static_cast<uint32_t>(sequence++);
+            buffer->timestamp.tv_sec = now.tv_sec;
+            buffer->timestamp.tv_usec = now.tv_nsec / 1000;
+
+            // A frame every 1 / fps, without catching up after a late one
+            if (seconds(next, now) > 1.0 / fps) next = now;
+
+            addSeconds(next, 1.0 / fps);
+            break;
+        }
+
+        case VIDIOC_STREAMON:
+            streaming = true;
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            break;
+
+        case VIDIOC_STREAMOFF:
+            streaming = false;
+            queue.clear();
+            queuedBuffers.assign(queuedBuffers.size(), false);
+            break;
+
+        default:
+            error = ENOTTY;
+            break;
+    }
+
+    errno = error;
+    return error ? -1 : 0;
+}
+
+void *MockV4l2Device::map(size_t length, off_t offset)
+{
+    if (!frameBytes || length != frameBytes) return MAP_FAILED;
+
+    size_t index = static_cast<size_t>(offset) / frameBytes;
+
+    if (index >= buffers.size()) return MAP_FAILED;
+
+    return &buffers[index][0];
+}
+
+void MockV4l2Device::unmap(void *, size_t)
+{
+}
+
+bool MockV4l2Device::wait(double timeout)
+{
+    timespec now;
+    double due;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        due = streaming && !queue.empty() ? seconds(now, next) : timeout + 1;
+    }
+
+    // No buffer queued, the driver has nothing to fill
+    if (due > timeout)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+        return false;
+    }
+
+    if (due > 0) std::this_thread::sleep_for(std::chrono::duration<double>(due));
+
+    return true;
+}
+
+/* The mapped buffers of a device. Every lease holds the stream, so the
+ * buffers stay mapped until the last frame is let go of, even after the
+ * source stopped streaming and closed the device.
+ */
+struct V4l2Stream
+{
+    V4l2Stream(V4l2Device *device_):
+        device(device_),
+        pixelFormat(0),
+        width(0),
+        height(0),
+        bytesPerLine(0),
+        opened(false),
+        streaming(false)
+    {
+    }
+
+    ~V4l2Stream()
+    {
+        stop();
+
+        for (size_t i = 0; i < starts.size(); i++) device->unmap(starts[i], lengths[i]);
+    }
+
+    void stop()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (streaming)
+        {
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            device->control(VIDIOC_STREAMOFF, &type);
+            streaming = false;
+        }
+
+        if (opened) device->close();
+
+        opened = false;
+    }
+
+    // Give a buffer back to the driver, unless it stopped streaming
+    void requeue(int index)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!streaming) return;
+
+        v4l2_buffer buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = index;
+
+        if (device->control(VIDIOC_QBUF, &buffer) < 0) perror("VIDIOC_QBUF");
+    }
+
+    std::unique_ptr<V4l2Device> device;
+    std::mutex lock;
+
+    std::vector<void *> starts;         // The mapped buffers
+    std::vector<size_t> lengths;
+    uint32_t pixelFormat;               // YUYV or I420
+    int width, height, bytesPerLine;
+
+    bool opened;
+    bool streaming;
+};
+
+V4l2FrameSource::V4l2FrameSource(V4l2Device *device)
+    : stream(std::make_shared<V4l2Stream>(device)), grabbed(-1)
+{
+}
+
+V4l2FrameSource::~V4l2FrameSource()
+{
+    stream->stop();
+}
+
+/* Set up frames of v4l2_width by v4l2_height in mapped buffers and start
+ * streaming. The frames are YUYV, or I420 if the camera offers that instead.
+ */
+bool V4l2FrameSource::open()
+{
+    V4l2Device &device = *stream->device;
+
+    if (!device.open()) return false;
+
+    stream->opened = true;
+
+    v4l2_capability capability;
+    memset(&capability, 0, sizeof(capability));
+
+    if (device.control(VIDIOC_QUERYCAP, &capability) < 0 ||
+        !(capability.capabilities & V4L2_CAP_VIDEO_CAPTURE) || !(capability.capabilities & V4L2_CAP_STREAMING))
+    {
+        printf("The V4L2 device can't stream video\n");
+        return false;
+    }
+
+    v4l2_format format;
+    memset(&format, 0, sizeof(format));
+    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.fmt.pix.width = v4l2_width;
+    format.fmt.pix.height = v4l2_height;
+    format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    format.fmt.pix.field = V4L2_FIELD_NONE;
+
+    if (device.control(VIDIOC_S_FMT, &format) < 0 || (format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV && 
+                                                      format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUV420))
+    {
+        printf("The V4L2 device has no YUYV or I420 frames\n");
+        return false;
+    }
+
+    stream->pixelFormat = format.fmt.pix.pixelformat;
+    stream->width = format.fmt.pix.width;
+    stream->height = format.fmt.pix.height;
+
+    int pixelBytes = stream->pixelFormat == V4L2_PIX_FMT_YUV420 ? 1 : 2;
+    stream->bytesPerLine = std::max(static_cast<int>(format.fmt.pix.bytesperline), pixelBytes * stream->width);
+
+    // Not every camera can set its frame rate
+    v4l2_streamparm parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    parameters.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    parameters.parm.capture.timeperframe.numerator = 1;
+    parameters.parm.capture.timeperframe.denominator = v4l2_fps;
+    device.control(VIDIOC_S_PARM, &parameters);
+
+    v4l2_requestbuffers request;
+    memset(&request, 0, sizeof(request));
+    request.count = v4l2_buffers;
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.memory = V4L2_MEMORY_MMAP;
+
+    if (device.control(VIDIOC_REQBUFS, &request) < 0 || request.count < 2)
+    {
+        perror("VIDIOC_REQBUFS");
+        return false;
+    }
+
+    for (unsigned i = 0; i < request.count; i++)
+    {
+        v4l2_buffer buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+        buffer.index = i;
+
+        if (device.control(VIDIOC_QUERYBUF, &buffer) < 0)
+        {
+            perror("VIDIOC_QUERYBUF");
+            return false;
+        }
+
+        void *start = device.map(buffer.length, buffer.m.offset);
+
+        if (start == MAP_FAILED)
+        {
+            perror("V4L2 mmap");
+            return false;
+        }
+
+        stream->starts.push_back(start);
+        stream->lengths.push_back(buffer.length);
+
+        if (device.control(VIDIOC_QBUF, &buffer) < 0)
+        {
+            perror("VIDIOC_QBUF");
+            return false;
+        }
+    }
+
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (device.control(VIDIOC_STREAMON, &type) < 0)
+    {
+        perror("VIDIOC_STREAMON");
+        return false;
+    }
+
+    stream->streaming = true;
+    return true;
+}
+
+// Dequeue the next filled buffer, skipping the ones the driver marks as bad
+bool V4l2FrameSource::grab()
+{
+    if (grabbed >= 0) stream->requeue(grabbed);
+
+    grabbed = -1;
+
+    size_t frameBytes = frameSize(stream->pixelFormat, stream->bytesPerLine, stream->height);
+
+    while (stream->device->wait(v4l2_poll_timeout))
+    {
+        v4l2_buffer buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buffer.memory = V4L2_MEMORY_MMAP;
+
+        int result;
+
+        {
+            std::lock_guard<std::mutex> guard(stream->lock);
+            result = stream->device->control(VIDIOC_DQBUF, &buffer);
+        }
+
+        if (result < 0)
+        {
+            if (errno == EAGAIN) continue;
+
+            perror("VIDIOC_DQBUF");
+            return false;
+        }
+
+        if ((buffer.flags & V4L2_BUF_FLAG_ERROR) || buffer.bytesused < frameBytes)
+        {
+            stream->requeue(buffer.index);
+            continue;
+        }
+
+        grabbed = buffer.index;
+        return true;
+    }
+
+    return false;
+}
+
+// A copy of the frame, like VideoCapture gives
+bool V4l2FrameSource::retrieve(cv::Mat &frame)
+{
+    FrameLease lent;
+
+    if (!lease(lent)) return false;
+
+    lent->copyTo(frame);
+    return true;
+}
+
+// The frame as a header on its buffer, which is queued again when the lease is let go of
+bool V4l2FrameSource::lease(FrameLease &frame)
+{
+    if (grabbed < 0) return false;
+
+    int index = grabbed;
+    std::shared_ptr<V4l2Stream> owner = stream;
+
+    bool i420 = stream->pixelFormat == V4L2_PIX_FMT_YUV420;
+
+    grabbed = -1;
+    frame = FrameLease(new cv::Mat(i420 ? stream->height * 3 / 2 : stream->height, stream->width,
+                                   i420 ? CV_8UC1 : CV_8UC2, stream->starts[index], stream->bytesPerLine),
+                       [owner, index](const cv::Mat *header)
+                       {
+                           owner->requeue(index);
+                           delete header;
+                       });
+
+    return true;
+}
+
+// vim:set ts=2 sw=2 bs=2:
@@ -0,0 +1,138 @@
+/* V4L2 capture
+ *
+ * A USB camera on the coprocessor is read straight through V4L2 rather than
+ * VideoCapture, which copies every frame at least once more. The driver
+ * fills v4l2_buffers buffers mapped into our memory, and each frame goes to
+ * the pipeline as a cv::Mat header on its buffer without a copy. The buffer
+ * is only queued back to the driver once the pipeline lets go of the
+ * FrameLease. The frames are YUYV, or I420 from a camera that only has
+ * that, which the pipeline makes its mask from without converting them.
+ *
+ * Every call to the driver goes through a V4l2Device, so MockV4l2Device can
+ * stand in for a camera on a machine without one. It serves the frames of a
+ * file of raw YUYV frames in a loop, made for instance with
+ *
+ *     ffmpeg -i match.avi -s 320x240 -pix_fmt yuyv422 -f rawvideo match.yuyv
+ *
+ * or of I420 frames (-pix_fmt yuv420p) when the file name ends in .i420,
+ * and refuses buffers that are queued or dequeued out of turn like a driver.
+ */
+
+#ifndef V4L2CAPTURE_HPP
+#define V4L2CAPTURE_HPP
+
+#include "Capture.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+static constexpr int v4l2_buffers = 4;          // The driver fills two while the newest frame and the pipeline's wait
+static constexpr int v4l2_width = 320;
+static constexpr int v4l2_height = 240;
+static constexpr int v4l2_fps = 30;
+static constexpr double v4l2_poll_timeout = 0.5;     // Seconds without a frame before a grab fails
+
+// The calls a V4l2FrameSource makes to the driver
+class V4l2Device
+{
+public:
+    virtual ~V4l2Device() {}
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
+
+    // Like ioctl(2), -1 with errno set on failure
+    virtual int control(unsigned long request, void *argument) = 0;
+
+    // Like mmap(2) and munmap(2) of the device
+    virtual void *map(size_t length, off_t offset) = 0;
+    virtual void unmap(void *address, size_t length) = 0;
+
+    // Wait at most timeout seconds for a filled buffer
+    virtual bool wait(double timeout) = 0;
+};
+
+// A video device such as /dev/video0
+class SystemV4l2Device : public V4l2Device
+{
+public:
+    explicit SystemV4l2Device(const std::string &path);
+    ~SystemV4l2Device();
+
+    bool open();
+    void close();
+    int control(unsigned long request, void *argument);
+    void *map(size_t length, off_t offset);
+    void unmap(void *address, size_t length);
+    bool wait(double timeout);
+
+private:
+    std::string path;
+    int fd;
+};
+
+// A camera made of a file of raw YUYV frames
+class MockV4l2Device : public V4l2Device
+{
+public:
+    explicit MockV4l2Device(const std::string &file);
+    ~MockV4l2Device();
+
+    bool open();
+    void close();
+    int control(unsigned long request, void *argument);
+    void *map(size_t length, off_t offset);
+    void unmap(void *address, size_t length);
+    bool wait(double timeout);
+
+private:
+    bool readFrame(uint8_t *data);
+
+    std::mutex lock;                    // The pipeline queues buffers while the reader waits
+    std::string file;
+    FILE *frames;
+    uint32_t pixelFormat;               // YUYV, or I420 for a .i420 file
+    int width, height;
+    size_t frameBytes;
+    int fps;
+    bool streaming;
+    std::vector<std::vector<uint8_t> > buffers;
+    std::vector<bool> queuedBuffers;
+    std::deque<int> queue;              // Queued buffers in the order they are filled
+    unsigned long sequence;
+    timespec next;                      // When the next frame is due
+};
+
+struct V4l2Stream;
+
+class V4l2FrameSource : public FrameSource
+{
+public:
+    explicit V4l2FrameSource(V4l2Device *device);   // Takes the device over
+    ~V4l2FrameSource();
+
+    bool open();
+    bool grab();
+    bool retrieve(cv::Mat &frame);
+    bool lease(FrameLease &frame);
+    bool live() const { return true; }
+
+private:
+    V4l2FrameSource(const V4l2FrameSource &);
+    V4l2FrameSource &operator=(const V4l2FrameSource &);
+
+    std::shared_ptr<V4l2Stream> stream;     // Also held by the leases
+    int grabbed;                            // The buffer grab() dequeued, -1 if none
+};
+
+#endif
+
+// vim:set ts=2 sw=2 bs=2:
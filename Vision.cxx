@@ -7,18 +7,101 @@
 #include <cerrno>
 #include <cstring>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <resolv.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <glob.h>
 
 using namespace cv;
 using namespace std;
 
+/* The tuning parameters that can be set in the --config file, under the
+ * names of the statics in Vision.hpp
+ */
+static const ConfigParameter config_parameters[] = 
+{
+	{ "thresh", &thresh, 0, max_thresh },
+	{ "thresh_block_size", &thresh_block_size, 1, max_thresh_block_size },
+	{ "poly_epsilon", &poly_epsilon, 0, max_poly_epsilon },
+	{ "minsize", &minsize, 0, max_minsize },
+	{ "dilation_elem", &dilation_elem, 0, max_elem },
+	{ "dilation_size", &dilation_size, 0, max_kernel_size },
+	{ "erode_count", &erode_count, 0, erode_max },
+	{ "blue_plane", &BLUE_PLANE, 0, 2 },
+	{ "green_plane", &GREEN_PLANE, 0, 2 },
+	{ "red_plane", &RED_PLANE, 0, 2 },
+	{ "color_lut", &color_lut, 0, 1 },
+	{ "lut_hue_min", &lut_hue_min, 0, max_hue },
+	{ "lut_hue_max", &lut_hue_max, 0, max_hue },
+	{ "lut_saturation_min", &lut_saturation_min, 0, 255 },
+	{ "lut_value_min", &lut_value_min, 0, 255 },
+	{ "fixed_point", &fixed_point, 0, 1 },
+	{ "motion_tolerance", &motion_tolerance, 0, 255 },
+	{ "motion_refresh", &motion_refresh, 0, max_motion_refresh },
+	{ "stream_quality", &stream_quality, 0, 100 },
+	{ "stream_fps", &stream_fps, 1, max_stream_fps }
+};
+
+// The distance fits of getTargetData() as tables, used with fixed_point
+static const PowerTable distance_x_table(11263, -1.061f);
+static const PowerTable distance_y_table(7239, -1.025f);
+
 void initObjs()
 {
-	src = new Mat();
 	options = new OptionsProcess();
+	pipelines = new vector<PipelineContext*>();
+	pool = new ThreadPool(0, true);
+	telemetry = new LatencyTelemetry();
+	targetLog = new TargetLogWriter();
+	metrics = new MetricsRegistry();
+	config = new ConfigFile(config_parameters, sizeof(config_parameters) / sizeof(config_parameters[0]));
+	classifier = new ColorClassifier();
+
+	// The pool already uses every core, so keep OpenCV from starting threads of its own
+	setNumThreads(0);
+}
+
+void deleteObjs()
+{
+	for (size_t i = 0; i < pipelines->size(); i++) 
+	{
+		PipelineContext *context = (*pipelines)[i];
+
+		if (context->capture) 
+		{
+			CaptureStats stats = context->capture->stats();
+
+			if (stats.stalls || stats.reconnects) 
+			{
+				printf("Camera %d: %lu frames, %lu stalls, %lu reconnects, longest gap %.1f s\n", context->index, 
+				       stats.frames, stats.stalls, stats.reconnects, stats.maxGapSeconds);
+			}
+		}
+
+		delete context;
+	}
+
+	if (options->latency) telemetry->report();
+
+	closeCrioSocket();
+	targetLog->close();
+
+	delete pipelines;
+	delete pool;
+	delete telemetry;
+	delete targetLog;
+	delete metrics;
+	delete config;
+	delete classifier;
+	delete options;
 }
 
 // A timer using the timespec struct
@@ -40,6 +123,12 @@ timespec diff(timespec start, timespec end)
     return temp;
 }
 
+// Convert a timespec into floating point seconds
+double toSeconds(timespec ts)
+{
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
  /// Function header
 void processImageCallback(int, void* );
 
@@ -94,27 +183,45 @@ void calcHistogram(Mat &source)
     }
   
     // Display the histogram
-    namedWindow("Histogram", CV_WINDOW_AUTOSIZE );
     imshow("Histogram", histImage );
 }
 
 
+// The titles of the windows of a camera, in DebugWindow order
+static const char *window_titles[WINDOW_COUNT] = 
+{
+    "Source", 
+    "Color", 
+    "Blur", 
+    "Dilate", 
+    "Threshold", 
+    "Contours", 
+    "Polygon", 
+    "PrunedPolygon", 
+    "Targets", 
+    "Final"
+};
+
 void createGuiWindows() 
 {
   /// Create all Windows
+  for (size_t i = 0; i < pipelines->size(); i++) 
+  {
+    PipelineContext &context = *(*pipelines)[i];
+
+    for (int window = 0; window < WINDOW_COUNT; window++) 
+    {
+      if (window != WINDOW_FINAL && !options->guiAll) continue;
+
+      namedWindow(windowName(context, window_titles[window]), CV_WINDOW_AUTOSIZE );
+    }
+  }
+
   if (options->guiAll) 
   {
-    namedWindow("Source", CV_WINDOW_AUTOSIZE );
-    namedWindow("Color", CV_WINDOW_AUTOSIZE );
-    namedWindow("Blur", CV_WINDOW_AUTOSIZE );
-    namedWindow("Dilate", CV_WINDOW_AUTOSIZE );
-    namedWindow("Threshold", CV_WINDOW_AUTOSIZE );
-    namedWindow("Contours", CV_WINDOW_AUTOSIZE );
-    namedWindow("Polygon", CV_WINDOW_AUTOSIZE );
-    namedWindow("PrunedPolygon", CV_WINDOW_AUTOSIZE );
-    namedWindow("Targets", CV_WINDOW_AUTOSIZE );
-    namedWindow("Final", CV_WINDOW_AUTOSIZE );
+    namedWindow("Histogram", CV_WINDOW_AUTOSIZE );
     
+    // The settings are shared by all cameras, so the trackbars go on the first camera's windows
     createTrackbar("minsize", "PrunedPolygon", &minsize, max_minsize, processImageCallback);
     createTrackbar("threshold", "Threshold", &thresh, max_thresh, processImageCallback);
     createTrackbar("block size", "Threshold", &thresh_block_size, max_thresh_block_size, processImageCallback);
@@ -122,6 +229,11 @@ void createGuiWindows()
     createTrackbar("Element: 0:Rect 1:Cross 2:Ellipse", "Dilate", &dilation_elem, max_elem, processImageCallback);
     createTrackbar("Kernel size:\n 2n+1", "Dilate", &dilation_size, max_kernel_size, processImageCallback);
     createTrackbar("Erode", "Dilate", &erode_count, erode_max, processImageCallback);
+    createTrackbar("Lookup table", "Color", &color_lut, 1, processImageCallback);
+    createTrackbar("Hue min", "Color", &lut_hue_min, max_hue, processImageCallback);
+    createTrackbar("Hue max", "Color", &lut_hue_max, max_hue, processImageCallback);
+    createTrackbar("Saturation min", "Color", &lut_saturation_min, 255, processImageCallback);
+    createTrackbar("Value min", "Color", &lut_value_min, 255, processImageCallback);
   }
 }
 
@@ -165,15 +277,13 @@ const char *getTargetTypeString(TargetType targetType)
 // Computes the offset of the Low Y values
 float computeLowYOffset(float distance) 
 {
-    return static_cast<float>
-					(-0.0009 * pow(distance, 2) + .3759 * (distance) + 83.232);
+    return (-0.0009f * distance + .3759f) * distance + 83.232f;
 }
 
 // Computes the offset of the Middle Y values
 float computeMidYOffset(float distance) 
 {
-  return static_cast<float>
-	  				(-0.0034 * pow(distance, 2) + 1.6519 * (distance) - 127.13);
+  return (-0.0034f * distance + 1.6519f) * distance - 127.13f;
 }
 
 // Computes the offset of the High Y values
@@ -198,312 +308,161 @@ float convertDistanceToTension(float distance)
 }
 
 /* Compute the type of target the camera is receving 
- * based on the Y offsets and the approximate height
+ * based on the Y offsets and the approximate height.
+ * All three tests are evaluated and combined without
+ * branches so the loop over a batch can be vectorized.
  */ 
-void computeTargetType(TargetData &target) 
+static inline TargetType classifyTargetHeight(float centerY, float distanceY) 
 {
-    if ( approximateHeight( computeLowYOffset(target.distanceY), target.centerY ) )     
-    {
-      target.targetType = TARGET_HEIGHT_LOW;
-    } 
-    else if ( approximateHeight( computeMidYOffset(target.distanceY), target.centerY ) ) 
-    {
-    target.targetType = TARGET_HEIGHT_MIDDLE;
-    } 
-    else if ( approximateHeight( computeHighYOffset(), target.centerY ) ) 
-    {
-    target.targetType = TARGET_HEIGHT_HIGH;
-    } 
-    else 
-    {
-    target.targetType = TARGET_HEIGHT_UNKNOWN;
-    }
+    int low = approximateHeight( computeLowYOffset(distanceY), centerY );
+    int middle = approximateHeight( computeMidYOffset(distanceY), centerY );
+    int high = approximateHeight( computeHighYOffset(), centerY );
+
+    // Low takes priority over middle, and middle over high
+    middle &= !low;
+    high &= !low & !middle;
+
+    return static_cast<TargetType>( low * TARGET_HEIGHT_LOW + 
+                                    middle * TARGET_HEIGHT_MIDDLE + 
+                                    high * TARGET_HEIGHT_HIGH );
 }
 
-/* Figure out which targets are of a certain target 
- * type and put them in a targetIndices vector.
- */ 
-void getTargetsType(vector<TargetData> &targets, vector<int> &targetIndices, TargetType targetType) 
+void computeTargetTypes(TargetBatch &targets) 
 {
-    for (size_t i = 0; i < targets.size(); i++) 
+    for (int i = 0; i < targets.count; i++) 
     {
-        if (targets[i].targetType == targetType) 
-        {
-            targetIndices.push_back(static_cast<int>(i));
-        }
+        targets.targetType[i] = classifyTargetHeight(targets.centerY[i], targets.distanceY[i]);
     }
 }
 
 
-void getTargetGroup(Mat &image, vector<TargetData> &targets, TargetGroup &targetGroup) 
+// Twice the area of a quad, which compares the same
+static float quadArea(const vector<Point2f> &quad) 
 {
-    vector<int> highTargetIndices;
-    getTargetsType(targets, highTargetIndices, TARGET_HEIGHT_HIGH);
-    
-    if (highTargetIndices.size()) 
+    float area = 0;
+
+    for (size_t j = 0; j < 4; j++) 
     {
-        targetGroup.high = targets[static_cast<size_t>(highTargetIndices[0])];
+        const Point2f &a = quad[j];
+        const Point2f &b = quad[(j + 1) % 4];
+        area += a.x * b.y - b.x * a.y;
     }
 
-    vector<int> lowTargetIndices;
-    getTargetsType(targets, lowTargetIndices, TARGET_HEIGHT_LOW);
-  
-    if (lowTargetIndices.size()) 
+    return abs(area);
+}
+
+/* The quads that go into the batch, in contour order. A frame has room for
+ * max_targets; a cluttered one keeps the largest, so the targets are not
+ * lost to the specks that happen to come first.
+ */
+static int keptQuads(const vector<vector<Point2f> > &targetQuads, size_t *kept) 
+{
+    size_t quads = targetQuads.size();
+
+    if (quads <= static_cast<size_t>(max_targets)) 
     {
-        targetGroup.low = targets[static_cast<size_t>(lowTargetIndices[0])];
+        for (size_t i = 0; i < quads; i++) kept[i] = i;
+        return static_cast<int>(quads);
     }
-  
-    vector<int> middleTargetIndices;
-    getTargetsType(targets, middleTargetIndices, TARGET_HEIGHT_MIDDLE);
-    
-    switch (middleTargetIndices.size()) 
-    {
-    
-        // We have two middle targets
-        case 2:
-            if (targets[static_cast<size_t>(middleTargetIndices[0])].centerX < 
-								targets[static_cast<size_t>(middleTargetIndices[1])].centerX) 
-            {
-                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-                targetGroup.middleLeft = targets[static_cast<size_t>(middleTargetIndices[0])];
-                targets[static_cast<size_t>(middleTargetIndices[1])].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-                targetGroup.middleRight = targets[static_cast<size_t>(middleTargetIndices[1])];
-            } 
-            else 
-            {
-                targets[static_cast<size_t>(middleTargetIndices[1])].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-                targetGroup.middleLeft = targets[static_cast<size_t>(middleTargetIndices[1])];
-                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-                targetGroup.middleRight = targets[static_cast<size_t>(middleTargetIndices[0])];
-            }
-        
-            break;
-    
-        // We only have one middle target
-        case 1:
-            // We also have a valid high or low
-            if (reinterpret_cast<unsigned char*>(&targetGroup.high.valid) || 
-								reinterpret_cast<unsigned char*>(&targetGroup.low.valid)) 
-            {
-                float centerX;
-      
-                // Get the center target x location
-                if (static_cast<bool>(targetGroup.high.valid)) 
-                {
-	                centerX = targetGroup.high.centerX;
-                } 
-                else 
-                {
-	                centerX = targetGroup.low.centerX;
-                }
 
-                // Based on the center target location, determine if the middle targets
-                // are left or right targets
-                if (targets[static_cast<size_t>(middleTargetIndices[0])].centerX < centerX) 
-                {
-	                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-	                targetGroup.middleLeft = targets[static_cast<size_t>(middleTargetIndices[0])];
-                } 
-                else 
-                {
-	                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-	                targetGroup.middleRight = targets[static_cast<size_t>(middleTargetIndices[0])];
-                }
+    vector<pair<float, size_t> > areas(quads);
 
-            /* If we don't have any center targets, assume that they are they are out of the
-             * image.  (i.e. don't assume that they are hidden)
-             */ 
-            } 
-            else 
-            {
-                if (targets[static_cast<size_t>(middleTargetIndices[0])].centerX > image.cols/2.0) 
-                {
-	                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-	                targetGroup.middleLeft = targets[static_cast<size_t>(middleTargetIndices[0])];
-                }           
-                else 
-                {
-	                targets[static_cast<size_t>(middleTargetIndices[0])].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-	                targetGroup.middleRight = targets[static_cast<size_t>(middleTargetIndices[0])];
-                }
-            }
-            
-            break;
+    for (size_t i = 0; i < quads; i++) 
+    {
+        areas[i] = make_pair(quadArea(targetQuads[i]), i);
     }
 
-    // Now determine the location of the center target, given other target data
-    if (static_cast<bool>(targetGroup.high.valid)) 
-    {
-        targetGroup.selected = targetGroup.high;
-    } 
-    else if (static_cast<bool>(targetGroup.low.valid)) 
-    {
-        targetGroup.selected = targetGroup.low;
-    } 
-    else if (static_cast<bool>(targetGroup.middleLeft.valid) && 
-							static_cast<bool>(targetGroup.middleRight.valid)) 
-    {
-        targetGroup.selected.centerX = (targetGroup.middleLeft.centerX + targetGroup.middleRight.centerX)/2;
-        targetGroup.selected.centerY = (targetGroup.middleLeft.centerY + targetGroup.middleRight.centerY)/2;
-        targetGroup.selected.sizeX = (targetGroup.middleLeft.sizeX + targetGroup.middleRight.sizeX)/2;
-        targetGroup.selected.sizeY = (targetGroup.middleLeft.sizeY + targetGroup.middleRight.sizeY)/2;
-        targetGroup.selected.distanceX = (targetGroup.middleLeft.distanceX + targetGroup.middleRight.distanceX)/2;
-        targetGroup.selected.distanceY = (targetGroup.middleLeft.distanceY + targetGroup.middleRight.distanceY)/2;
-        targetGroup.selected.angleX = (targetGroup.middleLeft.angleX + targetGroup.middleRight.angleX)/2;
-        targetGroup.selected.targetType = TARGET_HEIGHT_MIDDLE_COMBINED;
-        targetGroup.selected.valid = true;
-    } 
-    else if (static_cast<bool>(targetGroup.middleLeft.valid)) 
-    {
-        targetGroup.selected = targetGroup.middleLeft;
-    } 
-    else if (static_cast<bool>(targetGroup.middleRight.valid)) 
-    {
-        targetGroup.selected = targetGroup.middleRight;
-    } 
+    nth_element(areas.begin(), areas.begin() + max_targets - 1, areas.end(), 
+                greater<pair<float, size_t> >());
+
+    for (int i = 0; i < max_targets; i++) kept[i] = areas[static_cast<size_t>(i)].second;
+    sort(kept, kept + max_targets);
+
+    metrics->add(COUNTER_TARGETS_DROPPED, quads - static_cast<size_t>(max_targets));
+
+    return max_targets;
 }
 
-/* This boolean determines whether the 
- * target that has been acquired is the
- * best one
+/* For each of target compute size, distance, angle
+ * Every step is a separate loop over the batch arrays
+ * so that the compiler can vectorize them.
  */ 
-bool getBestTarget(vector<TargetData> &targets, TargetData &target) 
+void getTargetData(Mat &image, const vector<vector<Point2f> >&targetQuads, TargetBatch &targets) 
 {
-    for (size_t i = 0; i < targets.size(); i++) 
+    size_t kept[max_targets];
+    int count = keptQuads(targetQuads, kept);
+    targets.count = count;
+
+    for (int i = 0; i < count; i++) 
     {
-        if (targets[i].targetType == TARGET_HEIGHT_HIGH) 
+        const vector<Point2f> &quad = targetQuads[kept[i]];
+
+        for (int j = 0; j < 4; j++) 
         {
-            target = targets[i];
-        return true;
+            targets.cornerX[j][i] = quad[static_cast<size_t>(j)].x;
+            targets.cornerY[j][i] = quad[static_cast<size_t>(j)].y;
         }
     }
-    
-    for (size_t i = 0; i < targets.size(); i++) 
+
+    const float (&px)[4][max_targets] = targets.cornerX;
+    const float (&py)[4][max_targets] = targets.cornerY;
+
+    for (int i = 0; i < count; i++) 
     {
-        if (targets[i].targetType == TARGET_HEIGHT_LOW) 
-        {
-            target = targets[i];
-            return true;
-        }
+        targets.centerX[i] = (px[0][i] + px[1][i] + px[2][i] + px[3][i]) / 4;
+        targets.centerY[i] = (py[0][i] + py[1][i] + py[2][i] + py[3][i]) / 4;
+
+        float x1 = ( abs( px[0][i] - px[1][i] ) + abs( px[2][i] - px[3][i] ) ) / 2;
+        float x2 = ( abs( px[1][i] - px[2][i] ) + abs( px[3][i] - px[0][i] ) ) / 2;
+        float y1 = ( abs( py[0][i] - py[1][i] ) + abs( py[2][i] - py[3][i] ) ) / 2;
+        float y2 = ( abs( py[1][i] - py[2][i] ) + abs( py[3][i] - py[0][i] ) ) / 2;
+
+        targets.sizeX[i] = max(x1, x2);
+        targets.sizeY[i] = max(y1, y2);
+
+        // Angle per pixel is based on the camera perameters
+        targets.angleX[i] = 0.160943017f * ((image.cols / 2) - targets.centerX[i]) + 2.3f;
     }
-  
-    vector<TargetData> middleTargets;
-  
-    for (size_t i=0; i < targets.size(); i++) 
+
+    /* Distance to target was obtained from distance to target measurements
+     * that were trend line fit in LibreOffice
+     */ 
+    if (fixed_point)
     {
-        if (targets[i].targetType == TARGET_HEIGHT_MIDDLE) 
+        for (int i = 0; i < count; i++) 
         {
-            middleTargets.push_back(targets[i]);
+            targets.distanceX[i] = distance_x_table(targets.sizeX[i]);
+            targets.distanceY[i] = distance_y_table(targets.sizeY[i]);
         }
     }
-  
-    switch ( middleTargets.size() ) 
-    {
-        case 2:
-            if (targets[0].centerX < targets[1].centerX) 
-            {
-                targets[0].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-                targets[1].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-            } 
-            else 
-            {
-                targets[1].targetType = TARGET_HEIGHT_MIDDLE_LEFT;
-                targets[0].targetType = TARGET_HEIGHT_MIDDLE_RIGHT;
-            }
-    
-            target.centerX = (targets[0].centerX + targets[1].centerX)/2;
-            target.centerY = (targets[0].centerY + targets[1].centerY)/2;
-            target.sizeX = (targets[0].sizeX + targets[1].sizeX)/2;
-            target.sizeY = (targets[0].sizeY + targets[1].sizeY)/2;
-            target.distanceX = (targets[0].distanceX + targets[1].distanceX)/2;
-            target.distanceY = (targets[0].distanceY + targets[1].distanceY)/2;
-            target.angleX = (targets[0].angleX + targets[1].angleX)/2;
-            target.targetType = TARGET_HEIGHT_MIDDLE_COMBINED;
-            return true;
-        case 1:
-            target = targets[0];
-            return true;
-    }
-    
-    return false;
-}
-
-// For each of target compute size, distance, angle
-void getTargetData(Mat &image, const vector<vector<Point2f> >&targetQuads, vector<TargetData> &targets) 
-{
-    for (size_t i = 0; i < targetQuads.size(); i++) 
+    else
     {
-        TargetData target;
-        target.points = targetQuads[i];
-        target.valid = true;
-        float centerX = 0;
-        float centerY = 0;
-        
-        for (size_t j = 0; j < target.points.size(); j++) 
+        for (int i = 0; i < count; i++) 
         {
-            float x = target.points[j].x;
-            float y = target.points[j].y;
-            centerX += x;
-            centerY += y;
+            targets.distanceX[i] = 11263 * pow(targets.sizeX[i], -1.061f);
+            targets.distanceY[i] = 7239 * pow(targets.sizeY[i], -1.025f);
         }
-        
-        target.centerX = static_cast<float>(centerX / 4.0);
-        target.centerY = static_cast<float>(centerY / 4.0);
-        
-        float x1 = static_cast<float>
-														(( abs(target.points[0].x - target.points[1].x ) + 
-															 abs( target.points[2].x - target.points[3].x ) ) / 2.0);
-        
-        float x2 = static_cast<float>
-														(( abs( target.points[1].x - target.points[2].x ) + 
-															 abs( target.points[3].x - target.points[0].x ) ) / 2.0);
-        
-        float sizeX = max(x1, x2);
-
-        float y1 = static_cast<float>
-														(( abs( target.points[0].y - target.points[1].y ) + 
-															 abs( target.points[2].y - target.points[3].y ) ) / 2.0);
-        
-        float y2 = static_cast<float>
-														(( abs( target.points[1].y - target.points[2].y ) + 
-															 abs( target.points[3].y - target.points[0].y ) ) / 2.0);
-        
-        float sizeY = max(y1, y2);
-
-        target.sizeX = sizeX;
-        target.sizeY = sizeY;
-
-        /* Distance to target was obtained from distance to target measurements
-         * that were trend line fit in LibreOffice
-         */ 
-        target.distanceX = static_cast<float>(11263 * pow(sizeX, -1.061));
-        target.distanceY = static_cast<float>(7239 * pow(sizeY, -1.025));
-    
-        // Angle per pixel is based on the camera perameters
-        target.angleX = static_cast<float>(0.160943017 * ((image.cols / 2) - target.centerX) + 2.3);
-        
-	computeTargetType(target);
-
-        targets.push_back(target);
     }
+
+    computeTargetTypes(targets);
 }
 
 // Print out information about the targets to the console
-void printTargets(vector<TargetData> &targets) 
+void printTargets(TargetBatch &targets) 
 {
     printf("----------------------------------------------------------------\n");
-    for (size_t i = 0; i < targets.size(); i++) 
+    for (int i = 0; i < targets.count; i++) 
     {
         printf("Poly Points[");
         
-        for (size_t j = 0; j < targets[i].points.size(); j++) 
+        for (int j = 0; j < 4; j++) 
         {
-            printf("(%f, %f) ", targets[i].points[j].x, targets[i].points[j].y);
+            printf("(%f, %f) ", targets.cornerX[j][i], targets.cornerY[j][i]);
         }   
         
         printf("] ");
-        printf("Center (%f, %f) ", targets[i].centerX, targets[i].centerY);
-        printf("Size (%f, %f) \n", targets[i].sizeX, targets[i].sizeY);
+        printf("Center (%f, %f) ", targets.centerX[i], targets.centerY[i]);
+        printf("Size (%f, %f) \n", targets.sizeX[i], targets.sizeY[i]);
     }
 }
 
@@ -539,252 +498,623 @@ void intersection(Vec4f &line1Params, Vec4f &line2Params, Point2f &targetQuads2f
 }
 
 
-void refineCorners(vector<vector<Point> >&targetQuads,
-										vector<vector<Point> >&targetHulls, 
-										vector<vector<Point2f> >&targetQuads2f,
-										vector<vector<Point> >&targetQuads2fi) 
+/* Fit a line to each side of the hull between the corners of the quad and
+ * intersect the lines to get the corners to subpixel accuracy.
+ */ 
+static void refineQuadCorners(vector<Point> &quad, 
+                              vector<Point> &hull, 
+                              vector<Point2f> &quad2f, 
+                              vector<Point> &quad2fi) 
 {
-    Size winSize(7,7);
-    Size zeroZone(-1,-1);
-    TermCriteria criteria(TermCriteria::COUNT, 30, 0);
-    for (size_t i=0; i < targetQuads.size(); i++) 
+    for (size_t j=0; j < quad.size(); j++) 
     {
-        for (size_t j=0; j < targetQuads[i].size(); j++) 
-        {
-            targetQuads2f[i].push_back(targetQuads[i][j]);
-        }
+        quad2f.push_back(quad[j]);
+    }
 
 #if 1
-        // Find first element
-        size_t k = 0;
-    
-        while (targetQuads[i][0] != targetHulls[i][k]) 
+    // Find first element
+    size_t k = 0;
+
+    while (quad[0] != hull[k]) 
+    {
+        if ( k + 1 >= hull.size() ) 
         {
-            if ( k > targetHulls[i].size() ) 
-            {
 	            printf("Error %d", __LINE__);
 							return;
-            }
-        
-            k++;
         }
     
-        rotate( targetHulls[i].begin(), 
-								targetHulls[i].begin() + static_cast<const long>(k), 
-								targetHulls[i].end() );
-    
-        vector<Point> line1;
-        vector<Point> line2;
-        vector<Point> line3;
-        vector<Point> line4;
-    
-        k = 0;
+        k++;
+    }
+
+    rotate( hull.begin(), 
+								hull.begin() + static_cast<const long>(k), 
+								hull.end() );
+
+    vector<Point> line1;
+    vector<Point> line2;
+    vector<Point> line3;
+    vector<Point> line4;
+
+    k = 0;
+
+    while (quad[1] != hull[k]) 
+    {
+        line1.push_back(hull[k]);
+        k++;
     
-        while (targetQuads[i][1] != targetHulls[i][k]) 
+        if (k == hull.size()) 
         {
-            line1.push_back(targetHulls[i][k]);
-            k++;
-        
-            if (k == targetHulls[i].size()) 
-            {
 	        printf("Error %d", __LINE__);
 	        return;
-            }
         }
-     
-        line1.push_back(targetHulls[i][k]);
+    }
+ 
+    line1.push_back(hull[k]);
+
+    while (quad[2] != hull[k]) 
+    {
+        line2.push_back(hull[k]);
+        k++;
     
-        while (targetQuads[i][2] != targetHulls[i][k]) 
+        if (k == hull.size()) 
         {
-            line2.push_back(targetHulls[i][k]);
-            k++;
-        
-            if (k == targetHulls[i].size()) 
-            {
 	            printf("Error %d", __LINE__);
 	            return;
-            }
-        }   
-    
-        line2.push_back(targetHulls[i][k]);
+        }
+    }   
+
+    line2.push_back(hull[k]);
+
+    while (quad[3] != hull[k]) 
+    {
+        line3.push_back(hull[k]);
+        k++;
     
-        while (targetQuads[i][3] != targetHulls[i][k]) 
+        if (k == hull.size()) 
         {
-            line3.push_back(targetHulls[i][k]);
-            k++;
-        
-            if (k == targetHulls[i].size()) 
-            {
 	            printf("Error %d", __LINE__);
 	            return;
-            }
         }
+    }
+
+    line3.push_back(hull[k]);
+
+    while ( k < hull.size() ) 
+    {
+        line4.push_back(hull[k]);
+        k++;
+    }
+
+    line4.push_back(hull[0]);
+
+    Vec4f line1Params, line2Params, line3Params, line4Params;
+
+    fitLine(line1, line1Params, CV_DIST_L2, 0, 0.01, 0.01);
+    fitLine(line2, line2Params, CV_DIST_L2, 0, 0.01, 0.01);
+    fitLine(line3, line3Params, CV_DIST_L2, 0, 0.01, 0.01);
+    fitLine(line4, line4Params, CV_DIST_L2, 0, 0.01, 0.01);
     
-        line3.push_back(targetHulls[i][k]);
-    
-        while ( k < targetHulls[i].size() ) 
-        {
-            line4.push_back(targetHulls[i][k]);
-            k++;
-        }
-    
-        line4.push_back(targetHulls[i][0]);
-    
-        Vec4f line1Params, line2Params, line3Params, line4Params;
-    
-        fitLine(line1, line1Params, CV_DIST_L2, 0, 0.01, 0.01);
-        fitLine(line2, line2Params, CV_DIST_L2, 0, 0.01, 0.01);
-        fitLine(line3, line3Params, CV_DIST_L2, 0, 0.01, 0.01);
-        fitLine(line4, line4Params, CV_DIST_L2, 0, 0.01, 0.01);
-        
-        intersection(line4Params, line1Params, targetQuads2f[i][0]);
-        intersection(line1Params, line2Params, targetQuads2f[i][1]);
-        intersection(line2Params, line3Params, targetQuads2f[i][2]);
-        intersection(line3Params, line4Params, targetQuads2f[i][3]);
+    intersection(line4Params, line1Params, quad2f[0]);
+    intersection(line1Params, line2Params, quad2f[1]);
+    intersection(line2Params, line3Params, quad2f[2]);
+    intersection(line3Params, line4Params, quad2f[3]);
 #endif
-    
-        for (size_t j = 0; j < targetQuads[i].size(); j++) 
+
+    for (size_t j = 0; j < quad.size(); j++) 
+    {
+        quad2fi.push_back(quad2f[j]);
+    }
+}
+
+// The pool the parallel steps of a pipeline run on
+static ThreadPool &pipelinePool(const PipelineContext &context) 
+{
+    return context.pool ? *context.pool : *pool;
+}
+
+/* Refine the corners of every quad. The quads don't depend on each other,
+ * so with enough of them they are spread over the thread pool.
+ */ 
+void refineCorners(ThreadPool &threads, 
+										vector<vector<Point> >&targetQuads,
+										vector<vector<Point> >&targetHulls, 
+										vector<vector<Point2f> >&targetQuads2f,
+										vector<vector<Point> >&targetQuads2fi) 
+{
+    parallelFor(threads, static_cast<int>(targetQuads.size()), parallel_min_candidates, 
+                [&](int begin, int end) 
+    {
+        for (size_t i = static_cast<size_t>(begin); i < static_cast<size_t>(end); i++) 
         {
-            targetQuads2fi[i].push_back(targetQuads2f[i][j]);
+            refineQuadCorners(targetQuads[i], targetHulls[i], targetQuads2f[i], targetQuads2fi[i]);
         }
-    }
+    });
 }
 
-// Send a message about the targets to the cRIO
-void sendMessage(float distance, float angle, float tension) 
+// The socket the target messages go out on, opened by the first message
+static int crio_socket = -1;
+static struct sockaddr_in crio_addr;
+
+// The messages sent lately, to work out the latency of their echoes
+struct SentFrame 
 {
-    char sendbuffer[BUFFERSIZE];
-    struct sockaddr_in crio_addr;
-    int _socket;
+    int camera;                         // Frame numbers count per camera
+    unsigned long frame;
+    timespec captureTime;
+    timespec sendTime;
+};
+
+static SentFrame sent_frames[max_sent_frames];     // Frame 0 is an empty entry
+static unsigned long sent_count = 0;
+
+// Open the socket to the --crio address, returns false if it can't be
+static bool openCrioSocket() 
+{
+    if (crio_socket >= 0) return true;
+
+    string address(options->crioAddress);
+    size_t colon = address.rfind(':');
+    int port = colon == string::npos ? 9999 : atoi(address.c_str() + colon + 1);
+
+    if (colon != string::npos) address.erase(colon);
+
+    crio_addr.sin_family = AF_INET;
+    crio_addr.sin_port = htons(static_cast<uint16_t>(port));
+    
+    if ( inet_aton(address.c_str(), &crio_addr.sin_addr) == 0 ) 
+    {
+        printf("ERROR: bad cRIO address %s\n", options->crioAddress);
+        return false;
+    }
 
-    // Create a socket
-    if ( ( _socket = socket(PF_INET, SOCK_DGRAM, 0) ) < 0 ) 
+    // Create a socket, which doesn't block so echoes can be picked up when there are some
+    if ( ( crio_socket = socket(PF_INET, SOCK_DGRAM, 0) ) < 0 ) 
     {
         perror("Socket");
-        return;
+        return false;
     } 
-  
-    crio_addr.sin_family = AF_INET;
-    crio_addr.sin_port = htons(9999);
-    
-    // Store 10.17.68.2 in crio_addr
-    if ( inet_aton("10.17.68.2", &crio_addr.sin_addr) == 0 ) 
+
+    fcntl(crio_socket, F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+void closeCrioSocket() 
+{
+    if (crio_socket >= 0) close(crio_socket);
+
+    crio_socket = -1;
+}
+
+/* Send a message about the targets to the cRIO. With --sendAge the message
+ * also carries the camera and frame number and how old the frame is in
+ * milliseconds.
+ */
+void sendMessage(float distance, float angle, float tension, int camera, unsigned long frame, double age) 
+{
+    char sendbuffer[BUFFERSIZE];
+
+    if (!openCrioSocket()) return;
+
+    // Put the data into a formatted string and send it to the cRIO
+    int length = snprintf(sendbuffer, sizeof(sendbuffer), "Distance=%f:Angle=%f:Tension=%f", 
+                          distance, angle, tension);
+
+    if (options->sendAge) 
     {
-        perror("cRIO_Addr");
-        return;
+        snprintf(sendbuffer + length, sizeof(sendbuffer) - static_cast<size_t>(length), 
+                 ":Camera=%d:Frame=%lu:Age=%.1f", camera, frame, age * 1000);
     }
 
-    /* Put the data into a formatted string and send it to the cRIO @
-     * 10.17.68.2
-     */ 
-    sprintf(sendbuffer, "Distance=%f:Angle=%f:Tension=%f", distance, angle, tension);
-    sendto( _socket, sendbuffer, strlen(sendbuffer) + 1, 0, 
+    sendto( crio_socket, sendbuffer, strlen(sendbuffer) + 1, 0, 
 				reinterpret_cast<struct sockaddr*> (&crio_addr), sizeof(crio_addr) );
-    
-    // Close the socket
-    close(_socket);
+
+    metrics->add(COUNTER_MESSAGES_SENT);
 }
 
-/* This is called every time that we get a new image to process the image, get target data,
- * and send the information to the cRIO
- */ 
-void processImageCallback(int, void* ) 
+/* Pick up the messages an echo server sent back and record how long they
+ * took. Only messages with a camera and frame number can be matched, see
+ * --sendAge.
+ */
+void receiveEchoes() 
 {
-    static vector<Mat>* planes = new vector<Mat>();
-    static Mat* src_color = new Mat();
-    
-    split(*src, *planes);
-  
-    // Keep the color that we are intested in and substract off the other planes
-    addWeighted(planes[GREEN_PLANE], 1, planes[RED_PLANE], -.1, 0, *src_color);
-    addWeighted(*src_color, 1, planes[BLUE_PLANE], -.4, 0, *src_color);
-  
-    // Dilation + Erosion = Close
-    int dilation_type = 0;
-  
-    if( dilation_elem == 0 ) 
-    { 
-        dilation_type = MORPH_RECT; 
-    }
-    else if( dilation_elem == 1 ) 
-    { 
-        dilation_type = MORPH_CROSS; 
+    if (crio_socket < 0) return;
+
+    char buffer[BUFFERSIZE];
+    ssize_t length;
+
+    while ((length = recv(crio_socket, buffer, sizeof(buffer) - 1, 0)) > 0) 
+    {
+        buffer[length] = '\0';
+
+        const char *field = strstr(buffer, "Camera=");
+        int camera;
+        unsigned long frame;
+
+        if (!field || sscanf(field, "Camera=%d:Frame=%lu", &camera, &frame) != 2) continue;
+
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (int i = 0; i < max_sent_frames; i++) 
+        {
+            if (!frame || sent_frames[i].frame != frame || sent_frames[i].camera != camera) continue;
+
+            telemetry->echo.record(toSeconds(diff(sent_frames[i].captureTime, now)));
+            telemetry->roundTrip.record(toSeconds(diff(sent_frames[i].sendTime, now)));
+            metrics->add(COUNTER_ECHOES);
+            sent_frames[i].frame = 0;
+            break;
+        }
     }
-    else if( dilation_elem == 2) 
-    { 
-        dilation_type = MORPH_ELLIPSE; 
+}
+
+// Create the shared memory ring of a context, sized for its first frame
+void openFrameRing(PipelineContext &context) 
+{
+    context.ring = new FrameRingWriter();
+
+    if (!context.ring->open(frameRingName(context.index), context.src.total() * context.src.elemSize())) 
+    {
+        printf("Could not share the frames of camera %d\n", context.index);
+        delete context.ring;
+        context.ring = 0;
+    }
+}
+
+// Put the current frame of a context and its targets in the shared memory ring
+void publishFrame(PipelineContext &context) 
+{
+    if (!context.ring || context.src.empty()) return;
+
+    context.ring->publish(sourceImage(context), context.frameNumber, context.captureTime, context.index, 
+                          context.targets, context.targetGroup);
+}
+
+/* Hand the final image of a context to its stream, at most stream_fps times
+ * a second and only while somebody is watching. It is drawn here as the
+ * window may be closed or refreshed at another rate, the encoding happens on
+ * the thread of the stream.
+ */
+void streamFrame(PipelineContext &context, double now)
+{
+    if (!context.stream || context.src.empty() || !context.stream->wants(now, stream_fps)) return;
+
+    drawWindow(context, WINDOW_FINAL);
+    context.stream->publish(context.finalDrawing, now, stream_quality);
+}
+
+// The name of a window for a camera, the first camera keeps the plain name
+string windowName(const PipelineContext &context, const char *name) 
+{
+    if (context.index == 0) return name;
+
+    ostringstream windowName;
+    windowName << name << " " << context.index;
+    return windowName.str();
+}
+
+// A window that has been closed (or never opened) has no properties
+bool windowVisible(const string &name) 
+{
+    return getWindowProperty(name, CV_WND_PROP_AUTOSIZE) >= 0;
+}
+
+/* Make a captured frame the source image of a context. A BGR frame is used
+ * as it is. The color stage makes its mask straight from a YUYV or I420
+ * frame, so src is only allocated and sourceImage() converts the frame the
+ * first time something needs it in BGR. src and yuv may be headers on the
+ * frame's buffer, so they are only good while context.frame holds the lease.
+ */
+static void acceptFrame(PipelineContext &context, const FrameLease &frame) 
+{
+    context.frameNumber++;
+
+    if (frame->type() == CV_8UC3) 
+    {
+        context.src = *frame;
+        context.yuv.release();
+        context.sourceFrame = context.frameNumber;
+    }
+    else 
+    {
+        Size size = frame->type() == CV_8UC2 ? frame->size() : Size(frame->cols, frame->rows * 2 / 3);
+
+        // src may still be a header on a BGR frame of the source
+        if (context.yuv.empty()) context.src.release();
+
+        context.yuv = *frame;
+        context.src.create(size, CV_8UC3);
+    }
+
+    context.frame = frame;
+}
+
+/* The source image of a context in BGR. A YUV frame is converted the first
+ * time this is called for it, which only the windows, the frame ring, the
+ * lookup table classifier and saved images need. Called from one thread at
+ * a time for a context.
+ */
+Mat &sourceImage(PipelineContext &context) 
+{
+    if (context.yuv.empty() || context.sourceFrame == context.frameNumber) return context.src;
+
+    if (context.yuv.type() == CV_8UC2) 
+    {
+        runBands(pipelinePool(context), context.yuv, context.src, 0, [](const Mat &in, Mat &out) 
+        {
+            cvtColor(in, out, CV_YUV2BGR_YUYV);
+        });
+    }
+    else 
+    {
+        cvtColor(context.yuv, context.src, CV_YUV2BGR_I420);
+    }
+
+    context.sourceFrame = context.frameNumber;
+    return context.src;
+}
+
+/* Take the next frame of a context's capture source with the time it was
+ * captured, waiting at most capture_wait for it. Returns false when there
+ * is no new frame, and captureState says why; the source is done once its
+ * file ends.
+ */
+bool grabFrame(PipelineContext &context) 
+{
+    FrameLease frame;
+
+    if (context.capture->take(frame, context.captureTime, capture_wait)) 
+    {
+        acceptFrame(context, frame);
+        context.captureState = CAPTURE_STREAMING;
+        return true;
+    }
+
+    context.captureState = context.capture->state();
+    context.ok = context.captureState != CAPTURE_ENDED;
+    return false;
+}
+
+/* Does a stage have to run? It does when it never ran, was invalidated, or
+ * its input or settings are not the ones its cached result was made from.
+ * A stage that has to run gets the new key and a new output generation, so
+ * the stages after it run as well.
+ */
+bool stageStale(PipelineContext &context, PipelineStage stage, unsigned long input, 
+                int param0, int param1, int param2) 
+{
+    StageCache &cache = context.stages[stage];
+
+    if (cache.valid && cache.input == input && cache.params[0] == param0 && 
+        cache.params[1] == param1 && cache.params[2] == param2) return false;
+
+    cache.valid = true;
+    cache.input = input;
+    cache.params[0] = param0;
+    cache.params[1] = param1;
+    cache.params[2] = param2;
+    cache.output++;
+
+    return true;
+}
+
+// Throw away the cached result of a stage and so of every stage after it
+void invalidateStage(PipelineContext &context, PipelineStage stage) 
+{
+    context.stages[stage].valid = false;
+}
+
+/* Build the color lookup table again if its settings changed. The table is
+ * shared by every camera, so this is only called between frames.
+ */
+void updateClassifier() 
+{
+    static int built[7] = { -1 };
+    int settings[7] = { lut_hue_min, lut_hue_max, lut_saturation_min, lut_value_min, 
+                        BLUE_PLANE, GREEN_PLANE, RED_PLANE };
+
+    if (equal(settings, settings + 7, built)) return;
+
+    classifier->buildHsv(lut_hue_min, lut_hue_max, lut_saturation_min, lut_value_min, 
+                         BLUE_PLANE, GREEN_PLANE, RED_PLANE);
+    copy(settings, settings + 7, built);
+}
+
+/* The full image steps of the pipeline, from the source image to the
+ * contours of the thresholded image. Only the steps whose input or settings
+ * changed are run. With color_lut the lookup table classifier makes the
+ * binary image right away, and the blur and threshold are left out.
+ */ 
+void processImage(PipelineContext &context) 
+{
+    Mat &src = context.src;
+    StageCache *stages = context.stages;
+
+    // Kernels compiled for the current settings, if there are any, see Kernels.hpp
+    const KernelSet *kernels = findKernels(src.cols, BLUE_PLANE, GREEN_PLANE, RED_PLANE, 
+                                           dilation_elem, dilation_size);
+
+    /* The image steps run on bands of rows spread over the thread pool.
+     * The outputs are allocated before each step so the bands can fill in
+     * their rows.
+     */
+    bool lut = color_lut != 0;
+    bool fixed = fixed_point != 0;
+    int table = lut ? static_cast<int>(classifier->generation()) : fixed_point;
+
+    if (stageStale(context, STAGE_COLOR, context.imageFrame, planeOrder(), color_lut, table)) 
+    {
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_COLOR);
+
+        context.src_color.create(src.size(), CV_8UC1);
+
+        /* Keep the color that we are intested in and substract off the other
+         * planes. A YUV frame is weighed as it is, in fixed point either way,
+         * only the classifier works on BGR.
+         */
+        if (!lut && context.yuv.type() == CV_8UC2) 
+        {
+            runBands(pipelinePool(context), context.yuv, context.src_color, 0, [](const Mat &in, Mat &out)
+            {
+                yuyvColor(in, out, BLUE_PLANE, GREEN_PLANE, RED_PLANE);
+            });
+        }
+        else if (!lut && !context.yuv.empty()) 
+        {
+            const Mat &frame = context.yuv;
+            Mat &color = context.src_color;
+
+            parallelFor(pipelinePool(context), src.rows, band_min_pixels / src.cols, [&frame, &color](int begin, int end)
+            {
+                i420Color(frame, color, begin, end, BLUE_PLANE, GREEN_PLANE, RED_PLANE);
+            });
+        }
+        else 
+        {
+            runBands(pipelinePool(context), sourceImage(context), context.src_color, 0, [kernels, lut, fixed](const Mat &in, Mat &out)
+            {
+                if (lut) classifier->classify(in, out);
+                else if (fixed && kernels) kernels->fixedColor(in, out);
+                else if (fixed) genericFixedColor(in, out, BLUE_PLANE, GREEN_PLANE, RED_PLANE);
+                else if (kernels) kernels->color(in, out);
+                else genericColor(in, out, BLUE_PLANE, GREEN_PLANE, RED_PLANE);
+            });
+        }
     }
   
-    Mat element = getStructuringElement(dilation_type,
-				    Size( 2*dilation_size + 1, 2*dilation_size+1 ),
-				    Point( dilation_size, dilation_size ) );
-  
-    static Mat* src_gray;
-    *src_gray = src_color->clone();
- 
-    // This now does a close
-    static Mat* src_blur;
-    *src_blur = src_gray->clone();
-    GaussianBlur( *src_gray, *src_blur, Size( 5, 5 ), 0, 0 );
-  
-    static Mat* threshold_output;
-    *threshold_output = src_blur->clone();
-    
-    vector<vector<Point> > contours;
-    vector<Vec4i> hierarchy;
-  
-    // Detect edges using Threshold
-    threshold( *src_blur, *threshold_output, thresh, 255, THRESH_BINARY );
-  
-    // This now does a close
-    static Mat* src_dilate;
-    dilate(*threshold_output, *src_dilate, element );
-    erode(*src_dilate, *src_dilate, element);
-
-    static Mat* temp;
-    *temp = src_dilate->clone();
-    /// Find contours
-    findContours( *temp, contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_NONE, Point(0, 0) );
+    if (!lut && stageStale(context, STAGE_BLUR, stages[STAGE_COLOR].output)) 
+    {
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_BLUR);
+
+        context.src_blur.create(src.size(), CV_8UC1);
+
+        // The 5x5 blur needs 2 rows from the neighbouring bands
+        runBands(pipelinePool(context), context.src_color, context.src_blur, 2, [kernels](const Mat &in, Mat &out)
+        {
+            if (kernels) kernels->blur(in, out);
+            else genericBlur(in, out);
+        });
+    }
   
-    // Find the convex hull object for each contour
-    
-    vector<vector<Point> > hull( contours.size() );
-    
-    for( size_t i = 0; i < contours.size(); i++ ) 
+    if (!lut && stageStale(context, STAGE_THRESHOLD, stages[STAGE_BLUR].output, thresh)) 
     {
-        convexHull( Mat(contours[i]), hull[i], false ); 
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_THRESHOLD);
+
+        context.threshold_output.create(src.size(), CV_8UC1);
+
+        // Detect edges using Threshold
+        runBands(pipelinePool(context), context.src_blur, context.threshold_output, 0, [kernels](const Mat &in, Mat &out)
+        {
+            if (kernels) kernels->threshold(in, out, thresh);
+            else genericThreshold(in, out, thresh);
+        });
     }
   
-    static Mat* drawingContours;
-    
-    // Draw contours + hull results
-    if (options->guiAll) 
+    const Mat &binary = lut ? context.src_color : context.threshold_output;
+    unsigned long binaryOutput = lut ? stages[STAGE_COLOR].output : stages[STAGE_THRESHOLD].output;
+
+    if (stageStale(context, STAGE_CLOSE, binaryOutput, dilation_elem, dilation_size, color_lut)) 
     {
-        *drawingContours = Mat::zeros( threshold_output->size(), CV_8UC3 );
-        
-        for( size_t i = 0; i< contours.size(); i++ ) 
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_CLOSE);
+
+        // Dilation + Erosion = Close
+        if (context.elementShape != dilation_elem || context.elementSize != dilation_size) 
         {
-            Scalar color = Scalar( 255, 255, 255 );
-            drawContours( *drawingContours, contours, static_cast<int>(i), 
-														color, 1, 8, vector<Vec4i>(), 0, Point() );
+            int dilation_type = 0;
+      
+            if( dilation_elem == 0 ) 
+            { 
+                dilation_type = MORPH_RECT; 
+            }
+            else if( dilation_elem == 1 ) 
+            { 
+                dilation_type = MORPH_CROSS; 
+            }
+            else if( dilation_elem == 2) 
+            { 
+                dilation_type = MORPH_ELLIPSE; 
+            }
+      
+            context.element = getStructuringElement(dilation_type,
+    				        Size( 2*dilation_size + 1, 2*dilation_size+1 ),
+    				        Point( dilation_size, dilation_size ) );
+            context.elementShape = dilation_elem;
+            context.elementSize = dilation_size;
         }
-    } 
-  
-    /* Approximate the convex hulls with polygons
-     * This reduces the number of edges and makes the contours
-     * into quads
+
+        const Mat &element = context.element;
+
+        context.src_dilate.create(src.size(), CV_8UC1);
+      
+        /* This now does a close. The erode reads the dilated rows of the halo,
+         * so the band needs dilation_size rows for each of them, and the erode
+         * goes into its own buffer instead of working in place.
+         */
+        runBands(pipelinePool(context), binary, context.src_dilate, 2*dilation_size, [kernels, &element](const Mat &in, Mat &out)
+        {
+            if (kernels) kernels->close(in, out);
+            else genericClose(in, out, element);
+        });
+    }
+
+    if (stageStale(context, STAGE_CONTOURS, stages[STAGE_CLOSE].output)) 
+    {
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_CONTOURS);
+
+        vector<Vec4i> hierarchy;
+
+        context.src_dilate.copyTo(context.temp);
+        /// Find contours
+        findContours( context.temp, context.contours, hierarchy, CV_RETR_TREE, CV_CHAIN_APPROX_NONE, Point(0, 0) );
+
+        metrics->add(COUNTER_CANDIDATES, context.contours.size());
+        metrics->set(GAUGE_CONTOURS, context.contours.size());
+    }
+}
+
+/* Turn the contours into targets. Every contour and every target quad is
+ * handled on its own, so once there are enough of them they are spread
+ * over the thread pool.
+ */ 
+void processContours(PipelineContext &context) 
+{
+    vector<vector<Point> > &contours = context.contours;
+    vector<vector<Point> > &hull = context.hulls;
+    vector<vector<Point> > &poly = context.poly;
+    StageCache *stages = context.stages;
+
+    /* Find the convex hull object for each contour and approximate
+     * the convex hulls with polygons. This reduces the number of edges
+     * and makes the contours into quads
      */ 
-    vector<vector<Point> > poly( contours.size() );
-    
-    for (size_t i=0; i < contours.size(); i++) 
+    if (stageStale(context, STAGE_POLYGONS, stages[STAGE_CONTOURS].output, poly_epsilon)) 
     {
-        approxPolyDP(hull[i], poly[i], poly_epsilon, true);
+        MetricTimer timer(*metrics, HISTOGRAM_STAGE_POLYGONS);
+
+        hull.assign( contours.size(), vector<Point>() );
+        poly.assign( contours.size(), vector<Point>() );
+        
+        parallelFor(pipelinePool(context), static_cast<int>(contours.size()), parallel_min_contours, 
+                    [&](int begin, int end) 
+        {
+            for (size_t i = static_cast<size_t>(begin); i < static_cast<size_t>(end); i++) 
+            {
+                convexHull( Mat(contours[i]), hull[i], false ); 
+                approxPolyDP(hull[i], poly[i], poly_epsilon, true);
+            }
+        });
     }
+
+    if (!stageStale(context, STAGE_TARGETS, stages[STAGE_POLYGONS].output, minsize, fixed_point)) return;
+
+    MetricTimer timer(*metrics, HISTOGRAM_STAGE_TARGETS);
   
     // Prune the polygons into only the ones that we are intestered in.
-    vector<vector<Point> > prunedPoly(0);
+    vector<vector<Point> > &prunedPoly = context.prunedPoly;
     vector<vector<Point> > prunedHulls(0);
     vector<vector<Point> > prunedContours(0);
+    prunedPoly.clear();
+
     for (size_t i=0; i < poly.size(); i++) 
     {
         // Only 4 sized figures
@@ -802,298 +1132,1590 @@ void processImageCallback(int, void* )
     }
   
     // Prune to targets (Rectangles that contain an inner rectangle
-    vector<vector<Point> > targetQuads(0);
+    vector<vector<Point> > &targetQuads = context.targetQuads;
     vector<vector<Point> > targetHulls(0);
     vector<vector<Point> > targetContours(0);
+    targetQuads.clear();
     
     for (size_t i=0; i < prunedPoly.size(); i++) 
     {
-        // Keep only polygons that contain other polygons
-        if (rectContainsRect(static_cast<int>(i), prunedPoly)) 
+        // Keep only polygons that contain other polygons
+        if (rectContainsRect(static_cast<int>(i), prunedPoly)) 
+        {
+            targetQuads.push_back(prunedPoly[i]);
+            targetHulls.push_back(prunedHulls[i]);
+            targetContours.push_back(prunedContours[i]);
+        }
+    }
+
+    //Refine corner locations
+    //  Size winSize(7,7);
+    //  Size zeroZone(-1,-1);
+    vector<vector<Point2f> > targetQuads2f(targetQuads.size());
+    vector<vector<Point> > &targetQuads2fi = context.targetQuads2fi;
+    vector<vector<Point> > rcontours(targetContours.size());
+    targetQuads2fi.assign( targetQuads.size(), vector<Point>() );
+    
+    for (size_t i=0; i < targetContours.size(); i++) 
+    {
+        rcontours[i].assign(targetContours[i].rbegin(), targetContours[i].rend());
+    }
+
+    refineCorners(pipelinePool(context), targetQuads, rcontours, targetQuads2f, targetQuads2fi);
+
+    /* Size, distance, angle and type are a handful of arithmetic per target
+     * done in vectorized passes over the batch, so they stay on this thread.
+     */
+    getTargetData(context.src, targetQuads2f, context.targets);
+    context.targetGroup = TargetGroup();
+    getTargetGroup(context.src.cols, context.targets, context.targetGroup);
+}
+
+// Reuse the canvas of a window, it is only allocated when the size changes
+static void clearCanvas(Mat &canvas, Size size) 
+{
+    canvas.create(size, CV_8UC3);
+    canvas.setTo(Scalar::all(0));
+}
+
+/* Draw the text of a target below it. The lines are formatted into stack
+ * buffers at the precision they are shown at, and only drawn again into the
+ * label's layer when one of them reads differently from the last frame; the
+ * layer is then stamped onto the image in the color.
+ */
+static void drawTargetLabel(Mat &image, TargetLabel &label, const TargetData &target, const Scalar &color) 
+{
+    char lines[label_lines][label_chars];
+
+    snprintf(lines[0], label_chars, "Center: X: %.0f Y: %.0f", target.centerX, target.centerY);
+    snprintf(lines[1], label_chars, "Size: X: %.0f Y: %.0f", target.sizeX, target.sizeY);
+    snprintf(lines[2], label_chars, "Distance: X: %.1f Y: %.1f", target.distanceX, target.distanceY);
+    snprintf(lines[3], label_chars, "Angle: X: %.1f", target.angleX);
+    snprintf(lines[4], label_chars, "%s", getTargetTypeString(target.targetType));
+    snprintf(lines[5], label_chars, "Tension: %.2f", target.tension);
+
+    bool changed = label.layer.empty();
+
+    for (int i = 0; i < label_lines && !changed; i++) 
+    {
+        changed = strcmp(lines[i], label.lines[i]) != 0;
+    }
+
+    if (changed) 
+    {
+        label.layer.create(label_lines * label_line_height, label_width, CV_8UC1);
+        label.layer.setTo(Scalar::all(0));
+
+        for (int i = 0; i < label_lines; i++) 
+        {
+            putText( label.layer, lines[i], Point(0, label_ascent + i * label_line_height), 
+                     CV_FONT_HERSHEY_PLAIN, .7, Scalar::all(255) );
+            strcpy(label.lines[i], lines[i]);
+        }
+    }
+
+    // The first baseline is 35 pixels below the center, the layer is clipped to the image
+    Point origin( static_cast<int>(target.centerX - 50), 
+                  static_cast<int>(target.centerY + 35) - label_ascent );
+    Rect area = Rect(origin.x, origin.y, label.layer.cols, label.layer.rows) & Rect(0, 0, image.cols, image.rows);
+
+    if (area.area() <= 0) return;
+
+    image(area).setTo(color, label.layer(Rect(area.x - origin.x, area.y - origin.y, area.width, area.height)));
+}
+
+// Draw the image of one of the windows that are drawn rather than copied from the pipeline
+void drawWindow(PipelineContext &context, DebugWindow window) 
+{
+    vector<vector<Point> > &contours = context.contours;
+    vector<vector<Point> > &poly = context.poly;
+    vector<vector<Point> > &prunedPoly = context.prunedPoly;
+    vector<vector<Point> > &targetQuads = context.targetQuads;
+    vector<vector<Point> > &targetQuads2fi = context.targetQuads2fi;
+    TargetBatch &targets = context.targets;
+
+    switch (window) 
+    {
+        case WINDOW_CONTOURS:
+            // Draw contours + hull results
+            clearCanvas(context.drawingContours, context.threshold_output.size());
+            
+            for( size_t i = 0; i< contours.size(); i++ ) 
+            {
+                Scalar color = Scalar( 255, 255, 255 );
+                drawContours( context.drawingContours, contours, static_cast<int>(i), 
+															color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+            break;
+
+        case WINDOW_POLYGON:
+            // Draw the contours in a window
+            clearCanvas(context.drawing, context.threshold_output.size());
+            
+            for( size_t i = 0; i< contours.size(); i++ ) 
+            {
+                Scalar color = Scalar( 255, 255, 255 );
+                drawContours( context.drawing, poly, static_cast<int>(i), color, 1, 8, 
+																									vector<Vec4i>(), 0, Point() );
+            }
+            break;
+    
+        case WINDOW_PRUNED_POLYGON:
+            // Draw the pruned Poloygons in a window
+            clearCanvas(context.prunedDrawing, context.threshold_output.size());
+            
+            for (size_t i = 0; i < prunedPoly.size(); i++) 
+            {
+                Scalar color = Scalar( 255, 255, 255 );
+                drawContours(context.prunedDrawing, prunedPoly, static_cast<int>(i), 
+																			color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+            break;
+    
+        case WINDOW_TARGETS:
+            // Draw the targets
+            clearCanvas(context.targetsDrawing, context.threshold_output.size());
+            
+            for (size_t i=0; i < targetQuads.size(); i++) 
+            {
+                Scalar color = Scalar( 64, 64, 64 );
+                drawContours(context.targetsDrawing, targetQuads, static_cast<int>(i), 
+																			color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+        
+            for (size_t i=0; i < targetQuads2fi.size(); i++) 
+            {
+                Scalar color = Scalar( 255, 255, 255 );
+                drawContours(context.targetsDrawing, targetQuads2fi, static_cast<int>(i), 
+																			color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+            break;
+
+        case WINDOW_FINAL:
+            /* Output the final image. The pipeline still reads the source
+             * image, so it is copied, into the buffer of the last frame.
+             */
+            sourceImage(context).copyTo(context.finalDrawing);
+
+            if (context.labels.size() < static_cast<size_t>(targets.count)) context.labels.resize(static_cast<size_t>(targets.count));
+        
+            for (size_t i=0; i < targetQuads.size(); i++) 
+            {
+                Scalar color = Scalar( 64, 0, 0 );
+                drawContours(context.finalDrawing, targetQuads, static_cast<int>(i), 
+        																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+        
+            for (size_t i=0; i < targetQuads2fi.size(); i++) 
+            {
+                Scalar color = Scalar( 255, 255, 255 );
+                drawContours(context.finalDrawing, targetQuads2fi, static_cast<int>(i), 
+        																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+            }
+      
+            for (int i = 0; i < targets.count; i++ )
+            {
+                TargetData target = targets.get(i);
+                Point center( static_cast<int>(target.centerX), 
+        											static_cast<int>(target.centerY) );
+                Scalar color = Scalar( 255, 255, 255 );
+                circle( context.finalDrawing, center, 10, color );
+#ifdef DEBUG_TEXT
+                drawTargetLabel(context.finalDrawing, context.labels[static_cast<size_t>(i)], target, color);
+#endif
+            }
+
+            // The target that was sent to the cRIO
+            if (context.sent) 
+            {
+                Scalar color = Scalar( 255, 0, 255 );
+                circle( context.finalDrawing, context.sentCenter, 20, color );
+            }
+
+            // The image is the last one the camera sent
+            if (context.captureState != CAPTURE_STREAMING) 
+            {
+                string text = string("No frame: ") + captureStateString(context.captureState);
+                putText( context.finalDrawing, text, Point(10, 25), CV_FONT_HERSHEY_PLAIN, 1.5, 
+                         Scalar( 0, 0, 255 ), 2 );
+            }
+            break;
+
+        default:
+            // The other windows show the images of the pipeline as they are
+            break;
+    }
+}
+
+/* The motion gate. When the robot sits still the frames hardly change, so
+ * a new frame is first shrunk to a signature of motion_signature_cols by
+ * motion_signature_rows and compared to the signature of the frame the
+ * pipeline ran on last. If no cell is off by more than motion_tolerance the
+ * image stages keep that frame as their input, so their cached results,
+ * and the targets and TargetGroup found from them, are used again. It is
+ * compared to the frame the pipeline ran on rather than the one before, so
+ * a slow drift still adds up, and every motion_refresh frames the pipeline
+ * runs anyway.
+ */
+static void gateFrame(PipelineContext &context) 
+{
+    // The trackbars run the pipeline again on the same frame
+    if (context.imageFrame == context.frameNumber) return;
+
+    if (motion_refresh == 0) 
+    {
+        context.imageFrame = context.frameNumber;
+        context.motionSignature.release();
+        return;
+    }
+
+    // The signature of a YUV frame is made from the frame, it only has to change with it
+    const Mat &image = context.yuv.empty() ? context.src : context.yuv;
+    Mat signature;
+    resize(image, signature, Size(motion_signature_cols, motion_signature_rows), 0, 0, INTER_AREA);
+
+    if (!context.motionSignature.empty() && signature.type() == context.motionSignature.type() && 
+        context.frameNumber - context.imageFrame < static_cast<unsigned long>(motion_refresh) && 
+        norm(signature, context.motionSignature, NORM_INF) <= motion_tolerance) 
+    {
+        metrics->add(COUNTER_FRAMES_STILL);
+        return;
+    }
+
+    context.motionSignature = signature;
+    context.imageFrame = context.frameNumber;
+}
+
+/* Run the pipeline on the current frame of a context and get target data.
+ * This only touches the context, so the contexts of several cameras can be
+ * processed at the same time.
+ */ 
+void processFrame(PipelineContext &context) 
+{
+    if (context.src.empty()) return;
+
+    unsigned long targetsRun = context.stages[STAGE_TARGETS].output;
+
+    gateFrame(context);
+    processImage(context);
+    clock_gettime(CLOCK_MONOTONIC, &context.imageTime);
+    processContours(context);
+    clock_gettime(CLOCK_MONOTONIC, &context.detectTime);
+
+    /* Filter the grouped targets over time, see sendTargets(). A paused
+     * frame keeps its cached targets, which still keep the tracks alive. A
+     * frame that is processed again for a new setting is not measured twice.
+     */
+    if (context.captureTime.tv_sec != context.trackedTime.tv_sec || 
+        context.captureTime.tv_nsec != context.trackedTime.tv_nsec) 
+    {
+        context.trackedTime = context.captureTime;
+        context.tracker.update(context.targets, context.targetGroup, toSeconds(context.captureTime));
+    }
+
+    if (context.stages[STAGE_TARGETS].output == targetsRun) return;
+
+    // The windows are drawn later by showFrame(), if anybody is looking
+    context.generation++;
+
+    metrics->add(COUNTER_FRAMES_PROCESSED);
+    metrics->add(COUNTER_TARGETS, static_cast<uint64_t>(context.targets.count));
+    metrics->set(GAUGE_TARGETS, context.targets.count);
+    metrics->set(GAUGE_CONFIDENCE, context.targetGroup.confidence);
+}
+
+/* Time the steps that work on the target candidates of the frame of every
+ * camera with thread pools of 1, 2 and 4 threads, to see how they scale.
+ * The pipeline runs on a pool of its own, the shared one is left to the
+ * capture and the other cameras.
+ */ 
+void benchmarkCandidateStages() 
+{
+    static const int threadCounts[] = { 1, 2, 4 };
+    static const int iterations = 200;
+
+    for (size_t c = 0; c < pipelines->size(); c++) 
+    {
+        PipelineContext &context = *(*pipelines)[c];
+
+        processImage(context);
+        processContours(context);
+
+        printf("Camera %d: %d contours, %d targets, %d iterations\n", context.index, 
+               static_cast<int>(context.contours.size()), context.targets.count, iterations);
+
+        for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) 
+        {
+            ThreadPool threads(threadCounts[t]);
+            timespec start, end;
+
+            context.pool = &threads;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            for (int i = 0; i < iterations; i++) 
+            {
+                invalidateStage(context, STAGE_POLYGONS);
+                processContours(context);
+                drawWindow(context, WINDOW_FINAL);
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            context.pool = 0;
+
+            printf("%d threads: %.3f ms per frame\n", threadCounts[t], 
+                   toSeconds(diff(start, end)) * 1000 / iterations);
+        }
+    }
+}
+
+// Run an image kernel over and over, returns the ms it takes once
+static double timeKernel(int iterations, const function<void()> &kernel) 
+{
+    timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < iterations; i++) kernel();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return toSeconds(diff(start, end)) * 1000 / iterations;
+}
+
+static void printKernelTimes(const char *name, double generic, double specialized, 
+                             const Mat &genericOut, const Mat &specializedOut) 
+{
+    printf("  %-10s generic %7.3f ms  specialized %7.3f ms  %5.2fx  max difference %.0f\n", name, 
+           generic, specialized, generic / specialized, norm(genericOut, specializedOut, NORM_INF));
+}
+
+/* Time the generic and the specialized image kernels of every KernelSet on
+ * a whole frame on one thread, the frame scaled to the width of the set,
+ * and check that they give the same images.
+ */
+void benchmarkKernels(const Mat &frame) 
+{
+    static const int iterations = 200;
+
+    for (int k = 0; k < kernelSetCount(); k++) 
+    {
+        const KernelSet &kernels = kernelSet(k);
+        Mat src;
+
+        resize(frame, src, Size(kernels.cols, frame.rows * kernels.cols / frame.cols));
+
+        int radius = kernels.elementSize;
+        Mat element = getStructuringElement(MORPH_RECT, Size(2*radius + 1, 2*radius + 1), 
+                                            Point(radius, radius));
+        Mat color[2], blur[2], binary[2], closed[2];
+
+        for (int i = 0; i < 2; i++) 
+        {
+            color[i].create(src.size(), CV_8UC1);
+            blur[i].create(src.size(), CV_8UC1);
+            binary[i].create(src.size(), CV_8UC1);
+            closed[i].create(src.size(), CV_8UC1);
+        }
+
+        printf("%s, %dx%d:\n", kernels.name, src.cols, src.rows);
+
+        double generic = timeKernel(iterations, [&] 
+            { genericColor(src, color[0], kernels.bluePlane, kernels.greenPlane, kernels.redPlane); });
+        double specialized = timeKernel(iterations, [&] { kernels.color(src, color[1]); });
+        printKernelTimes("color", generic, specialized, color[0], color[1]);
+
+        // The fixed point weighting against the float one, off by at most 1
+        specialized = timeKernel(iterations, [&] { kernels.fixedColor(src, color[1]); });
+        printKernelTimes("fixed", generic, specialized, color[0], color[1]);
+
+        // The later kernels all start from the same image
+        generic = timeKernel(iterations, [&] { genericBlur(color[0], blur[0]); });
+        specialized = timeKernel(iterations, [&] { kernels.blur(color[0], blur[1]); });
+        printKernelTimes("blur", generic, specialized, blur[0], blur[1]);
+
+        generic = timeKernel(iterations, [&] { genericThreshold(blur[0], binary[0], thresh); });
+        specialized = timeKernel(iterations, [&] { kernels.threshold(blur[0], binary[1], thresh); });
+        printKernelTimes("threshold", generic, specialized, binary[0], binary[1]);
+
+        generic = timeKernel(iterations, [&] { genericClose(binary[0], closed[0], element); });
+        specialized = timeKernel(iterations, [&] { kernels.close(binary[0], closed[1]); });
+        printKernelTimes("close", generic, specialized, closed[0], closed[1]);
+    }
+}
+
+/* Merge the targets of every camera into one target and send it to the cRIO.
+ * Each camera's tracker is predicted to now, which is when the message goes
+ * out, to make up for the time the frame spent in the pipeline. A short
+ * detection gap still sends the predicted target. When more than one camera
+ * has a target, the one whose last group fit the backboard best wins.
+ */
+void sendTargets() 
+{
+    timespec sendTime;
+    clock_gettime(CLOCK_MONOTONIC, &sendTime);
+
+    PipelineContext *best = 0;
+    TargetData selected;
+
+    for (size_t i = 0; i < pipelines->size(); i++) 
+    {
+        PipelineContext &context = *(*pipelines)[i];
+        TargetData target;
+
+        context.sent = false;
+
+        if (!context.tracker.getSelected(toSeconds(sendTime), target)) continue;
+
+        if (!best || context.targetGroup.confidence > best->targetGroup.confidence) 
+        {
+            best = &context;
+            selected = target;
+        }
+    }
+
+    // If we have a target then send it to the cRio
+    if (best) 
+    {
+        // Marked in the final image by drawWindow()
+        best->sent = true;
+        best->sentCenter = Point( static_cast<int>(selected.centerX), 
+																	static_cast<int>(selected.centerY) );
+        
+        // Every frame goes in the target log, printing them all would hold up the loop
+        if (options->verbose_flag == 'v') 
+        {
+            printf("dist=%f angle=%f type=%s\n", selected.distanceY,
+                selected.angleX,
+	            getTargetTypeString(selected.targetType));
+        }
+#ifdef CRIO_NETWORK
+        float tension = convertDistanceToTension(selected.distanceY);
+        double age = toSeconds(diff(best->captureTime, sendTime));
+    
+        sendMessage(selected.distanceY, selected.angleX, tension, best->index, best->frameNumber, age);
+
+        /* The loop also sends when no new frame came in, with the same frame
+         * number. Only the first send of a frame is measured and remembered
+         * to match its echo, see receiveEchoes(), or the latency would count
+         * the time spent waiting for the next frame.
+         */
+        if (best->measuredFrame != best->frameNumber) 
+        {
+            best->measuredFrame = best->frameNumber;
+
+            SentFrame &sentFrame = sent_frames[sent_count++ % max_sent_frames];
+            sentFrame.camera = best->index;
+            sentFrame.frame = best->frameNumber;
+            sentFrame.captureTime = best->captureTime;
+            sentFrame.sendTime = sendTime;
+
+            telemetry->send.record(age);
+            metrics->observe(HISTOGRAM_SEND, age);
+        }
+#endif
+    }
+}
+
+// The pipeline image a window shows, or the canvas drawWindow() draws it into
+static Mat &windowImage(PipelineContext &context, int window) 
+{
+    switch (window) 
+    {
+        case WINDOW_SOURCE:         return sourceImage(context);
+        case WINDOW_COLOR:          return context.src_color;
+        case WINDOW_BLUR:           return context.src_blur;
+        case WINDOW_DILATE:         return context.src_dilate;
+        case WINDOW_THRESHOLD:      return context.threshold_output;
+        case WINDOW_CONTOURS:       return context.drawingContours;
+        case WINDOW_POLYGON:        return context.drawing;
+        case WINDOW_PRUNED_POLYGON: return context.prunedDrawing;
+        case WINDOW_TARGETS:        return context.targetsDrawing;
+        default:                    return context.finalDrawing;
+    }
+}
+
+/* Show the images of a context, this has to run on the GUI thread. Only the
+ * windows that are open and whose images changed since they were last shown
+ * are drawn, each by its own task.
+ */
+void showFrame(PipelineContext &context) 
+{
+    if (context.src.empty()) return;
+
+    TaskGroup group(*pool);
+    bool changed[WINDOW_COUNT];
+
+    for (int window = 0; window < WINDOW_COUNT; window++) 
+    {
+        changed[window] = false;
+
+        if (window != WINDOW_FINAL && !options->guiAll) continue;
+        if (!windowVisible(windowName(context, window_titles[window]))) continue;
+
+        bool stale = context.shownGeneration[window] != context.generation;
+
+        // The final image also marks the target that was sent
+        if (window == WINDOW_FINAL) 
+        {
+            stale = stale || context.sent != context.shownSent || 
+                    (context.sent && context.sentCenter != context.shownSentCenter) || 
+                    context.captureState != context.shownCaptureState;
+        }
+
+        if (!stale) continue;
+
+        changed[window] = true;
+
+        if (window >= WINDOW_CONTOURS) 
+        {
+            DebugWindow debugWindow = static_cast<DebugWindow>(window);
+            group.run([&context, debugWindow] { drawWindow(context, debugWindow); });
+        }
+    }
+
+    group.wait();
+
+    for (int window = 0; window < WINDOW_COUNT; window++) 
+    {
+        if (!changed[window]) continue;
+
+        imshow(windowName(context, window_titles[window]), windowImage(context, window));
+        context.shownGeneration[window] = context.generation;
+    }
+
+    context.shownSent = context.sent;
+    context.shownSentCenter = context.sentCenter;
+    context.shownCaptureState = context.captureState;
+
+    // The histogram only changes with the source image
+    if (options->guiAll && context.index == 0 && 
+        context.histogramGeneration != context.frameNumber && windowVisible("Histogram")) 
+    {
+        calcHistogram(sourceImage(context));
+        context.histogramGeneration = context.frameNumber;
+    }
+}
+
+/* Send the merged target and show the images of every camera. The targets go
+ * out with every frame, but the windows are redrawn at most every
+ * gui_refresh_interval however fast the frames come in.
+ */
+void finishFrames() 
+{
+    static double lastRefresh = 0;
+
+    // Each new frame counts once in the latency telemetry and the target log
+    for (size_t i = 0; i < pipelines->size(); i++) 
+    {
+        PipelineContext &context = *(*pipelines)[i];
+
+        if (context.recordedFrame == context.frameNumber || context.src.empty()) continue;
+
+        telemetry->detect.record(toSeconds(diff(context.captureTime, context.detectTime)));
+        metrics->observe(HISTOGRAM_DETECT, toSeconds(diff(context.captureTime, context.detectTime)));
+        targetLog->log(context.frameNumber, context.captureTime, context.detectTime, context.index, 
+                       context.targets, context.targetGroup);
+        context.recordedFrame = context.frameNumber;
+    }
+
+    sendTargets();
+    receiveEchoes();
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (options->latency && toSeconds(diff(telemetry->lastReport, now)) >= latency_report_interval) 
+    {
+        telemetry->report();
+    }
+
+    for (size_t i = 0; i < pipelines->size(); i++) 
+    {
+        streamFrame(*(*pipelines)[i], toSeconds(now));
+    }
+
+    if (toSeconds(now) - lastRefresh < gui_refresh_interval) return;
+
+    lastRefresh = toSeconds(now);
+
+    for (size_t i = 0; i < pipelines->size(); i++) 
+    {
+        showFrame(*(*pipelines)[i]);
+    }
+}
+
+/* This is called every time that a trackbar changes to process the current
+ * images again, get target data, and send the information to the cRIO.
+ * The cached stages before the one using the changed setting are kept.
+ */ 
+void processImageCallback(int, void* ) 
+{
+    updateClassifier();
+
+    TaskGroup group(*pool);
+
+    for (size_t i = 0; i < pipelines->size(); i++) 
+    {
+        PipelineContext *context = (*pipelines)[i];
+        group.run([context] { processFrame(*context); });
+    }
+
+    group.wait();
+    finishFrames();
+}
+
+// Insert the camera number into a file name for every camera but the first
+static string cameraFileName(const char *fileName, int camera) 
+{
+    string name(fileName);
+
+    if (camera > 0) 
+    {
+        ostringstream suffix;
+        suffix << "_" << camera;
+        name.insert(name.rfind('.'), suffix.str());
+    }
+
+    return name;
+}
+
+string getOutputVideoFileName(int camera) 
+{
+    char outputFileName[100];
+    time_t beginningTime;      // beginning time and end times
+    
+    tm *timeTm;
+    time(&beginningTime);      // start the clock
+    
+    timeTm = localtime(&beginningTime);
+    
+    strftime(outputFileName, sizeof(outputFileName)-1, "RobotVideo_%Y_%m_%d_%H_%M_%S.mjpg", timeTm);
+    
+    return cameraFileName(outputFileName, camera);
+}
+
+void writeImage(Mat &source, int camera) 
+{
+    char outputFileName[100];
+    time_t currentTime;
+    
+    tm *timeTm;
+    time(&currentTime);
+    timeTm = localtime(&currentTime);
+    
+    strftime(outputFileName, sizeof(outputFileName)-1, "RobotImage_%Y_%m_%d_%H_%M_%S.jpg", timeTm);
+    imwrite(cameraFileName(outputFileName, camera), source);
+}
+
+void computeFramesPerSec() 
+{
+    static bool first = true;
+    double fps, avgFps;             // fps calculated using number of frames / seconds
+    static int counter = 0;         // frame counter
+    double elapsed;                 // floating point seconds elapsed since start
+    static timespec beginningTs, currentTs, lastTs, printedTs;
+
+    if (first) 
+    {
+        clock_gettime(CLOCK_REALTIME, &beginningTs);
+        clock_gettime(CLOCK_REALTIME, &lastTs);
+        clock_gettime(CLOCK_REALTIME, &currentTs);
+        printedTs = beginningTs;
+    
+        first = false;
+    }
+
+    // see how much time has elapsed
+    clock_gettime(CLOCK_REALTIME, &currentTs);
+    
+    // calculate current FPS
+    ++counter;       
+    
+    elapsed = (currentTs.tv_nsec - beginningTs.tv_nsec) * 1e-9 + (currentTs.tv_sec - beginningTs.tv_sec); // 1e-9 is the epsilon or "close enough" factor     
+    avgFps = counter / elapsed;
+    elapsed = (currentTs.tv_nsec - lastTs.tv_nsec) * 1e-9 + (currentTs.tv_sec - lastTs.tv_sec);           // 1e-9 is the epsilon or "close enough" factor    
+    fps = 1 / elapsed;
+    metrics->set(GAUGE_FPS, fps);
+
+    // The gauge has the rate, printing it every loop would hold the loop up
+    if (options->verbose_flag == 'v' && toSeconds(diff(printedTs, currentTs)) >= fps_print_interval) 
+    {
+        printf("Avg FPS = %.2f. FPS = %.2f\n", avgFps, fps);
+        printedTs = currentTs;
+    }
+    
+    lastTs = currentTs;
+}
+
+// Is this the name of an image file batch mode should pick up from a directory?
+static bool isImageFile(const string &name) 
+{
+    static const char *extensions[] = { ".jpg", ".jpeg", ".png", ".bmp" };
+
+    string lower(name);
+
+    for (size_t i = 0; i < lower.size(); i++) 
+    {
+        lower[i] = static_cast<char>(tolower(static_cast<unsigned char>(lower[i])));
+    }
+
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) 
+    {
+        size_t length = strlen(extensions[i]);
+
+        if (lower.size() >= length && lower.compare(lower.size() - length, length, extensions[i]) == 0) return true;
+    }
+
+    return false;
+}
+
+// The images of a directory, or the files matching a glob pattern, sorted by name
+vector<string> findBatchImages(const char *input) 
+{
+    struct stat info;
+    bool directory = stat(input, &info) == 0 && S_ISDIR(info.st_mode);
+    string pattern(input);
+
+    if (directory) pattern += "/*";
+
+    vector<string> images;
+    glob_t matches;
+
+    if (glob(pattern.c_str(), 0, 0, &matches) == 0) 
+    {
+        for (size_t i = 0; i < matches.gl_pathc; i++) 
+        {
+            string name(matches.gl_pathv[i]);
+
+            if (!directory || isImageFile(name)) images.push_back(name);
+        }
+    }
+
+    globfree(&matches);
+    return images;
+}
+
+// Quote a string for JSON
+static string jsonString(const string &text) 
+{
+    string quoted("\"");
+
+    for (size_t i = 0; i < text.size(); i++) 
+    {
+        char c = text[i];
+
+        if (c == '"' || c == '\\') 
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) 
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else 
+        {
+            quoted += c;
+        }
+    }
+
+    return quoted + "\"";
+}
+
+// One line per target, an image without targets gets a line with an empty target
+void writeBatchCsv(FILE *file, const vector<BatchResult> &results) 
+{
+    fprintf(file, "file,target,type,centerX,centerY,sizeX,sizeY,distanceX,distanceY,angleX,"
+                  "x0,y0,x1,y1,x2,y2,x3,y3\n");
+
+    for (size_t i = 0; i < results.size(); i++) 
+    {
+        const BatchResult &result = results[i];
+
+        if (!result.loaded) continue;
+
+        if (result.targets.count == 0) 
+        {
+            fprintf(file, "%s,,,,,,,,,,,,,,,,,\n", result.fileName.c_str());
+            continue;
+        }
+
+        for (int t = 0; t < result.targets.count; t++) 
+        {
+            TargetData target = result.targets.get(t);
+
+            fprintf(file, "%s,%d,%s,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.3f", result.fileName.c_str(), t, 
+                    getTargetTypeString(target.targetType), target.centerX, target.centerY, 
+                    target.sizeX, target.sizeY, target.distanceX, target.distanceY, target.angleX);
+
+            for (int j = 0; j < 4; j++) 
+            {
+                fprintf(file, ",%.2f,%.2f", target.points[j].x, target.points[j].y);
+            }
+
+            fprintf(file, "\n");
+        }
+    }
+}
+
+// An array with an object per image holding its targets and group confidence
+void writeBatchJson(FILE *file, const vector<BatchResult> &results) 
+{
+    bool first = true;
+
+    fprintf(file, "[\n");
+
+    for (size_t i = 0; i < results.size(); i++) 
+    {
+        const BatchResult &result = results[i];
+
+        if (!result.loaded) continue;
+
+        fprintf(file, "%s  {\"file\": %s, \"confidence\": %.3f, \"targets\": [", first ? "" : ",\n", 
+                jsonString(result.fileName).c_str(), result.targetGroup.confidence);
+        first = false;
+
+        for (int t = 0; t < result.targets.count; t++) 
+        {
+            TargetData target = result.targets.get(t);
+
+            fprintf(file, "%s\n    {\"type\": \"%s\", \"center\": [%.2f, %.2f], \"size\": [%.2f, %.2f], "
+                          "\"distance\": [%.2f, %.2f], \"angle\": %.3f, \"quad\": [", 
+                    t ? "," : "", getTargetTypeString(target.targetType), target.centerX, target.centerY, 
+                    target.sizeX, target.sizeY, target.distanceX, target.distanceY, target.angleX);
+
+            for (int j = 0; j < 4; j++) 
+            {
+                fprintf(file, "%s[%.2f, %.2f]", j ? ", " : "", target.points[j].x, target.points[j].y);
+            }
+
+            fprintf(file, "]}");
+        }
+
+        fprintf(file, "%s]}", result.targets.count ? "\n  " : "");
+    }
+
+    fprintf(file, "\n]\n");
+}
+
+/* Process every image exactly once and keep the targets found in each.
+ * Every worker of the pool takes the next image until they are all done;
+ * the stages of an image spread over the pool as usual. Returns the time
+ * it took in seconds.
+ */
+double runBatch(const vector<string> &images, vector<BatchResult> &results) 
+{
+    atomic<size_t> nextImage(0);
+    timespec start, end;
+
+    results.assign(images.size(), BatchResult());
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    {
+        TaskGroup group(*pool);
+
+        for (int worker = 0; worker < pool->size(); worker++) 
+        {
+            group.run([&] 
+            {
+                for (size_t i = nextImage++; i < images.size(); i = nextImage++) 
+                {
+                    BatchResult &result = results[i];
+                    PipelineContext context;
+
+                    result.fileName = images[i];
+                    context.src = imread(images[i], 1);
+
+                    if (context.src.empty()) continue;
+
+                    context.frameNumber++;
+                    processImage(context);
+                    processContours(context);
+
+                    result.loaded = true;
+                    result.targets = context.targets;
+                    result.targetGroup = context.targetGroup;
+                }
+            });
+        }
+
+        group.wait();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return toSeconds(diff(start, end));
+}
+
+/* Process every image of --batch and write the targets found in each.
+ * Returns the exit code of the program.
+ */
+int processBatch() 
+{
+    vector<string> images = findBatchImages(options->batchInput);
+
+    if (images.empty()) 
+    {
+        printf("ERROR: no images found in %s\n", options->batchInput);
+        return -1;
+    }
+
+    // Keep the messages off stdout when the results go there
+    FILE *log = options->batchOutput ? stdout : stderr;
+
+    vector<BatchResult> results;
+    double seconds = runBatch(images, results);
+
+    int loaded = 0;
+    int targets = 0;
+
+    for (size_t i = 0; i < results.size(); i++) 
+    {
+        if (!results[i].loaded) 
+        {
+            fprintf(log, "Could not read %s\n", results[i].fileName.c_str());
+            continue;
+        }
+
+        loaded++;
+        targets += results[i].targets.count;
+    }
+
+    FILE *file = stdout;
+
+    if (options->batchOutput) 
+    {
+        file = fopen(options->batchOutput, "w");
+
+        if (!file) 
+        {
+            printf("ERROR: unable to write %s: %s\n", options->batchOutput, strerror(errno));
+            return -1;
+        }
+    }
+
+    string output(options->batchOutput ? options->batchOutput : "");
+
+    if (output.size() >= 5 && output.compare(output.size() - 5, 5, ".json") == 0) 
+    {
+        writeBatchJson(file, results);
+    }
+    else 
+    {
+        writeBatchCsv(file, results);
+    }
+
+    if (file != stdout) fclose(file);
+
+    fprintf(log, 
+            "%d images (%d unreadable), %d targets in %.3f s: %.1f images/s on %d threads\n", 
+            loaded, static_cast<int>(results.size()) - loaded, targets, seconds, 
+            seconds > 0 ? loaded / seconds : 0, pool->size());
+
+    return loaded ? 0 : -1;
+}
+
+// Split a line of a labels file at the commas, trimming the white space of each field
+static vector<string> splitFields(const char *line) 
+{
+    vector<string> fields;
+    string field;
+
+    for (const char *c = line; ; c++) 
+    {
+        if (*c == ',' || *c == '\0') 
+        {
+            size_t begin = field.find_first_not_of(" \t\r\n");
+            size_t end = field.find_last_not_of(" \t\r\n");
+
+            fields.push_back(begin == string::npos ? "" : field.substr(begin, end - begin + 1));
+            field.clear();
+
+            if (*c == '\0') break;
+        }
+        else 
+        {
+            field += *c;
+        }
+    }
+
+    return fields;
+}
+
+/* Read the labels file of --evaluate, see LabeledTarget. images gets every
+ * image named in the file once, in the order they first appear.
+ */
+bool readLabels(const char *fileName, vector<LabeledTarget> &labels, vector<string> &images) 
+{
+    FILE *file = fopen(fileName, "r");
+
+    if (!file) 
+    {
+        printf("ERROR: unable to read %s: %s\n", fileName, strerror(errno));
+        return false;
+    }
+
+    // The images are relative to the labels file
+    string directory(fileName);
+    size_t slash = directory.rfind('/');
+    directory = slash == string::npos ? "" : directory.substr(0, slash + 1);
+
+    char line[1024];
+    int lineNumber = 0;
+    bool ok = true;
+
+    while (fgets(line, sizeof(line), file)) 
+    {
+        lineNumber++;
+
+        vector<string> fields = splitFields(line);
+
+        if (fields[0].empty() || fields[0][0] == '#') continue;
+
+        string image = fields[0][0] == '/' ? fields[0] : directory + fields[0];
+
+        if (find(images.begin(), images.end(), image) == images.end()) images.push_back(image);
+
+        if (fields.size() == 1) continue;
+
+        if (fields.size() < 10) 
+        {
+            printf("ERROR: %s:%d: expected file,type,x0,y0,x1,y1,x2,y2,x3,y3[,distance]\n", 
+                   fileName, lineNumber);
+            ok = false;
+            continue;
+        }
+
+        LabeledTarget label;
+        label.fileName = image;
+        label.type = fields[1];
+
+        for (int j = 0; j < 4; j++) 
+        {
+            label.points[j] = Point2f(static_cast<float>(atof(fields[2 + 2*j].c_str())), 
+                                      static_cast<float>(atof(fields[3 + 2*j].c_str())));
+        }
+
+        label.distance = fields.size() > 10 ? static_cast<float>(atof(fields[10].c_str())) : 0;
+        labels.push_back(label);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+// Does a type found by the detector agree with a labeled type?
+static bool typeMatches(const string &label, TargetType targetType) 
+{
+    if (label == "Middle") 
+    {
+        return targetType == TARGET_HEIGHT_MIDDLE || 
+               targetType == TARGET_HEIGHT_MIDDLE_LEFT || 
+               targetType == TARGET_HEIGHT_MIDDLE_RIGHT;
+    }
+
+    return label == getTargetTypeString(targetType);
+}
+
+// The mean distance from each labeled corner to the closest corner found
+static float cornerError(const LabeledTarget &label, const TargetData &target) 
+{
+    float total = 0;
+
+    for (int j = 0; j < 4; j++) 
+    {
+        float closest = -1;
+
+        for (int k = 0; k < 4; k++) 
         {
-            targetQuads.push_back(prunedPoly[i]);
-            targetHulls.push_back(prunedHulls[i]);
-            targetContours.push_back(prunedContours[i]);
+            Point2f offset = label.points[j] - target.points[k];
+            float distance = sqrt(offset.x * offset.x + offset.y * offset.y);
+
+            if (closest < 0 || distance < closest) closest = distance;
         }
+
+        total += closest;
     }
 
-    //Refine corner locations
-    //  Size winSize(7,7);
-    //  Size zeroZone(-1,-1);
-    vector<vector<Point2f> > targetQuads2f(targetQuads.size());
-    vector<vector<Point> > targetQuads2fi(targetQuads.size());
-    vector<vector<Point> > rcontours(targetContours.size());
-    
-    for (size_t i=0; i < targetContours.size(); i++) 
+    return total / 4;
+}
+
+/* Run the detector over the labeled images of --evaluate and compare what
+ * it finds with the labels. A labeled target is found when a target's center
+ * is within half the labeled size of the labeled center. The speed is
+ * reported next to the accuracy so a faster pipeline can be checked to find
+ * the same targets. Returns 1 when the detector does worse than the eval_
+ * limits.
+ */
+int evaluateDetector() 
+{
+    vector<LabeledTarget> labels;
+    vector<string> images;
+
+    if (!readLabels(options->labelsFile, labels, images)) return -1;
+
+    if (images.empty()) 
     {
-        for (size_t j=0; j < targetContours[i].size(); j++) 
-        {
-            rcontours[i].push_back(targetContours[i][j]);
-        }
-        
-        reverse(rcontours[i].begin(), rcontours[i].end());
+        printf("ERROR: no images in %s\n", options->labelsFile);
+        return -1;
     }
 
-    refineCorners(targetQuads, rcontours, targetQuads2f, targetQuads2fi);
+    vector<BatchResult> results;
+    double seconds = runBatch(images, results);
 
-    vector<TargetData> targets;
-    getTargetData(*src, targetQuads2f, targets);
-    TargetGroup targetGroup;
-    getTargetGroup(*src, targets, targetGroup);
+    int unreadable = 0;
+    int found = 0;
+    int typeCorrect = 0;
+    int falseTargets = 0;
+    int distances = 0;
+    float totalCornerError = 0, maxCornerError = 0;
+    float totalDistanceError = 0, maxDistanceError = 0;
 
-    if (options->guiAll) 
+    for (size_t i = 0; i < results.size(); i++) 
     {
-        // Draw the contours in a window
-        Mat drawing = Mat::zeros( threshold_output->size(), CV_8UC3 );
-        
-        for( size_t i = 0; i< contours.size(); i++ ) 
-        {
-            Scalar color = Scalar( 255, 255, 255 );
-            drawContours( drawing, poly, static_cast<int>(i), color, 1, 8, 
-																								vector<Vec4i>(), 0, Point() );
-        }
-    
-        // Draw the pruned Poloygons in a window
-        Mat prunedDrawing = Mat::zeros( threshold_output->size(), CV_8UC3 );
-        
-        for (size_t i = 0; i < prunedPoly.size(); i++) 
+        const BatchResult &result = results[i];
+
+        if (!result.loaded) 
         {
-            Scalar color = Scalar( 255, 255, 255 );
-            drawContours(prunedDrawing, prunedPoly, static_cast<int>(i), 
-																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+            printf("Could not read %s\n", result.fileName.c_str());
+            unreadable++;
+            continue;
         }
-    
-        // Draw the targets
-        Mat targetsDrawing = Mat::zeros( threshold_output->size(), CV_8UC3 );
-        
-        for (size_t i=0; i < targetQuads.size(); i++) 
+
+        bool matched[max_targets] = { false };
+
+        for (size_t l = 0; l < labels.size(); l++) 
         {
-            Scalar color = Scalar( 64, 64, 64 );
-            drawContours(targetsDrawing, targetQuads, static_cast<int>(i), 
-																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+            const LabeledTarget &label = labels[l];
+
+            if (label.fileName != result.fileName) continue;
+
+            Point2f center(0, 0);
+            float left = label.points[0].x, right = left;
+            float top = label.points[0].y, bottom = top;
+
+            for (int j = 0; j < 4; j++) 
+            {
+                center.x += label.points[j].x / 4;
+                center.y += label.points[j].y / 4;
+                left = min(left, label.points[j].x);
+                right = max(right, label.points[j].x);
+                top = min(top, label.points[j].y);
+                bottom = max(bottom, label.points[j].y);
+            }
+
+            int best = -1;
+            float bestDistance = max(right - left, bottom - top) / 2;
+
+            for (int t = 0; t < result.targets.count; t++) 
+            {
+                if (matched[t]) continue;
+
+                float dx = result.targets.centerX[t] - center.x;
+                float dy = result.targets.centerY[t] - center.y;
+                float distance = sqrt(dx * dx + dy * dy);
+
+                if (distance < bestDistance) 
+                {
+                    best = t;
+                    bestDistance = distance;
+                }
+            }
+
+            if (best < 0) 
+            {
+                printf("%s: missed the %s target at (%.0f, %.0f)\n", result.fileName.c_str(), 
+                       label.type.c_str(), center.x, center.y);
+                continue;
+            }
+
+            matched[best] = true;
+            found++;
+
+            TargetData target = result.targets.get(best);
+            float error = cornerError(label, target);
+
+            totalCornerError += error;
+            maxCornerError = max(maxCornerError, error);
+
+            if (typeMatches(label.type, target.targetType)) 
+            {
+                typeCorrect++;
+            }
+            else 
+            {
+                printf("%s: the %s target was found as %s\n", result.fileName.c_str(), 
+                       label.type.c_str(), getTargetTypeString(target.targetType));
+            }
+
+            if (label.distance > 0) 
+            {
+                error = fabs(target.distanceY - label.distance);
+
+                totalDistanceError += error;
+                maxDistanceError = max(maxDistanceError, error);
+                distances++;
+            }
         }
-    
-        // Draw the targets
-        Mat targetsDrawing2fi = Mat::zeros( threshold_output->size(), CV_8UC3 );
-    
-        for (size_t i=0; i < targetQuads2fi.size(); i++) 
+
+        for (int t = 0; t < result.targets.count; t++) 
         {
-            Scalar color = Scalar( 255, 255, 255 );
-            drawContours(targetsDrawing, targetQuads2fi, static_cast<int>(i), 
-																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+            if (!matched[t]) falseTargets++;
         }
-    
-        imshow("Source", *src);
-        calcHistogram(*src);
-        imshow("Color", *src_color);
-        imshow("Blur", *src_blur);
-        imshow("Dilate", *src_dilate);
-        imshow("Threshold", *threshold_output);
-        imshow("Contours", *drawingContours);
-        imshow("Polygon", drawing );
-        imshow("PrunedPolygon", prunedDrawing);
-        imshow("Targets", targetsDrawing);
-  }
+    }
 
-    // Output the final image
-    static Mat* finalDrawing;
-    *finalDrawing = src->clone();
-    
-    for (size_t i=0; i < targetQuads.size(); i++) 
+    int labeled = static_cast<int>(labels.size());
+    int loaded = static_cast<int>(results.size()) - unreadable;
+    float foundRate = labeled ? static_cast<float>(found) / labeled : 1;
+    float typeRate = found ? static_cast<float>(typeCorrect) / found : 1;
+    float meanCornerError = found ? totalCornerError / found : 0;
+    float meanDistanceError = distances ? totalDistanceError / distances : 0;
+
+    printf("%d images (%d unreadable), %d labeled targets\n", loaded, unreadable, labeled);
+    printf("Found:          %d (%.1f%%), %d targets not labeled\n", found, foundRate * 100, falseTargets);
+    printf("Type correct:   %d (%.1f%%)\n", typeCorrect, typeRate * 100);
+    printf("Corner error:   mean %.2f px, max %.2f px\n", meanCornerError, maxCornerError);
+    printf("Distance error: mean %.1f in, max %.1f in over %d targets\n", 
+           meanDistanceError, maxDistanceError, distances);
+    printf("Speed:          %.1f images/s, %.2f ms per image on %d threads\n", 
+           seconds > 0 ? loaded / seconds : 0, loaded ? seconds * 1000 / loaded : 0, pool->size());
+
+    bool pass = unreadable == 0;
+
+    if (foundRate < eval_min_found) 
     {
-        Scalar color = Scalar( 64, 0, 0 );
-        drawContours(*finalDrawing, targetQuads, static_cast<int>(i), 
-																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+        printf("FAIL: found %.1f%% of the targets, at least %.1f%% expected\n", foundRate * 100, eval_min_found * 100);
+        pass = false;
     }
-    
-    for (size_t i=0; i < targetQuads2fi.size(); i++) 
+
+    if (typeRate < eval_min_type_correct) 
     {
-        Scalar color = Scalar( 255, 255, 255 );
-        drawContours(*finalDrawing, targetQuads2fi, static_cast<int>(i), 
-																		color, 1, 8, vector<Vec4i>(), 0, Point() );
+        printf("FAIL: %.1f%% of the types correct, at least %.1f%% expected\n", typeRate * 100, eval_min_type_correct * 100);
+        pass = false;
     }
-  
-    for (size_t i = 0; i < targets.size(); i++ )
+
+    if (meanCornerError > eval_max_corner_error) 
     {
-        Point center( static_cast<int>(targets[i].centerX), 
-											static_cast<int>(targets[i].centerY) );
-        Scalar color = Scalar( 255, 255, 255 );
-        circle( *finalDrawing, center, 10, color );
-#ifdef DEBUG_TEXT
-        Point textAlign( static_cast<int>(targets[i].centerX - 50), 
-													static_cast<int>(targets[i].centerY + 35) );
-        Point sizeAlign( static_cast<int>(targets[i].centerX - 50), 
-													static_cast<int>(targets[i].centerY + 50) );
-        Point distanceAlign( static_cast<int>(targets[i].centerX - 50), 
-															static_cast<int>(targets[i].centerY + 65) );
-        Point angleXAlign( static_cast<int>(targets[i].centerX - 50), 
-														static_cast<int>(targets[i].centerY + 80) );
-        Point typeTargetAlign( static_cast<int>(targets[i].centerX - 50), 
-																static_cast<int>(targets[i].centerY + 95) );
-        Point tensionAlign( static_cast<int>(targets[i].centerX - 50), 
-														static_cast<int>(targets[i].centerY + 110) );
-        
-        ostringstream text, size, distance, angle, typeTarget, tension;
-        
-        text << "Center: X: " << targets[i].centerX << " Y: " << targets[i].centerY;
-        distance << "Distance: X: " << targets[i].distanceX << " Y: " << targets[i].distanceY;
-        size << "Size: X: " << targets[i].sizeX << " Y: " << targets[i].sizeY;
-        angle << "Angle: X: " << targets[i].angleX;
-    
-        typeTarget << getTargetTypeString(targets[i].targetType);
-        
-        tension << "Tension: " << targets[i].tension;
-    
-        putText( *finalDrawing, text.str(), textAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-        putText( *finalDrawing, size.str(), sizeAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-        putText( *finalDrawing, distance.str(), distanceAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-        putText( *finalDrawing, angle.str(), angleXAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-        putText( *finalDrawing, typeTarget.str(), typeTargetAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-        putText( *finalDrawing, tension.str(), tensionAlign, CV_FONT_HERSHEY_PLAIN, .7, color );
-#endif  
+        printf("FAIL: mean corner error %.2f px, at most %.2f px expected\n", meanCornerError, eval_max_corner_error);
+        pass = false;
     }
-    
-    // If we have a target then send it to the cRio
-    if (static_cast<bool>(targetGroup.selected.valid)) 
+
+    if (meanDistanceError > eval_max_distance_error) 
     {
-        Point center( static_cast<int>(targetGroup.selected.centerX), 
-											static_cast<int>(targetGroup.selected.centerY) );
-        Scalar color = Scalar( 255, 0, 255 );
-        circle( *finalDrawing, center, 20, color );
-        
-        printf("dist=%f angle=%f type=%s\n", targetGroup.selected.distanceY,
-            targetGroup.selected.angleX,
-	        getTargetTypeString(targetGroup.selected.targetType));
-#ifdef CRIO_NETWORK
-        TargetData target;
-        
-        printf("dist=%f angle=%f type=%s\n", targetGroup.selected.distanceY,
-	        targetGroup.selected.angleX,
-	        getTargetTypeString(targetGroup.selected.targetType));
+        printf("FAIL: mean distance error %.1f in, at most %.1f in expected\n", meanDistanceError, eval_max_distance_error);
+        pass = false;
+    }
 
-        float tension = convertDistanceToTension(targetGroup.selected.distanceY);
-    
-        sendMessage(targetGroup.selected.distanceY, targetGroup.selected.angleX, tension);
-#endif
+    if (falseTargets > eval_max_false_targets) 
+    {
+        printf("FAIL: %d targets not labeled, at most %d expected\n", falseTargets, eval_max_false_targets);
+        pass = false;
     }
-  
-    imshow( "Final", *finalDrawing );
-	delete[] finalDrawing;
-	delete[] src_color;
-	delete[] planes;
-}
 
-string getOutputVideoFileName() 
-{
-    char outputFileName[100];
-    time_t beginningTime;      // beginning time and end times
-    
-    tm *timeTm;
-    time(&beginningTime);      // start the clock
-    
-    timeTm = localtime(&beginningTime);
-    
-    strftime(outputFileName, sizeof(outputFileName)-1, "RobotVideo_%Y_%m_%d_%H_%M_%S.mjpg", timeTm);
-    
-    return outputFileName;
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
 }
 
-void writeImage(Mat &source) 
+/* Time the pipeline on synthetic scenes with more and more decoy quads, to
+ * see how the candidate steps (rectContainsRect, refineCorners and
+ * getTargetGroup) scale with the number of quads. The scenes go straight
+ * into the pipeline without being encoded, and found is the fraction of the
+ * drawn targets that the pipeline found.
+ */
+int runSynthetic() 
 {
-    char outputFileName[100];
-    time_t currentTime;
-    
-    tm *timeTm;
-    time(&currentTime);
-    timeTm = localtime(&currentTime);
-    
-    strftime(outputFileName, sizeof(outputFileName)-1, "RobotImage_%Y_%m_%d_%H_%M_%S.jpg", timeTm);
-    imwrite(outputFileName, source);
-}
+    static const int decoyCounts[] = { 0, 2, 4, 8, 16, 28 };
+    int frames = options->syntheticFrames;
 
-void computeFramesPerSec() 
-{
-    static bool first = true;
-    double fps, avgFps;             // fps calculated using number of frames / seconds
-    static int counter = 0;         // frame counter
-    double elapsed;                 // floating point seconds elapsed since start
-    static timespec beginningTs, currentTs, lastTs;
+    if (frames <= 0) 
+    {
+        printf("ERROR: --synthetic needs a number of frames\n");
+        return -1;
+    }
 
-    if (first) 
+    /* The scenes without decoys can be written out with their labels, to be
+     * scored with --evaluate. The decoys are made to pass for targets.
+     */
+    FILE *labels = 0;
+    int saved = 0;
+
+    if (options->sceneDirectory) 
     {
-        clock_gettime(CLOCK_REALTIME, &beginningTs);
-        clock_gettime(CLOCK_REALTIME, &lastTs);
-        clock_gettime(CLOCK_REALTIME, &currentTs);
-    
-        first = false;
+        string labelsName = string(options->sceneDirectory) + "/labels.txt";
+
+        if (mkdir(options->sceneDirectory, 0777) < 0 && errno != EEXIST) 
+        {
+            printf("ERROR: unable to create %s: %s\n", options->sceneDirectory, strerror(errno));
+            return -1;
+        }
+
+        if (!(labels = fopen(labelsName.c_str(), "w"))) 
+        {
+            printf("ERROR: unable to write %s: %s\n", labelsName.c_str(), strerror(errno));
+            return -1;
+        }
+
+        fprintf(labels, "# The scenes of --synthetic %d without decoys, see SceneGenerator.hpp\n", frames);
     }
 
-    // see how much time has elapsed
-    clock_gettime(CLOCK_REALTIME, &currentTs);
-    
-    // calculate current FPS
-    ++counter;       
-    
-    elapsed = (currentTs.tv_nsec - beginningTs.tv_nsec) * 1e-9 + (currentTs.tv_sec - beginningTs.tv_sec); // 1e-9 is the epsilon or "close enough" factor     
-    avgFps = counter / elapsed;
-    elapsed = (currentTs.tv_nsec - lastTs.tv_nsec) * 1e-9 + (currentTs.tv_sec - lastTs.tv_sec);           // 1e-9 is the epsilon or "close enough" factor    
-    fps = 1 / elapsed;
-  // will print out Inf until sec is greater than 0
-  
-    printf("Avg FPS = %.2f. FPS = %.2f\n", avgFps, fps);
-    
-    lastTs = currentTs;
+    printf("%d frames per step on %d threads\n", frames, pool->size());
+    printf("decoys  quads  found  image ms  candidates ms  contains ms  grouping ms\n");
+
+    for (size_t d = 0; d < sizeof(decoyCounts) / sizeof(decoyCounts[0]); d++) 
+    {
+        double imageTime = 0, candidateTime = 0, containsTime = 0, groupTime = 0;
+        int quads = 0, drawn = 0, found = 0;
+
+        for (int f = 0; f < frames; f++) 
+        {
+            SceneSettings settings;
+            settings.decoys = decoyCounts[d];
+            settings.clutter = 20;
+            settings.offsetX = static_cast<float>((f % 3 - 1) * 40);
+            settings.perspective = 0.15f;
+            settings.roll = static_cast<float>((f % 5 - 2) * 3);
+            settings.gradient = 0.5f;
+            settings.blur = 1;
+            settings.noise = 4;
+            settings.seed = static_cast<unsigned>(f + 1);
+
+            PipelineContext context;
+            vector<SceneTarget> truth;
+
+            renderScene(settings, context.src, truth);
+            context.frameNumber++;
+
+            // Lossless, so the scene scores the same from the file
+            if (labels && decoyCounts[d] == 0) 
+            {
+                char imageName[32];
+                snprintf(imageName, sizeof(imageName), "scene_%03d.png", f);
+                imwrite(string(options->sceneDirectory) + "/" + imageName, context.src);
+
+                for (size_t t = 0; t < truth.size(); t++) 
+                {
+                    // The distance the fit of getTargetData() gives the true height of the target
+                    float distance = distance_y_table.exact(target_height_inches * truth[t].pixelsPerInch);
+
+                    fprintf(labels, "%s,%s", imageName, getTargetTypeString(truth[t].targetType));
+
+                    for (int j = 0; j < 4; j++) 
+                    {
+                        fprintf(labels, ",%.2f,%.2f", truth[t].points[j].x, truth[t].points[j].y);
+                    }
+
+                    fprintf(labels, ",%.1f\n", distance);
+                }
+
+                saved++;
+            }
+
+            timespec start, image, candidates, contains, grouping;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            processImage(context);
+            clock_gettime(CLOCK_MONOTONIC, &image);
+            processContours(context);
+            clock_gettime(CLOCK_MONOTONIC, &candidates);
+
+            int containing = 0;
+
+            for (size_t i = 0; i < context.prunedPoly.size(); i++) 
+            {
+                if (rectContainsRect(static_cast<int>(i), context.prunedPoly)) containing++;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &contains);
+
+            TargetBatch targets = context.targets;
+            TargetGroup targetGroup;
+            getTargetGroup(context.src.cols, targets, targetGroup);
+
+            clock_gettime(CLOCK_MONOTONIC, &grouping);
+
+            imageTime += toSeconds(diff(start, image));
+            candidateTime += toSeconds(diff(image, candidates));
+            containsTime += toSeconds(diff(candidates, contains));
+            groupTime += toSeconds(diff(contains, grouping));
+            quads += containing;
+
+            // A drawn target is found when a target is centered within a few pixels of it
+            for (size_t t = 0; t < truth.size(); t++) 
+            {
+                float centerX = 0, centerY = 0;
+
+                for (int j = 0; j < 4; j++) 
+                {
+                    centerX += truth[t].points[j].x / 4;
+                    centerY += truth[t].points[j].y / 4;
+                }
+
+                for (int i = 0; i < context.targets.count; i++) 
+                {
+                    float dx = context.targets.centerX[i] - centerX;
+                    float dy = context.targets.centerY[i] - centerY;
+
+                    if (dx * dx + dy * dy < 25) 
+                    {
+                        found++;
+                        break;
+                    }
+                }
+
+                drawn++;
+            }
+        }
+
+        printf("%6d  %5.1f  %4.0f%%  %8.3f  %13.3f  %11.3f  %11.3f\n", decoyCounts[d], 
+               static_cast<double>(quads) / frames, drawn ? 100.0 * found / drawn : 0.0, 
+               imageTime * 1000 / frames, candidateTime * 1000 / frames, 
+               containsTime * 1000 / frames, groupTime * 1000 / frames);
+    }
+
+    if (labels) 
+    {
+        fclose(labels);
+        printf("Wrote %d scenes and their labels to %s\n", saved, options->sceneDirectory);
+    }
+
+    return 0;
 }
 
 int main( int argc, char** argv ) 
 {
 	initObjs();
-    VideoCapture *cap = 0;
-    VideoWriter *record = 0;
 		bool loop;
   
-    // Process any OpenCV arguments
-    cvInitSystem(argc, argv);
     options->processArgs(argc, argv);
 
+    if (options->configFile && !config->load(options->configFile)) 
+    	{
+        	deleteObjs();
+        	return -1;
+    	}
+
+    updateClassifier();
+
+    if (options->batchInput) 
+    	{
+        	int result = processBatch();
+        	deleteObjs();
+        	return result;
+    	}
+
+    if (options->labelsFile) 
+    	{
+        	int result = evaluateDetector();
+        	deleteObjs();
+        	return result;
+    	}
+
+    if (options->syntheticFrames) 
+    	{
+        	int result = runSynthetic();
+        	deleteObjs();
+        	return result;
+    	}
+
+    /* Process any OpenCV arguments. The batch modes above never open a
+     * window, so they also run without a display (ctest on a build machine).
+     */
+    cvInitSystem(argc, argv);
+
     if (options->processCamera) 
     	{
-			if (options->processVideoFile) 
-				{
-					cap = new VideoCapture(options->fileName);
-				}  
-			else 
-				{
-					cap = new VideoCapture("http://10.17.68.9/axis-cgi/mjpg/video.cgi?resolution=320x240&req_fps=30&.mjpg"); 
-				}
-		
-			if(!cap || !cap->isOpened() ) // check if we succeeded
-				{       
-					printf("ERROR: unable to open camera\n");
-					delete[] src;
-					delete[] cap;
-					delete[] record;
-					return -1;
-				}
-		
-			*cap >> *src;
+				// Without any sources on the command line we use the robot's camera
+				if (options->sources.empty()) 
+					{
+						options->sources.push_back(default_camera_url);
+					}
+
+				// Every capture source gets its own pipeline
+				for (size_t i = 0; i < options->sources.size(); i++) 
+					{
+						PipelineContext *context = new PipelineContext();
+						context->index = static_cast<int>(i);
+						context->source = options->sources[i];
+						pipelines->push_back(context);
+
+						context->capture = new CaptureSource(context->source, *metrics);
+						context->capture->start();
 			
-			string outputFileName=getOutputVideoFileName();
-			record = new VideoWriter(outputFileName.c_str(), CV_FOURCC('M', 'J', 'P', 'G'), 30, src->size(), true);
+						// The first frame gives the size of the recording
+						FrameLease frame;
+
+						if( !context->capture->take(frame, context->captureTime, capture_open_timeout) )
+							{       
+								printf("ERROR: unable to open camera %s\n", context->source.c_str());
+								deleteObjs();
+								return -1;
+							}
+			
+						acceptFrame(*context, frame);
 			
-			if (!record->isOpened()) 
-				{
-					printf("VideoWriter failed to open!\n");
-					delete[] src;
-					delete[] cap;
-					delete[] record;
-					return -1;
-				}
+						string outputFileName=getOutputVideoFileName(context->index);
+						context->record = new VideoWriter(outputFileName.c_str(), CV_FOURCC('M', 'J', 'P', 'G'), 30, context->src.size(), true);
+			
+						if (!context->record->isOpened()) 
+							{
+								printf("VideoWriter failed to open!\n");
+								deleteObjs();
+								return -1;
+							}
+					}
     	} 
     else 
     	{
         	// Load an image from a file
-        	*src = imread(options->fileName, 1 );
+        	PipelineContext *context = new PipelineContext();
+        	context->src = imread(options->fileName, 1 );
+        	context->frameNumber++;
+        	pipelines->push_back(context);
+    	}
+
+    if (options->benchmark) 
+    	{
+        	benchmarkCandidateStages();
+        	benchmarkKernels(sourceImage(*(*pipelines)[0]));
+        	deleteObjs();
+        	return 0;
+    	}
+
+    if (options->logFile && !targetLog->open(options->logFile)) 
+    	{
+        	deleteObjs();
+        	return -1;
+    	}
+
+    if (options->metricsPort && !metrics->serve(options->metricsPort)) 
+    	{
+        	deleteObjs();
+        	return -1;
+    	}
+
+    if (options->shareFrames) 
+    	{
+        	for (size_t i = 0; i < pipelines->size(); i++) 
+        		{
+								openFrameRing(*(*pipelines)[i]);
+        		}
+    	}
+
+    if (options->streamPort) 
+    	{
+        	for (size_t i = 0; i < pipelines->size(); i++) 
+        		{
+								PipelineContext *context = (*pipelines)[i];
+
+								context->stream = new MjpegStreamer(*metrics);
+
+								if (!context->stream->serve(options->streamPort + context->index)) 
+									{
+										deleteObjs();
+										return -1;
+									}
+        		}
     	}
 
     createGuiWindows();
@@ -1106,30 +2728,64 @@ int main( int argc, char** argv )
 
         clock_gettime(CLOCK_REALTIME, &time1);
         
-        if (options->processCamera) 
+        /* Grab and process the frame of every camera as a task on the
+         * shared pool, so the cameras share the cores between them.
+         */
+        TaskGroup group(*pool);
+
+        for (size_t i = 0; i < pipelines->size(); i++) 
         	{
-						if (!pause_image) 
-							{
-								/* If there are more images to process then process them else
-								 * return.  This will be the case when processing an image file.
-								 */ 
-								if ( !cap->grab() )
-									{
-										loop = false;
-									}
-					
-								if ( !cap->retrieve(*src) ) 
-									{
-										loop = false;
-									}
-							}
+							PipelineContext *context = (*pipelines)[i];
+
+							group.run([context] 
+								{
+									bool fresh = true;
+
+									if (options->processCamera && !pause_image) 
+										{
+											// Without a new frame the tracker coasts, see sendTargets()
+											fresh = context->ok && grabFrame(*context);
+										}
+									else 
+										{
+											// A still image or a paused frame is as new as the time we look at it
+											clock_gettime(CLOCK_MONOTONIC, &context->captureTime);
+										}
+
+									if (context->ok && fresh) 
+										{
+											processFrame(*context);
+											publishFrame(*context);
+										}
+								});
+        	}
+
+        group.wait();
+
+        // Keep going until every source is out of frames
+        int cameras = 0;
+
+        for (size_t i = 0; i < pipelines->size(); i++) 
+        	{
+							if ((*pipelines)[i]->ok) cameras++;
         	}
+
+        loop = cameras > 0;
+        metrics->set(GAUGE_CAMERAS, cameras);
     
         clock_gettime(CLOCK_REALTIME, &time2);
 
-        processImageCallback( 0, 0 );
+        finishFrames();
         clock_gettime(CLOCK_REALTIME, &time3);
 
+        // No frame is in the pipeline now, so new settings apply to whole frames
+        if (options->configFile) 
+        	{
+            	timespec now;
+            	clock_gettime(CLOCK_MONOTONIC, &now);
+            	if (config->reload(toSeconds(now))) updateClassifier();
+        	}
+
         char c = 0;
 
         if (options->processCamera) 
@@ -1153,17 +2809,20 @@ int main( int argc, char** argv )
     
         if (c == 'p') pause_image = !pause_image;
     
-        if (c == 'w') writeImage(*src);
+        if (c == 'w') 
+        	{
+							for (size_t i = 0; i < pipelines->size(); i++) 
+								{
+									writeImage(sourceImage(*(*pipelines)[i]), (*pipelines)[i]->index);
+								}
+        	}
     
         clock_gettime(CLOCK_REALTIME, &time5);
     
         computeFramesPerSec();
   }
   
-	delete[] src;
-	delete[] cap;
-	delete[] record;
-	delete[] options;
+	deleteObjs();
 	return 0;
 }
 
@@ -68,7 +68,25 @@
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
 
+#include "Target.hpp"
+#include "Grouping.hpp"
+#include "Tracker.hpp"
+#include "ThreadPool.hpp"
+#include "BandParallel.hpp"
+#include "SceneGenerator.hpp"
+#include "Telemetry.hpp"
+#include "FrameRing.hpp"
+#include "TargetLog.hpp"
+#include "Metrics.hpp"
+#include "ConfigFile.hpp"
+#include "Kernels.hpp"
+#include "ColorClassifier.hpp"
+#include "PowerTable.hpp"
+#include "Capture.hpp"
+#include "MjpegStream.hpp"
+
 #include <string>
+#include <vector>
 #include <cstdio>
 #include <getopt.h>
 
@@ -78,11 +96,25 @@
 #define CRIO_NETWORK               // Normal case
 //#define WPI_IMAGES               // For debugging with WPI images
 
+// Where the target messages go, change with --crio
+static const char *default_crio_address = "10.17.68.2:9999";
+
+static constexpr int max_sent_frames = 64;   // Sent messages remembered to match their echoes
+
+// The robot's camera, used when no capture source is given on the command line
+static const char *default_camera_url = "http://10.17.68.9/axis-cgi/mjpg/video.cgi?resolution=320x240&req_fps=30&.mjpg";
+
 // Image Color Plane definitions
 static int BLUE_PLANE  = 0;
 static int GREEN_PLANE = 1;
 static int RED_PLANE   = 2;
 
+// The plane settings as one number, to key the cached color stage on
+static inline int planeOrder()
+{
+    return BLUE_PLANE * 9 + GREEN_PLANE * 3 + RED_PLANE;
+}
+
 
 static bool pause_image = false;
 static int thresh = 130;                   // Defines the threshold level to apply to image
@@ -103,68 +135,294 @@ static int max_kernel_size = 21;     // Max trackbar kernel dialation size
 static int erode_count = 1;                // The number of times to erode the image
 static int erode_max = 20;                 // Max number of times to erode on trackbar
 
-static constexpr int target_width_inches = 24;       // Width of a physical target in inches
-static constexpr int target_height_inches = 16;      // Height of a physical target in inches
-
-// A Target height enumerated type
-typedef enum {
-  TARGET_HEIGHT_UNKNOWN,
-  TARGET_HEIGHT_HIGH,
-  TARGET_HEIGHT_MIDDLE,
-  TARGET_HEIGHT_MIDDLE_RIGHT,
-  TARGET_HEIGHT_MIDDLE_LEFT,
-  TARGET_HEIGHT_LOW,
-  TARGET_HEIGHT_MIDDLE_COMBINED
-} TargetType;
-
-// Struct containing information about the vision targets
-struct TargetData 
+// The lookup table color classifier, used in place of the weighting and threshold when color_lut is 1
+static int color_lut = 0;
+static int lut_hue_min = 50;               // Hue range of the targets, 0 to 180
+static int lut_hue_max = 90;
+static int lut_saturation_min = 100;       // Glare is bright but not saturated
+static int lut_value_min = 80;
+static int max_hue = 180;                  // Max hue for the trackbar
+
+// Weigh the colors in fixed point and read the distances from tables, for coprocessors with a weak FPU
+static int fixed_point = 0;
+
+/* The motion gate, see gateFrame(). A frame that differs from the last one
+ * the pipeline ran on by at most motion_tolerance gray levels in every cell
+ * of its signature keeps the last targets, for up to motion_refresh frames.
+ */
+static int motion_tolerance = 4;
+static int motion_refresh = 10;            // 0 turns the gate off
+static int max_motion_refresh = 300;
+static constexpr int motion_signature_cols = 32;     // Size of the downsampled frame compared
+static constexpr int motion_signature_rows = 24;
+
+// The MJPEG stream of the final image, see --stream and streamFrame()
+static int stream_quality = 70;            // JPEG quality, 0 to 100
+static int stream_fps = 10;                // Frames a second at most
+static int max_stream_fps = 30;
+
+static constexpr int parallel_min_contours = 64;     // Fewer contours than this are processed on one thread
+static constexpr int parallel_min_candidates = 4;    // Fewer target quads than this are refined on one thread
+
+// The text next to each target in the final image, see drawTargetLabel()
+static constexpr int label_lines = 6;
+static constexpr int label_chars = 48;
+static constexpr int label_width = 240;              // Pixels of the layer the text is drawn into
+static constexpr int label_line_height = 15;
+static constexpr int label_ascent = 10;              // Above the first baseline
+
+static constexpr double gui_refresh_interval = 0.1;  // Seconds between redraws of the windows (10 Hz)
+static constexpr double fps_print_interval = 1;      // Seconds between the frame rates printed with --verbose
+static constexpr double capture_wait = 0.02;         // Seconds to wait for a frame, short so a dead camera holds up nobody
+
+// The windows of a camera, only the final window is shown without --guiAll
+enum DebugWindow 
+{
+    WINDOW_SOURCE,
+    WINDOW_COLOR,
+    WINDOW_BLUR,
+    WINDOW_DILATE,
+    WINDOW_THRESHOLD,
+    WINDOW_CONTOURS,
+    WINDOW_POLYGON,
+    WINDOW_PRUNED_POLYGON,
+    WINDOW_TARGETS,
+    WINDOW_FINAL,
+    WINDOW_COUNT
+};
+
+/* The stages of the pipeline, each one works on the output of the one before.
+ * Their results are cached so that changing a setting only runs the stages
+ * from the one that uses the setting on.
+ */
+enum PipelineStage 
+{
+    STAGE_COLOR,                        // Weighs or classifies the colors, planeOrder(), color_lut, the table or fixed_point
+    STAGE_BLUR,
+    STAGE_THRESHOLD,                    // thresh
+    STAGE_CLOSE,                        // dilation_elem, dilation_size, color_lut
+    STAGE_CONTOURS,
+    STAGE_POLYGONS,                     // poly_epsilon
+    STAGE_TARGETS,                      // minsize, fixed_point (the distance tables)
+    STAGE_COUNT
+};
+
+static_assert(HISTOGRAM_STAGE_TARGETS - HISTOGRAM_STAGE_COLOR == STAGE_TARGETS,
+              "The stage histograms must be in the order of the stages");
+
+/* The text of a target drawn once into a mask and stamped onto the final
+ * image from then on, until the text at its display precision changes
+ */
+struct TargetLabel 
+{
+    TargetLabel() 
+    {
+        for (int i = 0; i < label_lines; i++) lines[i][0] = 0;
+    }
+
+    char lines[label_lines][label_chars];
+    cv::Mat layer;                      // CV_8UC1, 255 where the text is
+};
+
+static constexpr int max_stage_params = 3;
+
+/* The key of the cached result of a stage. The result is good as long as the
+ * input and the settings are the same. output counts the runs of the stage,
+ * which is the input of the next stage.
+ */
+struct StageCache 
 {
-    TargetData() 
+    StageCache(): 
+        valid(false), 
+        input(0), 
+        output(0) 
     {
-        centerX = 0;
-        centerY = 0;
-        sizeX = 0;
-        sizeY = 0;
-        distanceX = 0;
-        distanceY = 0;
-        angleX = 0;
-        tension = 0;
-        targetType = TARGET_HEIGHT_UNKNOWN;
-        valid = 0;
+        for (int i = 0; i < max_stage_params; i++) params[i] = 0;
     }
-    
-		std::vector<cv::Point2f> points;
-
-    float centerX;
-    float centerY;
-    float sizeX;
-    float sizeY;
-    float distanceX;
-    float distanceY;
-    float angleX;
-    float tension;
-    
-    TargetType targetType;
-    
-    float valid;
+
+    bool valid;
+    unsigned long input;
+    int params[max_stage_params];
+    unsigned long output;
 };
 
-// Struct containing target groups based on location of target
-struct TargetGroup 
+/* Everything the pipeline needs for one capture source. Every camera gets
+ * its own context so the cameras can be processed at the same time.
+ */
+struct PipelineContext 
 {
-    TargetData high;
-    TargetData middleLeft;
-    TargetData middleRight;
-    TargetData low;
-    TargetData selected;
+    PipelineContext(): 
+        index(0), 
+        ok(true), 
+        pool(0), 
+        capture(0), 
+        captureState(CAPTURE_STREAMING), 
+        shownCaptureState(CAPTURE_STREAMING), 
+        record(0), 
+        ring(0), 
+        stream(0), 
+        sourceFrame(0), 
+        recordedFrame(0), 
+        frameNumber(0), 
+        imageFrame(0), 
+        generation(0), 
+        histogramGeneration(0), 
+        sent(false), 
+        measuredFrame(0), 
+        shownSent(false), 
+        elementShape(-1), 
+        elementSize(-1) 
+    {
+        captureTime.tv_sec = 0;
+        captureTime.tv_nsec = 0;
+        imageTime = captureTime;
+        detectTime = captureTime;
+
+        // Never a capture time, so the first frame is tracked
+        trackedTime.tv_sec = -1;
+        trackedTime.tv_nsec = 0;
+
+        for (int i = 0; i < WINDOW_COUNT; i++) shownGeneration[i] = 0;
+    }
+
+    ~PipelineContext() 
+    {
+        delete capture;
+        delete record;
+        delete ring;
+        delete stream;
+    }
+
+    int index;                          // The camera number, used in window and file names
+    bool ok;                            // False once the source is out of frames
+    std::string source;                 // The URL or file name of the source
+    ThreadPool *pool;                   // Runs the parallel steps, 0 for the shared pool, see pipelinePool()
+    CaptureSource *capture;
+    CaptureState captureState;          // Whether the camera is sending frames, see grabFrame()
+    CaptureState shownCaptureState;
+    cv::VideoWriter *record;
+    FrameRingWriter *ring;              // Shares the frames with other processes, see --shareFrames
+    MjpegStreamer *stream;              // Serves the final image, see --stream
+
+    cv::Mat src;                        // The source image matrix
+    FrameLease frame;                   // The captured frame src is made from, see acceptFrame()
+    cv::Mat yuv;                        // The frame when it is YUV, src is then converted on demand
+    unsigned long sourceFrame;          // The frame src holds, see sourceImage()
+
+    /* When src was captured and when the pipeline finished with it, all
+     * CLOCK_MONOTONIC, see Telemetry.hpp
+     */
+    timespec captureTime;
+    timespec imageTime;                 // The image stages are done
+    timespec detectTime;                // The targets are found
+    unsigned long recordedFrame;        // The last frame in the latency telemetry
+    timespec trackedTime;               // The capture time the tracker was last fed, see processFrame()
+
+    // The images of each step of the pipeline
+    cv::Mat src_color;
+    cv::Mat src_blur;
+    cv::Mat threshold_output;
+    cv::Mat src_dilate;
+    cv::Mat temp;
+    cv::Mat finalDrawing;
+    std::vector<TargetLabel> labels;    // The text of each target in finalDrawing
+
+    // The debugging images shown with --guiAll
+    cv::Mat drawingContours;
+    cv::Mat drawing;
+    cv::Mat prunedDrawing;
+    cv::Mat targetsDrawing;
+
+    /* The windows are only redrawn when what they show has changed, which
+     * is tracked by counting the new frames and the runs of the pipeline.
+     */
+    unsigned long frameNumber;          // Sequence number of the frame in src, counts from 1
+    unsigned long imageFrame;           // The frame the image stages ran on last, see gateFrame()
+    cv::Mat motionSignature;            // The downsampled imageFrame
+    unsigned long generation;           // Counts the runs of the pipeline that found new targets
+    unsigned long histogramGeneration;  // The source frame the histogram shows
+    unsigned long shownGeneration[WINDOW_COUNT];
+
+    // The target sent to the cRIO from this camera, marked in the final image
+    bool sent;
+    cv::Point sentCenter;
+    unsigned long measuredFrame;        // The last frame whose send was measured, coasted sends are not
+    bool shownSent;
+    cv::Point shownSentCenter;
+
+    // The shapes found in the image
+    std::vector<std::vector<cv::Point> > contours;
+    std::vector<std::vector<cv::Point> > hulls;
+    std::vector<std::vector<cv::Point> > poly;
+    std::vector<std::vector<cv::Point> > prunedPoly;
+    std::vector<std::vector<cv::Point> > targetQuads;
+    std::vector<std::vector<cv::Point> > targetQuads2fi;
+
+    TargetBatch targets;
+    TargetGroup targetGroup;
+    TargetTracker tracker;              // Filters the targets of this camera over time
+
+    StageCache stages[STAGE_COUNT];
+
+    // The structuring element of the close, made again only when its settings change
+    cv::Mat element;
+    int elementShape;
+    int elementSize;
+
+private:
+    PipelineContext(const PipelineContext &);
+    PipelineContext &operator=(const PipelineContext &);
 };
 
+// What batch mode found in one still image
+struct BatchResult 
+{
+    BatchResult(): 
+        loaded(false) 
+    {
+    }
+
+    std::string fileName;
+    bool loaded;                        // False if the image could not be read
+    TargetBatch targets;
+    TargetGroup targetGroup;
+};
+
+/* A target labeled in an image for --evaluate, by hand or by --saveScenes.
+ * The labels file has a line per target:
+ *
+ *   file,type,x0,y0,x1,y1,x2,y2,x3,y3,distance
+ *
+ * type is a name from getTargetTypeString(), where "Middle" stands for either
+ * middle target. distance is in inches and may be left out or 0 when it is
+ * not known. A line with just the file name is an image without targets.
+ * Lines starting with # are comments, and file names are relative to the
+ * labels file.
+ */
+struct LabeledTarget 
+{
+    std::string fileName;
+    std::string type;
+    cv::Point2f points[4];
+    float distance;
+};
+
+// The evaluation fails when the detector does worse than any of these
+static constexpr float eval_min_found = 0.9f;              // Fraction of the labeled targets found
+static constexpr float eval_min_type_correct = 0.9f;       // Fraction of the found targets with the right type
+static constexpr float eval_max_corner_error = 3;          // Mean corner error in pixels
+static constexpr float eval_max_distance_error = 12;       // Mean distance error in inches
+static constexpr int eval_max_false_targets = 0;           // Targets found that are not labeled
+
 void initObjs();
+void deleteObjs();
 
 timespec diff(timespec start, timespec end);
+double toSeconds(timespec ts);
 void calcHistogram(cv::Mat &source);
 void createGuiWindows();
+std::string windowName(const PipelineContext &context, const char *name);
+bool windowVisible(const std::string &name);
 
 bool rectContainsRect(int polygon_pt, 
 											const std::vector<std::vector<cv::Point> >&prunedPoly);
@@ -175,34 +433,58 @@ float computeHighYOffset();
 const char *getTargetTypeString(TargetType targetType);
 bool approximateHeight(float value, float baseline);
 float convertDistanceToTension(float distance);
-void computeTargetType(TargetData &target);
-
-void getTargetsType(std::vector<TargetData> &targets, 
-										std::vector<int> &targetIndices, 
-										TargetType targetType); 
-
-void getTargetGroup(cv::Mat &image, std::vector<TargetData> &targets, 
-		TargetGroup &targetGroup);
+void computeTargetTypes(TargetBatch &targets);
 
 void computeFramesPerSec();
-void writeImage(cv::Mat &source);
-std::string getOutputVideoFileName();
-bool getBestTarget(std::vector<TargetData> &targets, TargetData &target);
+void writeImage(cv::Mat &source, int camera);
+std::string getOutputVideoFileName(int camera);
 
 void getTargetData(cv::Mat &image, 
 										const std::vector<std::vector<cv::Point2f> >&targetQuads, 
-										std::vector<TargetData> &targets);
+										TargetBatch &targets);
 
-void printTargets(std::vector<TargetData> &targets);
+void printTargets(TargetBatch &targets);
 
 void intersection(cv::Vec4f &line1Params, cv::Vec4f &line2Params, 
 																					cv::Point2f &targetQuads2f);
 
-void refineCorners(std::vector<std::vector<cv::Point> >&targetQuads,
+void refineCorners(ThreadPool &threads, 
+                   std::vector<std::vector<cv::Point> >&targetQuads,
             				std::vector<std::vector<cv::Point> >&targetHulls,
 		    						std::vector<std::vector<cv::Point2f> >&targetQuads2f,
 		    						std::vector<std::vector<cv::Point> >&targetQuads2fi);
-void sendMessage(float distance, float angle, float tension);
+void sendMessage(float distance, float angle, float tension, int camera, unsigned long frame, double age);
+void receiveEchoes();
+void openFrameRing(PipelineContext &context);
+void publishFrame(PipelineContext &context);
+void streamFrame(PipelineContext &context, double now);
+void closeCrioSocket();
+
+cv::Mat &sourceImage(PipelineContext &context);
+bool grabFrame(PipelineContext &context);
+bool stageStale(PipelineContext &context, PipelineStage stage, unsigned long input, 
+                int param0 = 0, int param1 = 0, int param2 = 0);
+void invalidateStage(PipelineContext &context, PipelineStage stage);
+void updateClassifier();
+void processImage(PipelineContext &context);
+void processContours(PipelineContext &context);
+void drawWindow(PipelineContext &context, DebugWindow window);
+void processFrame(PipelineContext &context);
+void benchmarkCandidateStages();
+void benchmarkKernels(const cv::Mat &frame);
+void sendTargets();
+void showFrame(PipelineContext &context);
+void finishFrames();
+
+std::vector<std::string> findBatchImages(const char *input);
+void writeBatchCsv(FILE *file, const std::vector<BatchResult> &results);
+void writeBatchJson(FILE *file, const std::vector<BatchResult> &results);
+double runBatch(const std::vector<std::string> &images, std::vector<BatchResult> &results);
+int processBatch();
+bool readLabels(const char *fileName, std::vector<LabeledTarget> &labels, 
+                std::vector<std::string> &images);
+int evaluateDetector();
+int runSynthetic();
 
 /* The command line options processing class
  * Processes command line options using getopt_long()
@@ -215,16 +497,44 @@ public:
 	int verbose_flag;
 	int processVideoFile;
 	int processJpegFile;
-	int pad_;
+	int benchmark;
 	char *fileName;
-	char pad[8];
+	char *batchInput;                   // Directory or glob of still images for batch mode
+	char *batchOutput;                  // Where batch mode writes the targets, .json or CSV
+	char *labelsFile;                   // The labeled images for --evaluate
+	int syntheticFrames;                // Frames per step of --synthetic
+	char *sceneDirectory;               // Where --synthetic writes its scenes and their labels
+	const char *crioAddress;            // host:port the target messages go to
+	int sendAge;                        // Add the camera, frame number and age to the messages
+	int latency;                        // Print the latency telemetry
+	int shareFrames;                    // Publish the frames in shared memory
+	char *logFile;                      // Binary target log of every frame
+	int metricsPort;                    // Serve the metrics on this UDP port, 0 for none
+	int streamPort;                     // Serve the final images as MJPEG from this TCP port on, 0 for none
+	char *configFile;                   // Tuning parameters, read again when it changes
+	std::vector<std::string> sources;   // Capture sources, URLs or video files
 
 	OptionsProcess(): 
 		processCamera(true), 
 		guiAll(false), 
+		verbose_flag(false),
 		processVideoFile(false),
 		processJpegFile(false),
-		fileName(0) 
+		benchmark(false),
+		fileName(0),
+		batchInput(0),
+		batchOutput(0),
+		labelsFile(0),
+		syntheticFrames(0),
+		sceneDirectory(0),
+		crioAddress(default_crio_address),
+		sendAge(false),
+		latency(false),
+		shareFrames(false),
+		logFile(0),
+		metricsPort(0),
+		streamPort(0),
+		configFile(0) 
 {
 	
 }
@@ -245,19 +555,34 @@ public:
 				{"verbose",     no_argument,       &verbose_flag, 'v'},     // The verbosity flag
 				{"guiAll",      no_argument,       &guiAll, 'g'},           // The debug flag showing all of the windows
 				{"brief",       no_argument,       &verbose_flag, 'b'},     // The anti-verbosity flag
+				{"benchmark",   no_argument,       &benchmark, 1},          // Time the candidate steps on 1, 2 and 4 threads
+				{"sendAge",     no_argument,       &sendAge, 1},            // Add the camera, frame number and age to the messages
+				{"latency",     no_argument,       &latency, 1},            // Print the latency from capture every few seconds
+				{"shareFrames", no_argument,       &shareFrames, 1},        // Publish the frames and targets in shared memory
 				
 				/* These options don't set a flag.
 				We distinguish them by their indices */
 				{"help",        no_argument,        0, 'h'},                // The help flag
 				{"wpiImages",   no_argument,        0, 'w'},                // The WPI image processing flag
 				{"file",        required_argument,  0, 'f'},                // The jpeg file loading flag
+				{"camera",      required_argument,  0, 'c'},                // A capture source, may be given more than once
+				{"batch",       required_argument,  0, 'B'},                // Process a directory or glob of stills once each
+				{"output",      required_argument,  0, 'o'},                // The batch mode results file
+				{"evaluate",    required_argument,  0, 'E'},                // Score the detector against labeled images
+				{"synthetic",   required_argument,  0, 'S'},                // Time the stages on synthetic scenes
+				{"saveScenes",  required_argument,  0, 'R'},                // Write the synthetic scenes with labels for --evaluate
+				{"crio",        required_argument,  0, 'C'},                // Where the target messages go
+				{"log",         required_argument,  0, 'L'},                // Log the targets of every frame
+				{"metrics",     required_argument,  0, 'M'},                // Serve the live metrics on a UDP port
+				{"stream",      required_argument,  0, 'J'},                // Serve the final images as MJPEG over HTTP
+				{"config",      required_argument,  0, 'P'},                // Read the tuning parameters from a file
 				{0, 0, 0, 0}                                                // The default, no options flag
 			};
 
 			/* getopt_long stores the option index here. */
 			int option_index = 0;
 
-			get_longOptions = getopt_long (argc, argv, "f:h", long_options, &option_index);
+			get_longOptions = getopt_long (argc, argv, "c:f:ho:", long_options, &option_index);
 
 			/* Detect the end of the options. */
 			if (get_longOptions == -1) break;
@@ -303,8 +628,57 @@ public:
 					
 					// File name is equal to the file name inputted 
 					fileName = optarg;
+
+					if (processVideoFile) sources.push_back(optarg);
 					break;
 				}
+
+				case 'c':
+					// Add a camera URL or video file to process along with the others
+					processJpegFile = false;
+					processCamera = true;
+					sources.push_back(optarg);
+					break;
+
+				case 'B':
+					batchInput = optarg;
+					break;
+
+				case 'o':
+					batchOutput = optarg;
+					break;
+
+				case 'E':
+					labelsFile = optarg;
+					break;
+
+				case 'S':
+					syntheticFrames = atoi(optarg);
+					break;
+
+				case 'R':
+					sceneDirectory = optarg;
+					break;
+
+				case 'C':
+					crioAddress = optarg;
+					break;
+
+				case 'L':
+					logFile = optarg;
+					break;
+
+				case 'M':
+					metricsPort = atoi(optarg);
+					break;
+
+				case 'J':
+					streamPort = atoi(optarg);
+					break;
+
+				case 'P':
+					configFile = optarg;
+					break;
 				
 				case 'w':
 					// Flop the green and red planes
@@ -318,8 +692,24 @@ public:
 					printf("Usage: ./Vision\n"); 
 					printf("[-h|--help]:\tPrint this message\n");
 					printf("[--guiAll]:\tDisplay all debugging windows\n");
+					printf("[--benchmark]:\tTime the target candidate steps of the first frame of every camera on 1, 2 and 4 threads,\n\t\tand the generic against the specialized image kernels\n");
 					printf("[-w|--wpiImages]:\tProcess WPI type images (red targets)\n");
 					printf("[-f|--file] filename : Process a mjpg video or jpeg image\n");
+					printf("[-c|--camera] source : Process a camera URL or video file, repeat for more cameras.\n\t\tfake:file plays a file as a camera that stalls and disconnects,\n\t\tv4l2:/dev/videoN reads a USB camera, v4l2mock:file raw YUYV frames as one\n");
+					printf("[--batch] directory|glob : Process every still image once and print the throughput\n");
+					printf("[-o|--output] file : Write the batch mode targets to a .json file, CSV otherwise (default stdout)\n");
+					printf("[--evaluate] labels : Score accuracy and speed against labeled images, exit 1 if worse than the limits\n");
+					printf("[--synthetic] frames : Time the stages on synthetic scenes with more and more decoy targets\n");
+					printf("[--saveScenes] directory : Write the --synthetic scenes without decoys there, with a labels.txt for --evaluate\n");
+					printf("[--crio] host:port : Send the target messages here (default %s)\n", default_crio_address);
+					printf("[--sendAge]:\tAdd the camera, the frame number and its age in ms to the target messages\n");
+					printf("[--latency]:\tPrint the latency from capture to detect, send and echo every few seconds\n");
+					printf("[--shareFrames]:\tPublish every frame and its targets in shared memory (/vision-frames)\n");
+					printf("[--log] file : Log the targets of every frame to a binary file, see target_log_csv\n");
+					printf("[--metrics] port : Answer UDP requests on 127.0.0.1:port with the live metrics\n");
+					printf("[--stream] port : Serve the final image of camera n as MJPEG on http://host:port+n/,\n\t\tstream_quality and stream_fps set the quality and rate\n");
+					printf("[--config] file : Read the tuning parameters from \"name = value\" lines, again whenever it is saved\n");
+					printf("[--verbose]:\tPrint the target sent with every frame\n");
 					
 					exit(0);
 
@@ -335,7 +725,13 @@ public:
 };
 
 
-static cv::Mat* src;              // The source image matrix
 static OptionsProcess* options;
+static std::vector<PipelineContext*>* pipelines;    // One pipeline per capture source
+static ThreadPool* pool;                            // Shared by every camera and stage
+static LatencyTelemetry* telemetry;
+static TargetLogWriter* targetLog;
+static MetricsRegistry* metrics;
+static ConfigFile* config;
+static ColorClassifier* classifier;                 // Built from the lut_ settings by updateClassifier()
 
 // vim:set ts=2 sw=2 bs=2: